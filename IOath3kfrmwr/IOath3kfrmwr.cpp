@@ -9,20 +9,54 @@
  */
 #include <IOKit/IOLib.h>
 #include <IOKit/IOMessage.h>
+#include <IOKit/IOSubMemoryDescriptor.h>
+#include <kern/clock.h>
+#include <kern/thread_call.h>
+#include <libkern/OSKextLib.h>
 
 #include <IOKit/usb/IOUSBDevice.h>
 #include <IOKit/usb/IOUSBInterface.h>
 #include <IOKit/usb/USB.h>
 
 #include "IOath3kfrmwr.h"
+#include "ath3k-engine-body.h"
+
+//ATH3K_COMPRESSED_FIRMWARE=1 builds the kext with the LZ4 packed image from tools/fwpack.py,
+//which is expanded once into the image cache by the first upload
 #include "ath3k-1fw.h"
 
 OSDefineMetaClassAndStructors(local_IOath3kfrmwr, IOService)
 #define super IOService
 
-#define USB_REQ_DFU_DNLOAD	1
-#define CONTROL_PACKET_SIZE 20
-#define BULK_SIZE	4096
+//chunk sizes tuned by the engine we remember for later attaches
+#define TUNED_ENTRIES_MAX   8
+
+//device models whose endpoint table we keep
+#define ENDPOINT_TABLES_MAX 8
+
+//ATH3K_EXTERNAL_FIRMWARE=1 builds the kext without the image, which is then read from
+//the kext resources on first use and dropped again when the last upload is done
+#define FIRMWARE_RESOURCE_NAME      "ath3k-1fw.bin"
+#define FIRMWARE_LOAD_TIMEOUT_MS    30000
+
+//how long the image stays in the cache after the last upload, see FirmwareCacheIdleMs
+#define FIRMWARE_CACHE_IDLE_DEFAULT 60000
+
+#define CONCURRENT_UPLOADS_DEFAULT  4
+
+//a device in the boot ROM may not know GETSTATE at all, so we do not wait long for it
+#define PROBE_STATE_TIMEOUT_MS      500
+
+//staging buffers the uploads of all devices share. UHCI, OHCI and EHCI controllers only
+//reach the low 4 GB, so the buffers are allocated there and never need bouncing
+#define BUFFER_POOL_ENTRIES         16
+#define BUFFER_POOL_PHYSICAL_MASK   0x00000000FFFFFFFFULL
+
+//what every upload is checked against on its way out, the CRC alone or with the SHA-256 as
+//well if UploadVerifySha256 is set in the personality
+static const UInt8 g_aFirmwareSha256[ATH3K_SHA256_SIZE] = { ATH3K_FIRMWARE_SHA256_BYTES };
+static const Ath3kImageDigest g_digestFirmwareCrc32 = { ATH3K_FIRMWARE_CRC32, NULL };
+static const Ath3kImageDigest g_digestFirmwareSha256 = { ATH3K_FIRMWARE_CRC32, g_aFirmwareSha256 };
 
 #if !defined(MIN)
 #define MIN(A,B)	({ __typeof__(A) __a = (A); __typeof__(B) __b = (B); __a < __b ? __a : __b; })
@@ -32,33 +66,659 @@ OSDefineMetaClassAndStructors(local_IOath3kfrmwr, IOService)
 #define MAX(A,B)	({ __typeof__(A) __a = (A); __typeof__(B) __b = (B); __a < __b ? __b : __a; })
 #endif
 
+//chunk sizes measured by the auto-tune on earlier attaches, one entry per VID/PID/bcdDevice
+struct TunedChunkSize
+{
+    UInt16 idVendor;
+    UInt16 idProduct;
+    UInt16 bcdDevice;
+    int iChunkSize;
+};
+
+//owns the lock protecting the class-wide state for as long as the kext is loaded
+static struct ClassLockHolder
+{
+    IOLock* pLock;
+    ClassLockHolder() { pLock = IOLockAlloc(); }
+    ~ClassLockHolder() { if (pLock != NULL) IOLockFree(pLock); }
+} g_lockClass;
+
+static TunedChunkSize g_aTunedChunkSizes[TUNED_ENTRIES_MAX];
+static int g_iTunedChunkSizes = 0;
+
+//the endpoints of each device model we have seen, parsed once from its configuration descriptor
+struct CachedEndpointTable
+{
+    UInt16 idVendor;
+    UInt16 idProduct;
+    UInt16 bcdDevice;
+    Ath3kEndpointTable table;
+};
+
+static CachedEndpointTable g_aEndpointTables[ENDPOINT_TABLES_MAX];
+static int g_iEndpointTables = 0;
+
+//the raw image the uploads send, shared read-only by all of them. the first upload loads it
+//from the kext resources, expands the packed one or takes the embedded one, and checks it
+//against the manifest. it stays until no upload used it for FirmwareCacheIdleMs
+struct FirmwareCache
+{
+    const unsigned char* pImage;
+    IOBufferMemoryDescriptor* pBuffer;      //holds pImage unless it is the embedded image
+    IOMemoryDescriptor* pDescriptor;        //pImage prepared for DMA by the first zero copy write
+    int iUsers;
+    bool bLoading;
+    IOReturn kLoadResult;
+    thread_call_t pThreadCallEvict;
+#if ATH3K_EXTERNAL_FIRMWARE
+    OSKextRequestTag requestTag;            //the request to kextd the load waits for
+#endif
+    
+    //uploads that found the image in the cache or had to wait for it, what is resident now,
+    //the most it ever was, and how often it was loaded and evicted
+    UInt32 uHits;
+    UInt32 uMisses;
+    UInt32 uResidentBytes;
+    UInt32 uResidentPeak;
+    UInt32 uLoads;
+    UInt32 uEvictions;
+    
+    ~FirmwareCache()
+    {
+        if (pThreadCallEvict != NULL)
+        {
+            thread_call_cancel(pThreadCallEvict);
+            thread_call_free(pThreadCallEvict);
+        }
+        if (pDescriptor != NULL)
+        {
+            pDescriptor->complete();
+            pDescriptor->release();
+        }
+        if (pBuffer != NULL) pBuffer->release();
+    }
+};
+
+static FirmwareCache g_firmwareCache;
+
+//uploads of all attached devices go through one loader that runs at most
+//MaxConcurrentUploads of them at the same time and queues the rest in attach order
+struct LoaderService
+{
+    OSArray* pQueue;
+    int iActive;
+    int iLimit;
+    
+    //the current batch - from the first upload scheduled while the loader was idle
+    //until every device of it is done
+    UInt64 uBatchStart;
+    UInt32 uBatchDevices;
+    UInt32 uBatchFailed;
+    UInt64 uBatchBytes;
+    
+    ~LoaderService() { if (pQueue != NULL) pQueue->release(); }
+};
+
+static LoaderService g_loaderService;
+
+//staging buffers, wired when they are first needed and kept until the kext unloads. an entry
+//is lent by clearing its bit in uFreeMask with a compare and swap, so uploads never wait on
+//each other or on a lock for one
+struct BufferPool
+{
+    IOBufferMemoryDescriptor* aBuffers[BUFFER_POOL_ENTRIES];
+    vm_size_t aCapacities[BUFFER_POOL_ENTRIES];     //read without the entry, so never freed
+    UInt32 uUsedMask;       //entries that hold a buffer
+    UInt32 uFreeMask;       //entries that hold one nobody has borrowed
+    
+    //buffers lent out of the pool, ones that had to be allocated, and the most out at once
+    UInt32 uHits;
+    UInt32 uMisses;
+    SInt32 iBorrowed;
+    SInt32 iBorrowedPeak;
+    
+    ~BufferPool()
+    {
+        for (int iEntryCounter = 0; iEntryCounter < BUFFER_POOL_ENTRIES; iEntryCounter++)
+        {
+            if (aBuffers[iEntryCounter] == NULL) continue;
+            aBuffers[iEntryCounter]->complete();
+            aBuffers[iEntryCounter]->release();
+        }
+    }
+};
+
+static BufferPool g_bufferPool;
+
+//one more buffer lent out, which may be the most at once so far
+static void CountPoolBorrow(void)
+{
+    SInt32 iBorrowed = __atomic_add_fetch(&g_bufferPool.iBorrowed, 1, __ATOMIC_RELAXED);
+    SInt32 iPeak = __atomic_load_n(&g_bufferPool.iBorrowedPeak, __ATOMIC_RELAXED);
+    
+    while ((iBorrowed > iPeak) && !__atomic_compare_exchange_n(&g_bufferPool.iBorrowedPeak, &iPeak, iBorrowed, false,
+                                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+static UInt64 GetUptimeNanoseconds(void)
+{
+    UInt64 uUptime = 0;
+    UInt64 uNanoseconds = 0;
+    
+    clock_get_uptime(&uUptime);
+    absolutetime_to_nanoseconds(uUptime, &uNanoseconds);
+    
+    return(uNanoseconds);
+}
+
+static uint64_t GetTraceTimestamp(void)
+{
+    return(GetUptimeNanoseconds());
+}
+
+//
+// GetEngineResult
+// the engine only tells a handful of results apart, the IOReturn behind them is logged
+// where it happens
+//
+static int GetEngineResult(IOReturn kResult)
+{
+    switch (kResult)
+    {
+        case kIOReturnSuccess:
+            return(kAth3kSuccess);
+            
+        case kIOReturnNoMemory:
+            return(kAth3kErrorNoMemory);
+            
+        case kIOReturnNoDevice:
+        case kIOReturnNotResponding:
+            return(kAth3kErrorNoDevice);
+            
+        case kIOUSBPipeStalled:
+            return(kAth3kErrorStall);
+            
+        case kIOReturnTimeout:
+        case kIOUSBTransactionTimeout:
+            return(kAth3kErrorTimeout);
+            
+        case kIOReturnUnderrun:
+            return(kAth3kErrorUnderrun);
+            
+        case kIOReturnAborted:
+            return(kAth3kErrorAborted);
+            
+        default:
+            return(kAth3kErrorIO);
+    }
+}
+
+//
+// VerifyFirmware
+// the image has to be the one the manifest was generated from, anything else the dongle
+// would take and then not boot
+//
+static IOReturn VerifyFirmware(const unsigned char* pImage, UInt32 uLength)
+{
+    if (uLength != ATH3K_FIRMWARE_SIZE)
+    {
+        IOLog("local_IOath3kfrmwr::VerifyFirmware -> image has %u bytes, expected %d\n", uLength, ATH3K_FIRMWARE_SIZE);
+        return(kIOReturnBadArgument);
+    }
+    
+    UInt32 uCrc32 = Ath3kCrc32(0, pImage, uLength);
+    if (uCrc32 != ATH3K_FIRMWARE_CRC32)
+    {
+        IOLog("local_IOath3kfrmwr::VerifyFirmware -> image has crc32 %08x, expected %08x\n", uCrc32, ATH3K_FIRMWARE_CRC32);
+        return(kIOReturnBadArgument);
+    }
+    
+    return(kIOReturnSuccess);
+}
+
+//the load is over, with the class lock held - the uploads waiting for it go on
+static void FinishFirmwareLoad(IOBufferMemoryDescriptor* pBuffer, const unsigned char* pImage, IOReturn kResult)
+{
+    g_firmwareCache.kLoadResult = kResult;
+    
+    if (kResult == kIOReturnSuccess)
+    {
+        g_firmwareCache.pImage = pImage;
+        g_firmwareCache.pBuffer = pBuffer;
+        g_firmwareCache.uResidentBytes = ATH3K_FIRMWARE_SIZE;
+        g_firmwareCache.uResidentPeak = MAX(g_firmwareCache.uResidentPeak, g_firmwareCache.uResidentBytes);
+        g_firmwareCache.uLoads++;
+    }
+    
+    g_firmwareCache.bLoading = false;
+    IOLockWakeup(g_lockClass.pLock, &g_firmwareCache, false);
+}
+
+//
+// EvictFirmwareCache
+// runs FirmwareCacheIdleMs after the last upload let go of the image, and drops it unless
+// an upload has come along since
+//
+static void EvictFirmwareCache(thread_call_param_t pParam0, thread_call_param_t pParam1)
+{
+    IOBufferMemoryDescriptor* pBufferRelease = NULL;
+    IOMemoryDescriptor* pDescriptorRelease = NULL;
+    
+    IOLockLock(g_lockClass.pLock);
+    
+    if ((g_firmwareCache.iUsers == 0) && (g_firmwareCache.pImage != NULL))
+    {
+        pBufferRelease = g_firmwareCache.pBuffer;
+        pDescriptorRelease = g_firmwareCache.pDescriptor;
+        g_firmwareCache.pImage = NULL;
+        g_firmwareCache.pBuffer = NULL;
+        g_firmwareCache.pDescriptor = NULL;
+        g_firmwareCache.uResidentBytes = 0;
+        g_firmwareCache.uEvictions++;
+    }
+    
+    IOLockUnlock(g_lockClass.pLock);
+    
+    if (pDescriptorRelease != NULL)
+    {
+        pDescriptorRelease->complete();
+        pDescriptorRelease->release();
+    }
+    if (pBufferRelease != NULL) pBufferRelease->release();
+}
+
+#if ATH3K_EXTERNAL_FIRMWARE
+//
+// FirmwareResourceLoaded
+// called by kextd with the contents of the firmware resource. the data is only valid
+// during the callback, so it is copied into a wired buffer every upload can share
+//
+static void FirmwareResourceLoaded(OSKextRequestTag requestTag, OSReturn result, const void* pResourceData,
+                                   uint32_t uResourceDataLength, void* pContext)
+{
+    IOBufferMemoryDescriptor* pBuffer = NULL;
+    IOReturn kResult = kIOReturnSuccess;
+    
+    if (result != kOSReturnSuccess)
+    {
+        IOLog("local_IOath3kfrmwr::FirmwareResourceLoaded -> error loading %s (%08x)\n", FIRMWARE_RESOURCE_NAME, result);
+        kResult = kIOReturnNotFound;
+    }
+    else kResult = VerifyFirmware((const unsigned char*)pResourceData, uResourceDataLength);
+    
+    if (kResult == kIOReturnSuccess)
+    {
+        //page aligned so the zero copy path can describe it like the embedded image
+        pBuffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionOut, uResourceDataLength,
+                                                              PAGE_SIZE);
+        if (pBuffer != NULL) pBuffer->writeBytes(0, pResourceData, uResourceDataLength);
+        else kResult = kIOReturnNoMemory;
+    }
+    
+    IOLockLock(g_lockClass.pLock);
+    
+    //an answer to a request the uploads gave up on, after the load was started again or not
+    if (!g_firmwareCache.bLoading || (requestTag != g_firmwareCache.requestTag))
+    {
+        IOLockUnlock(g_lockClass.pLock);
+        
+        IOLog("local_IOath3kfrmwr::FirmwareResourceLoaded -> dropping the answer to a cancelled request\n");
+        if (pBuffer != NULL) pBuffer->release();
+        return;
+    }
+    
+    FinishFirmwareLoad(pBuffer, (pBuffer != NULL) ? (const unsigned char*)pBuffer->getBytesNoCopy() : NULL, kResult);
+    
+    //every upload that asked for it gave up waiting
+    if ((g_firmwareCache.iUsers == 0) && (g_firmwareCache.pThreadCallEvict != NULL))
+    {
+        thread_call_enter(g_firmwareCache.pThreadCallEvict);
+    }
+    
+    IOLockUnlock(g_lockClass.pLock);
+}
+#else
+//
+// LoadFirmware
+// gets the image for the cache, without the class lock: the packed image is expanded into a
+// wired buffer of its own, the embedded one is used where it is. both are checked once here
+// instead of on every upload
+//
+static IOReturn LoadFirmware(IOBufferMemoryDescriptor** ppBuffer, const unsigned char** ppImage)
+{
+#if ATH3K_COMPRESSED_FIRMWARE
+    IOBufferMemoryDescriptor* pBuffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionOut,
+                                                                                    ATH3K_FIRMWARE_SIZE, PAGE_SIZE);
+    uint8_t* pWindow = (uint8_t*)::IOMalloc(ATH3K_LZ_WINDOW_SIZE);
+    IOReturn kResult = kIOReturnNoMemory;
+    
+    if ((pBuffer != NULL) && (pWindow != NULL))
+    {
+        //the decoder only needs its history window while it runs
+        Ath3kFirmwareDecoder decoder;
+        decoder.Init(g_bytesFirmwareCompressed, ATH3K_FIRMWARE_COMPRESSED_SIZE, pWindow);
+        int iDecoded = decoder.Decode((uint8_t*)pBuffer->getBytesNoCopy(), ATH3K_FIRMWARE_SIZE);
+        
+        if (iDecoded < 0)
+        {
+            IOLog("local_IOath3kfrmwr::LoadFirmware -> error expanding the packed image\n");
+            kResult = kIOReturnBadArgument;
+        }
+        else kResult = VerifyFirmware((const unsigned char*)pBuffer->getBytesNoCopy(), iDecoded);
+    }
+    
+    if (pWindow != NULL) ::IOFree(pWindow, ATH3K_LZ_WINDOW_SIZE);
+    if ((kResult != kIOReturnSuccess) && (pBuffer != NULL))
+    {
+        pBuffer->release();
+        pBuffer = NULL;
+    }
+    
+    *ppBuffer = pBuffer;
+    *ppImage = (pBuffer != NULL) ? (const unsigned char*)pBuffer->getBytesNoCopy() : NULL;
+    return(kResult);
+#else
+    *ppBuffer = NULL;
+    *ppImage = g_bytesFirmware;
+    return(VerifyFirmware(g_bytesFirmware, ATH3K_FIRMWARE_SIZE));
+#endif
+}
+#endif
+
+//
+// RetainFirmware
+// points m_pFirmwareImage at the raw image for this upload. the first upload after the cache
+// was empty fills it - the external image is requested from kextd, the packed one expanded,
+// the embedded one just checked - and every upload after it finds it there
+//
+IOReturn local_IOath3kfrmwr::RetainFirmware(void)
+{
+    IOReturn kResult = kIOReturnSuccess;
+#if ATH3K_EXTERNAL_FIRMWARE
+    OSKextRequestTag requestTagCancel = kOSKextRequestTagInvalid;
+#endif
+    
+    IOLockLock(g_lockClass.pLock);
+    
+    g_firmwareCache.iUsers++;
+    
+    //the image is in use again, the eviction is off
+    if (g_firmwareCache.pThreadCallEvict == NULL)
+    {
+        g_firmwareCache.pThreadCallEvict = thread_call_allocate(&EvictFirmwareCache, NULL);
+    }
+    else thread_call_cancel(g_firmwareCache.pThreadCallEvict);
+    
+    if (g_firmwareCache.pImage != NULL) g_firmwareCache.uHits++;
+    else
+    {
+        g_firmwareCache.uMisses++;
+        
+        if (!g_firmwareCache.bLoading)
+        {
+            g_firmwareCache.bLoading = true;
+#if ATH3K_EXTERNAL_FIRMWARE
+            IOLog("%s::%p::RetainFirmware -> requesting %s\n", this->getName(), this, FIRMWARE_RESOURCE_NAME);
+            
+            g_firmwareCache.requestTag = kOSKextRequestTagInvalid;
+            kResult = OSKextRequestResource(OSKextGetCurrentIdentifier(), FIRMWARE_RESOURCE_NAME, &FirmwareResourceLoaded,
+                                            NULL, &g_firmwareCache.requestTag);
+            if (kResult != kOSReturnSuccess)
+            {
+                IOLog("%s::%p::RetainFirmware -> error requesting firmware (%08x)\n", this->getName(), this, kResult);
+                FinishFirmwareLoad(NULL, NULL, kResult);
+            }
+#else
+            //the other uploads wait on bLoading while we expand or check the image
+            IOBufferMemoryDescriptor* pBuffer = NULL;
+            const unsigned char* pImage = NULL;
+            
+            IOLockUnlock(g_lockClass.pLock);
+            kResult = LoadFirmware(&pBuffer, &pImage);
+            IOLockLock(g_lockClass.pLock);
+            
+            FinishFirmwareLoad(pBuffer, pImage, kResult);
+#endif
+        }
+        
+        //wait for the load started by us or by another upload
+        UInt64 uDeadline = 0;
+        clock_interval_to_deadline(FIRMWARE_LOAD_TIMEOUT_MS, kMillisecondScale, &uDeadline);
+        while (g_firmwareCache.bLoading)
+        {
+            if (IOLockSleepDeadline(g_lockClass.pLock, &g_firmwareCache, *(AbsoluteTime*)&uDeadline,
+                                    THREAD_UNINT) == THREAD_TIMED_OUT)
+            {
+                break;
+            }
+        }
+        
+#if ATH3K_EXTERNAL_FIRMWARE
+        //kextd never answered. the request is given up and the uploads waiting for it fail,
+        //so the next upload asks again instead of waiting on a load that is not coming
+        if (g_firmwareCache.bLoading)
+        {
+            IOLog("%s::%p::RetainFirmware -> no answer for %s, giving up\n", this->getName(), this, FIRMWARE_RESOURCE_NAME);
+            
+            requestTagCancel = g_firmwareCache.requestTag;
+            g_firmwareCache.requestTag = kOSKextRequestTagInvalid;
+            FinishFirmwareLoad(NULL, NULL, kIOReturnTimeout);
+        }
+#endif
+    }
+    
+    if (g_firmwareCache.pImage != NULL)
+    {
+        m_pFirmwareImage = g_firmwareCache.pImage;
+        kResult = kIOReturnSuccess;
+    }
+    else
+    {
+        kResult = g_firmwareCache.bLoading ? kIOReturnTimeout : g_firmwareCache.kLoadResult;
+        if (kResult == kIOReturnSuccess) kResult = kIOReturnNotFound;
+        g_firmwareCache.iUsers--;
+    }
+    
+    IOLockUnlock(g_lockClass.pLock);
+    
+#if ATH3K_EXTERNAL_FIRMWARE
+    //without the class lock, in case kextd is calling back right now. an answer that still
+    //comes is dropped by its tag
+    if (requestTagCancel != kOSKextRequestTagInvalid) OSKextCancelRequest(requestTagCancel, NULL);
+#endif
+    
+    return(kResult);
+}
+
+//
+// ReleaseFirmware
+// the last upload to finish starts the idle timeout of the cache, FirmwareCacheIdleMs in
+// the personality (0 drops the image right away)
+//
+void local_IOath3kfrmwr::ReleaseFirmware(void)
+{
+    UInt32 uIdleMs = this->GetFirmwareCacheIdle();
+    
+    IOLockLock(g_lockClass.pLock);
+    
+    if ((--g_firmwareCache.iUsers == 0) && (g_firmwareCache.pThreadCallEvict != NULL))
+    {
+        UInt64 uDeadline = 0;
+        clock_interval_to_deadline(uIdleMs, kMillisecondScale, &uDeadline);
+        thread_call_enter_delayed(g_firmwareCache.pThreadCallEvict, uDeadline);
+    }
+    
+    this->setProperty("FirmwareResidentBytes", g_firmwareCache.uResidentBytes, 32);
+    this->setProperty("FirmwareResidentPeak", g_firmwareCache.uResidentPeak, 32);
+    this->setProperty("FirmwareLoads", g_firmwareCache.uLoads, 32);
+    this->setProperty("FirmwareCacheHits", g_firmwareCache.uHits, 32);
+    this->setProperty("FirmwareCacheMisses", g_firmwareCache.uMisses, 32);
+    this->setProperty("FirmwareCacheEvictions", g_firmwareCache.uEvictions, 32);
+    m_trace.Record(kAth3kTraceInfo, kAth3kTraceFirmware, m_uTraceDevice, g_firmwareCache.uResidentBytes,
+                   g_firmwareCache.uHits, g_firmwareCache.uMisses);
+    
+    IOLockUnlock(g_lockClass.pLock);
+    
+    m_pFirmwareImage = NULL;
+    m_pDescriptorImage = NULL;
+}
+
+//
+// GetFirmwareDescriptor
+// the cached image described and prepared for DMA. the first zero copy write does it, the
+// uploads after it share the descriptor until the image is evicted
+//
+IOMemoryDescriptor* local_IOath3kfrmwr::GetFirmwareDescriptor(void)
+{
+    IOLockLock(g_lockClass.pLock);
+    
+    if (g_firmwareCache.pDescriptor == NULL)
+    {
+        IOMemoryDescriptor* pDescriptor = IOMemoryDescriptor::withAddress((void*)g_firmwareCache.pImage,
+                                                                          ATH3K_FIRMWARE_SIZE, kIODirectionOut);
+        IOReturn kResult = (pDescriptor != NULL) ? pDescriptor->prepare() : kIOReturnNoMemory;
+        
+        if (kResult == kIOReturnSuccess) g_firmwareCache.pDescriptor = pDescriptor;
+        else
+        {
+            IOLog("%s::%p::GetFirmwareDescriptor -> error preparing firmware image (%08x)\n", this->getName(), this,
+                  kResult);
+            if (pDescriptor != NULL) pDescriptor->release();
+        }
+    }
+    
+    IOMemoryDescriptor* pDescriptor = g_firmwareCache.pDescriptor;
+    
+    IOLockUnlock(g_lockClass.pLock);
+    
+    return(pDescriptor);
+}
+
 bool local_IOath3kfrmwr::init(OSDictionary *propTable)
 {
-    IOLog("local_IOath3kfrmwr::init\n");
-    return(super::init(propTable));
+    if (!super::init(propTable)) return(false);
+    
+    //the ring stays off (m_pTraceRecords NULL) if there is no memory for it
+    m_uTraceDevice = 0;
+    m_pTraceRecords = (Ath3kTraceRecord*)::IOMalloc(ATH3K_TRACE_RECORDS * sizeof(Ath3kTraceRecord));
+    m_trace.Init(m_pTraceRecords, (m_pTraceRecords != NULL) ? ATH3K_TRACE_RECORDS : 0, &GetTraceTimestamp);
+    m_trace.SetLevel(this->GetTraceLevel());
+    m_trace.Record(kAth3kTraceInfo, kAth3kTraceInit, m_uTraceDevice);
+    
+    //lock protecting the completions queued for the upload thread
+    m_pLockUpload = IOLockAlloc();
+    m_iUploadEvents = 0;
+    m_transport.m_pOwner = this;
+    m_pUploadDevice = NULL;
+    m_pUploadInterface = NULL;
+    m_pUploadPipe = NULL;
+    m_pDescriptorImage = NULL;
+    m_pFirmwareImage = NULL;
+    m_bUploadRunning = false;
+    m_pUploadProvider = NULL;
+    bzero(m_aUploadSlots, sizeof(m_aUploadSlots));
+    
+    m_pThreadCallUpload = thread_call_allocate(&local_IOath3kfrmwr::UploadThread, this);
+    if (m_pThreadCallUpload == NULL) return(false);
+    
+    return(m_pLockUpload != NULL);
 }
 
 void local_IOath3kfrmwr::free(void)
 {
-    IOLog("local_IOath3kfrmwr::free\n");
+    m_trace.Record(kAth3kTraceInfo, kAth3kTraceFree, m_uTraceDevice);
+    if (m_pLockUpload != NULL)
+    {
+        IOLockFree(m_pLockUpload);
+        m_pLockUpload = NULL;
+    }
+    if (m_pThreadCallUpload != NULL)
+    {
+        thread_call_free(m_pThreadCallUpload);
+        m_pThreadCallUpload = NULL;
+    }
+    if (m_pTraceRecords != NULL)
+    {
+        m_trace.Init(NULL, 0, &GetTraceTimestamp);
+        ::IOFree(m_pTraceRecords, ATH3K_TRACE_RECORDS * sizeof(Ath3kTraceRecord));
+        m_pTraceRecords = NULL;
+    }
     super::free();
 }
 
 bool local_IOath3kfrmwr::attach(IOService* provider)
 {
-    IOLog("local_IOath3kfrmwr::attach\n");
+    m_trace.Record(kAth3kTraceInfo, kAth3kTraceAttach, m_uTraceDevice);
     return(super::attach(provider));
 }
 
 void local_IOath3kfrmwr::detach(IOService* provider)
 {
-    IOLog("local_IOath3kfrmwr::detach\n");
+    m_trace.Record(kAth3kTraceInfo, kAth3kTraceDetach, m_uTraceDevice);
     super::detach(provider);
 }
 
+//
+// GetFirmwareState
+// the byte the vendor GETSTATE request returns, or -1 if the device has no answer to it.
+// pDevice has to be open
+//
+int local_IOath3kfrmwr::GetFirmwareState(IOUSBDevice* pDevice)
+{
+    UInt8 uState = 0;
+    
+    IOUSBDevRequest requestState;
+    requestState.bmRequestType = ATH3K_STATE_REQUEST_TYPE;
+    requestState.bRequest = ATH3K_REQUEST_GETSTATE;
+    requestState.wValue = 0;
+    requestState.wIndex = 0;
+    requestState.wLength = sizeof(uState);
+    requestState.pData = &uState;
+    requestState.wLenDone = 0;
+    
+    IOReturn kResult = pDevice->DeviceRequest(&requestState, PROBE_STATE_TIMEOUT_MS, PROBE_STATE_TIMEOUT_MS);
+    if ((kResult != kIOReturnSuccess) || (requestState.wLenDone != sizeof(uState))) return(-1);
+    
+    return(uState);
+}
+
+//
+// probe
+// a device that already runs the firmware - after a warm reboot or when the hub lost power
+// for a moment - is not ours: uploading again would cost the reset and the whole transfer.
+// bcdDevice tells most of them apart for free, GETSTATE the rest. GETSTATE is only sent
+// with the device opened by us; while another driver has it open, bcdDevice has to do
+//
 IOService* local_IOath3kfrmwr::probe(IOService *provider, SInt32 *score)
 {
-    IOLog("%s(%p)::probe\n", getName(), this);
+    IOUSBDevice* pDevice = OSDynamicCast(IOUSBDevice, provider);
+    if (pDevice == NULL) return(super::probe(provider, score));
+    
+    int iDeviceRelease = pDevice->GetDeviceRelease();
+    int iState = -1;
+    
+    OSBoolean* pBooleanProbeState = OSDynamicCast(OSBoolean, this->getProperty("ProbeFirmwareState"));
+    if ((iDeviceRelease <= ATH3K_BCD_DEVICE_ROM) && ((pBooleanProbeState == NULL) || pBooleanProbeState->isTrue()) &&
+        pDevice->open(this))
+    {
+        iState = this->GetFirmwareState(pDevice);
+        pDevice->close(this);
+    }
+    
+    bool bRunning = Ath3kUploadEngine::IsFirmwareRunning(iDeviceRelease, iState);
+    m_trace.Record(kAth3kTraceInfo, kAth3kTraceProbe, pDevice->GetLocationID(), iDeviceRelease,
+                   (iState >= 0) ? iState : 0xFF, bRunning);
+    
+    if (bRunning)
+    {
+        IOLog("%s::%p::probe -> firmware already running (bcdDevice %04x, state %02x), no upload\n", this->getName(),
+              this, iDeviceRelease, (iState >= 0) ? iState : 0xFF);
+        *score = 0;
+        return(NULL);
+    }
+    
     return(super::probe(provider, score));
 }
 
@@ -106,23 +766,107 @@ IOUSBInterface* local_IOath3kfrmwr::GetInterfaceWithBulkPipeOut(IOUSBDevice* pDe
     return(pInterfaceReturn);
 }
 
-int local_IOath3kfrmwr::GetBulkPipeOutNumber(IOUSBInterface* pInterface)
+//
+// GetBulkOutEndpoint
+// where the bulk out pipe of the device is, from the endpoint table of its VID/PID/bcdDevice.
+// the first attach of a model parses the configuration descriptor, the ones after it only
+// look the table up
+//
+bool local_IOath3kfrmwr::GetBulkOutEndpoint(IOUSBDevice* pDevice, Ath3kEndpoint* pEndpoint, bool* pbCached)
 {
-    int iReturn = -1;
+    const Ath3kEndpoint* pFound = NULL;
     
-    int iNumberOfPipes = pInterface->GetNumEndpoints();
-    if (iNumberOfPipes > 0)
+    *pbCached = false;
+    
+    IOLockLock(g_lockClass.pLock);
+    for (int iEntryCounter = 0; iEntryCounter < g_iEndpointTables; iEntryCounter++)
     {
-        for (int iPipeCounter = 0; iPipeCounter < iNumberOfPipes; iPipeCounter++)
+        CachedEndpointTable* pEntry = &g_aEndpointTables[iEntryCounter];
+        if ((pEntry->idVendor == pDevice->GetVendorID()) && (pEntry->idProduct == pDevice->GetProductID()) &&
+            (pEntry->bcdDevice == pDevice->GetDeviceRelease()))
         {
-            IOUSBPipe* pPipeIterator = pInterface->GetPipeObj(iPipeCounter);
-            if (pPipeIterator != NULL)
-            {
-                if (pPipeIterator->GetType() == kUSBBulk)
-                {
-                    if (pPipeIterator->GetDirection() == kUSBOut)
-                    {
-                        //stop and return this pipe #
+            pFound = pEntry->table.FindBulkOut();
+            if (pFound != NULL) *pEndpoint = *pFound;
+            *pbCached = true;
+            break;
+        }
+    }
+    IOLockUnlock(g_lockClass.pLock);
+    
+    if (*pbCached) return(pFound != NULL);
+    
+    //first attach of this model - the descriptor is already in memory since the configure step
+    const IOUSBConfigurationDescriptor* pDeviceConfiguration = pDevice->GetFullConfigurationDescriptor(0);
+    if (pDeviceConfiguration == NULL) return(false);
+    
+    Ath3kEndpointTable table;
+    if (!table.Parse((const uint8_t*)pDeviceConfiguration, USBToHostWord(pDeviceConfiguration->wTotalLength)))
+    {
+        IOLog("%s::%p::GetBulkOutEndpoint -> error parsing configuration descriptor\n", this->getName(), this);
+        return(false);
+    }
+    
+    pFound = table.FindBulkOut();
+    if (pFound == NULL) return(false);
+    *pEndpoint = *pFound;
+    
+    IOLockLock(g_lockClass.pLock);
+    if (g_iEndpointTables < ENDPOINT_TABLES_MAX)
+    {
+        CachedEndpointTable* pEntry = &g_aEndpointTables[g_iEndpointTables++];
+        pEntry->idVendor = pDevice->GetVendorID();
+        pEntry->idProduct = pDevice->GetProductID();
+        pEntry->bcdDevice = pDevice->GetDeviceRelease();
+        pEntry->table = table;
+    }
+    IOLockUnlock(g_lockClass.pLock);
+    
+    return(true);
+}
+
+//
+// FindInterface
+// the interface object of the endpoint, without opening any of them
+//
+IOUSBInterface* local_IOath3kfrmwr::FindInterface(IOUSBDevice* pDevice, const Ath3kEndpoint* pEndpoint)
+{
+    IOUSBInterface* pInterface = NULL;
+    
+    IOUSBFindInterfaceRequest requestFindInterface = {0};
+    requestFindInterface.bAlternateSetting = kIOUSBFindInterfaceDontCare;
+    requestFindInterface.bInterfaceClass = kIOUSBFindInterfaceDontCare;
+    requestFindInterface.bInterfaceSubClass = kIOUSBFindInterfaceDontCare;
+    requestFindInterface.bInterfaceProtocol = kIOUSBFindInterfaceDontCare;
+    
+    while ((pInterface = pDevice->FindNextInterface(pInterface, &requestFindInterface)) != NULL)
+    {
+        if ((pInterface->GetInterfaceNumber() == pEndpoint->bInterfaceNumber) &&
+            (pInterface->GetAlternateSetting() == pEndpoint->bAlternateSetting))
+        {
+            break;
+        }
+    }
+    
+    return(pInterface);
+}
+
+int local_IOath3kfrmwr::GetBulkPipeOutNumber(IOUSBInterface* pInterface)
+{
+    int iReturn = -1;
+    
+    int iNumberOfPipes = pInterface->GetNumEndpoints();
+    if (iNumberOfPipes > 0)
+    {
+        for (int iPipeCounter = 0; iPipeCounter < iNumberOfPipes; iPipeCounter++)
+        {
+            IOUSBPipe* pPipeIterator = pInterface->GetPipeObj(iPipeCounter);
+            if (pPipeIterator != NULL)
+            {
+                if (pPipeIterator->GetType() == kUSBBulk)
+                {
+                    if (pPipeIterator->GetDirection() == kUSBOut)
+                    {
+                        //stop and return this pipe #
                         iReturn = iPipeCounter;
                         break;
                     }
@@ -145,293 +889,1107 @@ int local_IOath3kfrmwr::GetBulkPipeOutNumber(IOUSBInterface* pInterface)
     return(iReturn);
 }
 
+int local_IOath3kfrmwr::GetUploadQueueDepth(void)
+{
+    int iQueueDepth = UPLOAD_QUEUE_DEPTH_DEFAULT;
+    
+    //the personality can override how many writes we keep queued
+    OSNumber* pNumberQueueDepth = OSDynamicCast(OSNumber, this->getProperty("UploadQueueDepth"));
+    if (pNumberQueueDepth != NULL) iQueueDepth = pNumberQueueDepth->unsigned32BitValue();
+    
+    iQueueDepth = MAX(iQueueDepth, UPLOAD_QUEUE_DEPTH_MIN);
+    iQueueDepth = MIN(iQueueDepth, UPLOAD_QUEUE_DEPTH_MAX);
+    
+    return(iQueueDepth);
+}
+
+//
+// BulkWriteComplete
+// called by the usb family when one of the queued bulk writes finished. the engine only
+// runs on the upload thread, so the result is queued for it there
+//
+void local_IOath3kfrmwr::BulkWriteComplete(void* target, void* parameter, IOReturn status, UInt32 bufferSizeRemaining)
+{
+    local_IOath3kfrmwr* pThis = (local_IOath3kfrmwr*)target;
+    UploadSlot* pSlot = (UploadSlot*)parameter;
+    
+    if ((status != kIOReturnSuccess) || (bufferSizeRemaining != 0))
+    {
+        IOLog("%s::%p::BulkWriteComplete -> error writing to bulk pipe (%08x), %u bytes remaining\n", pThis->getName(),
+              pThis, status, (unsigned int)bufferSizeRemaining);
+    }
+    
+    pThis->m_trace.Record(kAth3kTraceDebug, kAth3kTraceWriteComplete, pThis->m_uTraceDevice, pSlot - pThis->m_aUploadSlots,
+                          GetEngineResult(status), pSlot->iLength - (int)bufferSizeRemaining);
+    pThis->PostUploadEvent(kAth3kStepBody, (int)(pSlot - pThis->m_aUploadSlots), GetEngineResult(status),
+                           pSlot->iLength - (int)bufferSizeRemaining);
+}
+
+bool local_IOath3kfrmwr::GetUploadZeroCopy(void)
+{
+    //hand subranges of the firmware image straight to the pipe unless the personality says otherwise
+    OSBoolean* pBooleanZeroCopy = OSDynamicCast(OSBoolean, this->getProperty("UploadZeroCopy"));
+    
+    return((pBooleanZeroCopy == NULL) || pBooleanZeroCopy->isTrue());
+}
+
+bool local_IOath3kfrmwr::GetUploadVerifySha256(void)
+{
+    //the CRC catches what goes wrong between the manifest and the bus, the SHA-256 on top
+    //of it is for those who want the image to be the very one it was generated from
+    OSBoolean* pBooleanSha256 = OSDynamicCast(OSBoolean, this->getProperty("UploadVerifySha256"));
+    
+    return((pBooleanSha256 != NULL) && pBooleanSha256->isTrue());
+}
+
+bool local_IOath3kfrmwr::GetUploadSingleTransfer(void)
+{
+    //"Single" submits the whole body as one bulk transfer and leaves the packetization to the
+    //host controller, "Chunked" (the default) splits it into chunk sized writes
+    OSString* pStringMode = OSDynamicCast(OSString, this->getProperty("UploadMode"));
+    
+    return((pStringMode != NULL) && pStringMode->isEqualTo("Single"));
+}
+
+int local_IOath3kfrmwr::GetPacketSize(IOUSBPipe* pBulkPipe)
+{
+    int iPacketSize = 64;
+    
+    const IOUSBEndpointDescriptor* pEndpoint = pBulkPipe->GetEndpointDescriptor();
+    if (pEndpoint != NULL)
+    {
+        //bits 10..0 hold the packet size, the rest is for high bandwidth endpoints
+        iPacketSize = USBToHostWord(pEndpoint->wMaxPacketSize) & 0x07FF;
+    }
+    
+    return(MAX(iPacketSize, 8));
+}
+
+//
+// GetUploadChunkSize
+// a fixed UploadChunkSize from the personality, or the size tuned on an earlier attach of
+// the same device model. 0 leaves it to the engine to work one out from the endpoint
+//
+int local_IOath3kfrmwr::GetUploadChunkSize(IOUSBDevice* pDevice, bool* pbTuned)
+{
+    int iChunkSize = 0;
+    
+    *pbTuned = false;
+    
+    OSNumber* pNumberChunkSize = OSDynamicCast(OSNumber, this->getProperty("UploadChunkSize"));
+    if (pNumberChunkSize != NULL) iChunkSize = pNumberChunkSize->unsigned32BitValue();
+    
+    if (iChunkSize <= 0)
+    {
+        IOLockLock(g_lockClass.pLock);
+        for (int iEntryCounter = 0; iEntryCounter < g_iTunedChunkSizes; iEntryCounter++)
+        {
+            TunedChunkSize* pEntry = &g_aTunedChunkSizes[iEntryCounter];
+            if ((pEntry->idVendor == pDevice->GetVendorID()) && (pEntry->idProduct == pDevice->GetProductID()) &&
+                (pEntry->bcdDevice == pDevice->GetDeviceRelease()))
+            {
+                iChunkSize = pEntry->iChunkSize;
+                *pbTuned = true;
+                break;
+            }
+        }
+        IOLockUnlock(g_lockClass.pLock);
+    }
+    
+    return(MAX(iChunkSize, 0));
+}
+
+bool local_IOath3kfrmwr::GetUploadAutoTune(void)
+{
+    OSBoolean* pBooleanAutoTune = OSDynamicCast(OSBoolean, this->getProperty("UploadAutoTune"));
+    OSNumber* pNumberChunkSize = OSDynamicCast(OSNumber, this->getProperty("UploadChunkSize"));
+    
+    //a fixed chunk size from the personality wins over tuning
+    if ((pNumberChunkSize != NULL) && (pNumberChunkSize->unsigned32BitValue() > 0)) return(false);
+    
+    return((pBooleanAutoTune != NULL) && pBooleanAutoTune->isTrue());
+}
+
+//
+// SaveTunedChunkSize
+// remembers the chunk size the engine's auto-tune found for this VID/PID/bcdDevice, so later
+// attaches of the same model start with it
+//
+void local_IOath3kfrmwr::SaveTunedChunkSize(IOUSBDevice* pDevice, int iChunkSize)
+{
+    IOLockLock(g_lockClass.pLock);
+    if (g_iTunedChunkSizes < TUNED_ENTRIES_MAX)
+    {
+        TunedChunkSize* pEntry = &g_aTunedChunkSizes[g_iTunedChunkSizes++];
+        pEntry->idVendor = pDevice->GetVendorID();
+        pEntry->idProduct = pDevice->GetProductID();
+        pEntry->bcdDevice = pDevice->GetDeviceRelease();
+        pEntry->iChunkSize = iChunkSize;
+    }
+    IOLockUnlock(g_lockClass.pLock);
+    
+    m_trace.Record(kAth3kTraceInfo, kAth3kTraceChunkTuned, m_uTraceDevice, iChunkSize);
+}
+
 //
 // start
 // when this method is called, I have been selected as the driver for this device.
-// I can still return false to allow a different driver to load
+// the upload itself runs on its own thread, so the matching thread is only held for
+// as long as it takes to hand it to the loader
 //
 bool local_IOath3kfrmwr::start(IOService *provider)
 {
+    UInt64 uStart = GetUptimeNanoseconds();
+    
     //make sure we can super::start() - this is the only place we will return with no indenting
-    /*if (!super::start(provider))
+    if (!super::start(provider))
     {
         IOLog("%s::%p::start -> error for super::start()\n", this->getName(), this);
         return(false);
     }
-    else IOLog("%s::%p::start -> super::start() ok\n", this->getName(), this);*/
     
+    //the location tells the instances apart in the trace
+    IOUSBDevice* pDevice = OSDynamicCast(IOUSBDevice, provider);
+    if (pDevice != NULL) m_uTraceDevice = pDevice->GetLocationID();
+    
+    //hand the upload to the loader
+    this->ScheduleUpload(provider);
+    
+    UInt64 uHeld = GetUptimeNanoseconds() - uStart;
+    this->setProperty("MatchingThreadHeldNs", uHeld, 64);
+    m_trace.Record(kAth3kTraceInfo, kAth3kTraceStart, m_uTraceDevice, uHeld / 1000);
+    
+    return(true);
+}
+
+int local_IOath3kfrmwr::GetUploadRecoveries(void)
+{
+    int iRecoveries = UPLOAD_RECOVERIES_DEFAULT;
+    
+    //failed bulk writes the engine gets over before the upload fails, 0 gives up on the first
+    OSNumber* pNumberRecoveries = OSDynamicCast(OSNumber, this->getProperty("UploadRecoveries"));
+    if (pNumberRecoveries != NULL) iRecoveries = pNumberRecoveries->unsigned32BitValue();
+    
+    return(MAX(iRecoveries, 0));
+}
+
+UInt32 local_IOath3kfrmwr::GetFirmwareCacheIdle(void)
+{
+    UInt32 uIdleMs = FIRMWARE_CACHE_IDLE_DEFAULT;
+    
+    OSNumber* pNumberIdle = OSDynamicCast(OSNumber, this->getProperty("FirmwareCacheIdleMs"));
+    if (pNumberIdle != NULL) uIdleMs = pNumberIdle->unsigned32BitValue();
+    
+    return(uIdleMs);
+}
+
+//the bounds of the bulk write timeouts, 0 where the personality leaves them to the engine
+UInt32 local_IOath3kfrmwr::GetUploadTimeout(const char* pKey)
+{
+    OSNumber* pNumberTimeout = OSDynamicCast(OSNumber, this->getProperty(pKey));
+    
+    return((pNumberTimeout != NULL) ? pNumberTimeout->unsigned32BitValue() : 0);
+}
+
+int local_IOath3kfrmwr::GetMaxConcurrentUploads(void)
+{
+    int iLimit = CONCURRENT_UPLOADS_DEFAULT;
+    
+    OSNumber* pNumberLimit = OSDynamicCast(OSNumber, this->getProperty("MaxConcurrentUploads"));
+    if (pNumberLimit != NULL) iLimit = pNumberLimit->unsigned32BitValue();
+    
+    return(MAX(iLimit, 1));
+}
+
+int local_IOath3kfrmwr::GetTraceLevel(void)
+{
+    int iLevel = kAth3kTraceInfo;
+    
+    OSNumber* pNumberLevel = OSDynamicCast(OSNumber, this->getProperty("TraceLevel"));
+    if (pNumberLevel != NULL) iLevel = pNumberLevel->unsigned32BitValue();
+    
+    return(MIN(iLevel, kAth3kTraceDebug));
+}
+
+//
+// DumpTrace
+// writes what is in the trace ring to the system log. only called once an upload is over,
+// the events themselves never wait for IOLog
+//
+void local_IOath3kfrmwr::DumpTrace(void)
+{
+    //too big for the kernel stack
+    Ath3kTraceRecord* pRecords = (Ath3kTraceRecord*)::IOMalloc(ATH3K_TRACE_RECORDS * sizeof(Ath3kTraceRecord));
+    if (pRecords == NULL) return;
+    
+    UInt32 uRecords = m_trace.Read(pRecords, ATH3K_TRACE_RECORDS);
+    IOLog("%s::%p::DumpTrace -> %u of %u events\n", this->getName(), this, (unsigned int)uRecords,
+          (unsigned int)m_trace.GetCount());
+    
+    char szLine[ATH3K_TRACE_LINE_SIZE];
+    for (UInt32 uRecordCounter = 0; uRecordCounter < uRecords; uRecordCounter++)
+    {
+        Ath3kTraceRing::Format(&pRecords[uRecordCounter], szLine, sizeof(szLine));
+        IOLog("%s::%p::DumpTrace -> %s\n", this->getName(), this, szLine);
+    }
+    
+    ::IOFree(pRecords, ATH3K_TRACE_RECORDS * sizeof(Ath3kTraceRecord));
+}
+
+//
+// ScheduleUpload
+// runs the upload on our thread call right away if the loader has a free slot, or queues
+// it behind the uploads already waiting. the upload holds a reference on us until it is done
+//
+void local_IOath3kfrmwr::ScheduleUpload(IOService* provider)
+{
+    bool bRunNow = false;
+    int iQueued = 0;
+    
+    m_pUploadProvider = provider;
+    m_bUploadRunning = true;
+    this->setProperty("FirmwareUploadState", "Queued");
+    this->retain();
+    
+    IOLockLock(g_lockClass.pLock);
+    
+    g_loaderService.iLimit = this->GetMaxConcurrentUploads();
+    
+    if ((g_loaderService.iActive == 0) && ((g_loaderService.pQueue == NULL) || (g_loaderService.pQueue->getCount() == 0)))
+    {
+        //the loader was idle - this starts a new batch
+        g_loaderService.uBatchStart = GetUptimeNanoseconds();
+        g_loaderService.uBatchDevices = 0;
+        g_loaderService.uBatchFailed = 0;
+        g_loaderService.uBatchBytes = 0;
+    }
+    
+    if (g_loaderService.iActive < g_loaderService.iLimit)
+    {
+        g_loaderService.iActive++;
+        bRunNow = true;
+    }
+    else
+    {
+        if (g_loaderService.pQueue == NULL) g_loaderService.pQueue = OSArray::withCapacity(8);
+        if ((g_loaderService.pQueue == NULL) || !g_loaderService.pQueue->setObject(this))
+        {
+            //no room in the queue - rather run over the limit than never upload
+            g_loaderService.iActive++;
+            bRunNow = true;
+        }
+        else iQueued = g_loaderService.pQueue->getCount();
+    }
+    
+    IOLockUnlock(g_lockClass.pLock);
+    
+    if (bRunNow)
+    {
+        this->setProperty("FirmwareUploadState", "Running");
+        thread_call_enter1(m_pThreadCallUpload, provider);
+    }
+    else m_trace.Record(kAth3kTraceInfo, kAth3kTraceUploadQueued, m_uTraceDevice, iQueued);
+}
+
+//
+// FinishUpload
+// gives the slot of a finished upload to the next one in the queue and keeps the
+// statistics of the batch: devices, failures, time until all of them were ready and
+// the aggregate throughput
+//
+void local_IOath3kfrmwr::FinishUpload(bool bUploaded)
+{
+    local_IOath3kfrmwr* pNext = NULL;
+    
+    IOLockLock(g_lockClass.pLock);
+    
+    g_loaderService.iActive--;
+    g_loaderService.uBatchDevices++;
+    if (bUploaded) g_loaderService.uBatchBytes += ATH3K_FIRMWARE_SIZE;
+    else g_loaderService.uBatchFailed++;
+    
+    if ((g_loaderService.pQueue != NULL) && (g_loaderService.pQueue->getCount() > 0) &&
+        (g_loaderService.iActive < g_loaderService.iLimit))
+    {
+        //the queue drops its reference, the one taken in ScheduleUpload stays with the upload
+        pNext = (local_IOath3kfrmwr*)g_loaderService.pQueue->getObject(0);
+        g_loaderService.pQueue->removeObject(0);
+        g_loaderService.iActive++;
+    }
+    
+    bool bBatchDone = (g_loaderService.iActive == 0) && (pNext == NULL) &&
+                      ((g_loaderService.pQueue == NULL) || (g_loaderService.pQueue->getCount() == 0));
+    UInt64 uBatchTime = GetUptimeNanoseconds() - g_loaderService.uBatchStart;
+    UInt64 uThroughput = (uBatchTime > 0) ? (g_loaderService.uBatchBytes * 1000000000ULL) / uBatchTime : 0;
+    
+    this->setProperty("LoaderBatchDevices", g_loaderService.uBatchDevices, 32);
+    this->setProperty("LoaderBatchFailed", g_loaderService.uBatchFailed, 32);
+    this->setProperty("LoaderBatchTimeNs", uBatchTime, 64);
+    this->setProperty("LoaderBatchBytesPerSecond", uThroughput, 64);
+    
+    if (bBatchDone)
+    {
+        m_trace.Record(kAth3kTraceInfo, kAth3kTraceLoaderDone, m_uTraceDevice, g_loaderService.uBatchDevices,
+                       uBatchTime / 1000000, g_loaderService.uBatchFailed);
+    }
+    
+    IOLockUnlock(g_lockClass.pLock);
+    
+    //failures dump the trace right away, with debug on every upload does
+    if (bUploaded && m_trace.IsEnabled(kAth3kTraceDebug)) this->DumpTrace();
+    
+    if (pNext != NULL)
+    {
+        pNext->setProperty("FirmwareUploadState", "Running");
+        thread_call_enter1(pNext->m_pThreadCallUpload, pNext->m_pUploadProvider);
+    }
+}
+
+//
+// UploadThread
+// thread call running the upload off the matching thread. when it is done the result is
+// published in FirmwareUploadState. only a successful upload registers the service, so
+// clients waiting for a matching notification on it know the device is ready. a failed
+// upload terminates the driver instead, so a replug or rematch can try again
+//
+void local_IOath3kfrmwr::UploadThread(thread_call_param_t pParam0, thread_call_param_t pParam1)
+{
+    local_IOath3kfrmwr* pThis = (local_IOath3kfrmwr*)pParam0;
+    IOService* pProvider = (IOService*)pParam1;
+    
+    UInt64 uStart = GetUptimeNanoseconds();
+    bool bUploaded = pThis->UploadFirmware(pProvider);
+    UInt64 uElapsed = GetUptimeNanoseconds() - uStart;
+    
+    pThis->setProperty("FirmwareUploadState", bUploaded ? "Done" : "Failed");
+    pThis->setProperty("FirmwareUploadTimeNs", uElapsed, 64);
+    if (bUploaded)
+    {
+        pThis->registerService();
+    }
+    
+    pThis->FinishUpload(bUploaded);
+    
+    //let stop() go ahead
+    IOLockLock(pThis->m_pLockUpload);
+    pThis->m_bUploadRunning = false;
+    IOLockWakeup(pThis->m_pLockUpload, &pThis->m_bUploadRunning, false);
+    IOLockUnlock(pThis->m_pLockUpload);
+    
+    //only after the wakeup - stop() waits on m_bUploadRunning
+    if (!bUploaded)
+    {
+        IOLog("%s::%p::UploadThread -> upload failed, terminating\n", pThis->getName(), pThis);
+        pThis->terminate();
+    }
+    
+    pThis->release();
+}
+
+//
+// UploadFirmware
+// sets the engine up for this device and runs it on the upload thread:
+// reset -> configure -> control request -> bulk body
+//
+bool local_IOath3kfrmwr::UploadFirmware(IOService *provider)
+{
     kern_return_t kResult = KERN_SUCCESS;
     
+    //get hold of the firmware before touching the device
+    kResult = this->RetainFirmware();
+    if (kResult != KERN_SUCCESS)
+    {
+        IOLog("%s::%p::UploadFirmware -> error getting firmware (%08x)\n", this->getName(), this, kResult);
+        return(false);
+    }
+    
+    bool bUploaded = false;
+    
     //get the device
     IOUSBDevice* pDeviceRaw = OSDynamicCast(IOUSBDevice, provider);
     if (pDeviceRaw != NULL)
     {
-        IOLog("%s::%p::start -> device cast\n", this->getName(), this);
+        Ath3kUploadConfig config;
+        bzero(&config, sizeof(config));
+        config.pImage = m_pFirmwareImage;
+        config.iImageSize = ATH3K_FIRMWARE_SIZE;
+        config.iQueueDepth = this->GetUploadQueueDepth();
+        config.bZeroCopy = this->GetUploadZeroCopy();
+        config.bSingleTransfer = this->GetUploadSingleTransfer();
+        config.iMaxRecoveries = this->GetUploadRecoveries();
+        config.uTimeoutMinMs = this->GetUploadTimeout("UploadTimeoutMinMs");
+        config.uTimeoutMaxMs = this->GetUploadTimeout("UploadTimeoutMaxMs");
+        config.pDigest = this->GetUploadVerifySha256() ? &g_digestFirmwareSha256 : &g_digestFirmwareCrc32;
+        config.pPlans = g_aFirmwarePlans;
+        config.iPlans = ATH3K_FIRMWARE_PLANS;
+        
+        bool bTuned = false;
+        config.iChunkSize = this->GetUploadChunkSize(pDeviceRaw, &bTuned);
+        config.bAutoTune = !bTuned && this->GetUploadAutoTune();
+        
+        m_pUploadDevice = pDeviceRaw;
+        this->RunEngine(&config);
+        this->PublishUploadTiming(m_engine.GetTiming());
+        
+        m_trace.Record(kAth3kTraceInfo, kAth3kTraceUploadConfig, m_uTraceDevice, m_engine.GetPacketSize(),
+                       m_engine.GetChunkSize(), m_engine.GetQueueDepth());
+        
+        //first attach of this device model - keep what the engine measured
+        if (m_engine.GetTunedChunkSize() > 0) this->SaveTunedChunkSize(pDeviceRaw, m_engine.GetTunedChunkSize());
+        
+        //publish how much of the image went through the cpu, and what failed writes cost
+        this->setProperty("FirmwareBytesCopied", m_engine.GetBytesCopied(), 32);
+        this->setProperty("FirmwareUploadRecoveries", m_engine.GetRecoveries(), 32);
+        this->setProperty("FirmwareBytesWasted", m_engine.GetWastedBytes(), 32);
+        this->setProperty("FirmwareUploadVerified", m_engine.IsImageVerified());
+        m_trace.Record(kAth3kTraceInfo, kAth3kTraceUploadDone, m_uTraceDevice, m_engine.GetResult(),
+                       m_engine.GetPosition(), m_engine.GetBytesCopied());
         
-        //opent the device
-        if (!(pDeviceRaw->open(this)))
+        //check if we transferred everything, and that it was the image of the manifest
+        bool bVerified = (config.pDigest == NULL) || m_engine.IsImageVerified();
+        if ((m_engine.GetResult() == kAth3kSuccess) && (m_engine.GetPosition() >= ATH3K_FIRMWARE_SIZE) && bVerified)
         {
-            IOLog("%s::%p::start -> error opening device\n", this->getName(), this);
+            bUploaded = true;
         }
         else
         {
-            IOLog("%s::%p::start -> device open\n", this->getName(), this);
+            IOLog("%s::%p::UploadFirmware -> error: transfer failed in step %d (%d), bytes remaining: %d, position %d, verified %d\n",
+                  this->getName(), this, m_engine.GetFailedStep(), m_engine.GetResult(),
+                  ATH3K_FIRMWARE_SIZE - m_engine.GetPosition(), m_engine.GetPosition(), bVerified);
             
+            //what led up to it
+            this->DumpTrace();
+        }
+        
+        //clean up
+        this->ReleaseUploadSlots();
+        m_pUploadDevice = NULL;
+    }
+    else IOLog("%s::%p::UploadFirmware -> error casting provider to usb device\n", this->getName(), this);
+    
+    this->ReleaseFirmware();
+    
+    return(bUploaded);
+}
+
+//
+// RunEngine
+// drives the engine on the upload thread until the upload is done: it submits whatever can
+// go out, then we sleep until the steps and the usb family hand back completions for it.
+// the engine itself is never touched from the completion callbacks
+//
+void local_IOath3kfrmwr::RunEngine(const Ath3kUploadConfig* pConfig)
+{
+    UploadEvent aEvents[UPLOAD_EVENTS_MAX];
+    
+    m_iUploadEvents = 0;
+    
+    //the body loop built for our transport, the chunking of the personality decides which
+    if (pConfig->bSingleTransfer) m_engine.StartWith<UsbTransport, Ath3kChunkWhole>(&m_transport, pConfig);
+    else m_engine.StartWith<UsbTransport, Ath3kChunkEndpoint>(&m_transport, pConfig);
+    m_engine.Pump();
+    
+    while (!m_engine.IsDone())
+    {
+        IOLockLock(m_pLockUpload);
+        while (m_iUploadEvents == 0)
+        {
+            IOLockSleep(m_pLockUpload, &m_iUploadEvents, THREAD_UNINT);
+        }
+        
+        int iEvents = m_iUploadEvents;
+        bcopy(m_aUploadEvents, aEvents, iEvents * sizeof(UploadEvent));
+        m_iUploadEvents = 0;
+        IOLockUnlock(m_pLockUpload);
+        
+        for (int iEventCounter = 0; iEventCounter < iEvents; iEventCounter++)
+        {
+            UploadEvent* pEvent = &aEvents[iEventCounter];
+            
+            if (pEvent->iSlot >= 0) m_engine.WriteComplete(pEvent->iSlot, pEvent->iResult, pEvent->iBytesDone);
+            else m_engine.StepComplete(pEvent->iStep, pEvent->iResult);
+        }
+        
+        m_engine.Pump();
+    }
+}
+
+static void SetDictionaryNumber(OSDictionary* pDictionary, const char* pKey, UInt64 uValue)
+{
+    OSNumber* pNumber = OSNumber::withNumber(uValue, 64);
+    if (pNumber == NULL) return;
+    
+    pDictionary->setObject(pKey, pNumber);
+    pNumber->release();
+}
+
+static void SetDictionaryHistogram(OSDictionary* pDictionary, const char* pKey, const uint32_t* pBuckets)
+{
+    OSArray* pArrayHistogram = OSArray::withCapacity(ATH3K_LATENCY_BUCKETS);
+    if (pArrayHistogram == NULL) return;
+    
+    for (int iBucketCounter = 0; iBucketCounter < ATH3K_LATENCY_BUCKETS; iBucketCounter++)
+    {
+        OSNumber* pNumberBucket = OSNumber::withNumber(pBuckets[iBucketCounter], 32);
+        if (pNumberBucket == NULL) continue;
+        
+        pArrayHistogram->setObject(pNumberBucket);
+        pNumberBucket->release();
+    }
+    
+    pDictionary->setObject(pKey, pArrayHistogram);
+    pArrayHistogram->release();
+}
+
+//
+// PublishUploadTiming
+// puts where the time of the last upload went into the registry, so it can be read with
+// ioreg from any machine: the time of each step, how long the bulk writes took and the
+// no-data timeouts they were given. bucket n of both histograms counts the values below
+// ChunkLatencyBucketUs << n us
+//
+void local_IOath3kfrmwr::PublishUploadTiming(const Ath3kUploadTiming* pTiming)
+{
+    static const char* s_aStepKeys[kAth3kStepDone] =
+    {
+        "OpenNs", "GetDeviceStatusNs", "ResetDeviceNs", "SetConfigurationNs", "FindBulkPipeNs", "ControlRequestNs",
+        "BulkWritesNs", "CloseNs", "ClearPipeStallNs"
+    };
+    
+    OSDictionary* pDictionaryTiming = OSDictionary::withCapacity(kAth3kStepDone + 13);
+    if (pDictionaryTiming == NULL) return;
+    
+    for (int iStepCounter = 0; iStepCounter < kAth3kStepDone; iStepCounter++)
+    {
+        SetDictionaryNumber(pDictionaryTiming, s_aStepKeys[iStepCounter], pTiming->aStepNanoseconds[iStepCounter]);
+    }
+    SetDictionaryNumber(pDictionaryTiming, "TotalNs", pTiming->uTotalNanoseconds);
+    SetDictionaryNumber(pDictionaryTiming, "RecoveryNs", pTiming->uRecoveryNanoseconds);
+    
+    SetDictionaryNumber(pDictionaryTiming, "Chunks", pTiming->uChunks);
+    SetDictionaryNumber(pDictionaryTiming, "ChunkMinNs", pTiming->uChunkMinNanoseconds);
+    SetDictionaryNumber(pDictionaryTiming, "ChunkMaxNs", pTiming->uChunkMaxNanoseconds);
+    SetDictionaryNumber(pDictionaryTiming, "ChunkMeanNs",
+                        (pTiming->uChunks > 0) ? pTiming->uChunkSumNanoseconds / pTiming->uChunks : 0);
+    SetDictionaryNumber(pDictionaryTiming, "ChunkLatencyBucketUs", ATH3K_LATENCY_BUCKET_US);
+    SetDictionaryHistogram(pDictionaryTiming, "ChunkLatencyHistogram", pTiming->aChunkLatency);
+    
+    SetDictionaryNumber(pDictionaryTiming, "ChunkNoDataTimeoutMinMs", pTiming->uNoDataTimeoutMinMs);
+    SetDictionaryNumber(pDictionaryTiming, "ChunkNoDataTimeoutMaxMs", pTiming->uNoDataTimeoutMaxMs);
+    SetDictionaryHistogram(pDictionaryTiming, "ChunkNoDataTimeoutHistogram", pTiming->aNoDataTimeout);
+    SetDictionaryNumber(pDictionaryTiming, "ChunkCompletionTimeoutMaxMs", pTiming->uCompletionTimeoutMaxMs);
+    
+    this->setProperty("UploadTiming", pDictionaryTiming);
+    pDictionaryTiming->release();
+}
+
+void local_IOath3kfrmwr::PostUploadEvent(int iStep, int iSlot, int iResult, int iBytesDone)
+{
+    IOLockLock(m_pLockUpload);
+    
+    //never more than one step and the queued writes outstanding, so this cannot fill up
+    if (m_iUploadEvents < UPLOAD_EVENTS_MAX)
+    {
+        UploadEvent* pEvent = &m_aUploadEvents[m_iUploadEvents++];
+        pEvent->iStep = iStep;
+        pEvent->iSlot = iSlot;
+        pEvent->iResult = iResult;
+        pEvent->iBytesDone = iBytesDone;
+    }
+    IOLockWakeup(m_pLockUpload, &m_iUploadEvents, false);
+    
+    IOLockUnlock(m_pLockUpload);
+}
+
+//
+// RunUploadStep
+// the device level steps of the engine, done right away on the upload thread
+//
+int local_IOath3kfrmwr::RunUploadStep(int iStep)
+{
+    IOReturn kResult = kIOReturnSuccess;
+    UInt32 uDetail = 0;
+    
+    switch (iStep)
+    {
+        case kAth3kStepOpen:
+            //opent the device
+            if (!(m_pUploadDevice->open(this)))
+            {
+                IOLog("%s::%p::RunUploadStep -> error opening device\n", this->getName(), this);
+                return(kAth3kErrorNoDevice);
+            }
+            break;
+            
+        case kAth3kStepGetStatus:
+        {
             USBStatus statusDevice = 0;
-            kResult = pDeviceRaw->GetDeviceStatus(&statusDevice);
+            kResult = m_pUploadDevice->GetDeviceStatus(&statusDevice);
             if (kResult != KERN_SUCCESS)
             {
-                IOLog("%s::%p::start -> error getting status (%08x)\n", this->getName(), this, kResult);
+                IOLog("%s::%p::RunUploadStep -> error getting status (%08x)\n", this->getName(), this, kResult);
             }
-            else
+            else uDetail = statusDevice;
+            break;
+        }
+            
+        case kAth3kStepReset:
+            //a restart after a failed body still holds the interface the reset takes away
+            m_pUploadPipe = NULL;
+            if (m_pUploadInterface != NULL)
             {
-                IOLog("%s::%p::start -> device status: (%08x)\n", this->getName(), this, statusDevice);
+                m_pUploadInterface->close(this);
+                m_pUploadInterface = NULL;
             }
             
             //reset the device to set the device for configuration
-            kResult = pDeviceRaw->ResetDevice();
+            kResult = m_pUploadDevice->ResetDevice();
             if (kResult != KERN_SUCCESS)
             {
-                IOLog("%s::%p::start -> error resetting device (%08x)\n", this->getName(), this, kResult);
+                IOLog("%s::%p::RunUploadStep -> error resetting device (%08x)\n", this->getName(), this, kResult);
             }
-            else
+            break;
+            
+        case kAth3kStepConfigure:
+        {
+            //get the configuration descriptor so we can set the default one
+            const IOUSBConfigurationDescriptor* pDeviceConfiguration = m_pUploadDevice->GetFullConfigurationDescriptor(0);
+            if (pDeviceConfiguration == NULL)
             {
-                IOLog("%s::%p::start -> device reset\n", this->getName(), this);
-                
-                //get the configuration descriptor so we can set the default one
-                const IOUSBConfigurationDescriptor* pDeviceConfiguration = pDeviceRaw->GetFullConfigurationDescriptor(0);
-                if (pDeviceConfiguration != NULL)
+                IOLog("%s::%p::RunUploadStep -> error getting configuration descriptor\n", this->getName(), this);
+                return(kAth3kErrorIO);
+            }
+            
+            //set the configuration for the device
+            kResult = m_pUploadDevice->SetConfiguration(this, pDeviceConfiguration->bConfigurationValue);
+            if (kResult != KERN_SUCCESS)
+            {
+                IOLog("%s::%p::RunUploadStep -> error setting device configuration (%08x)\n", this->getName(), this,
+                      kResult);
+            }
+            break;
+        }
+            
+        case kAth3kStepFindPipe:
+        {
+            IOUSBInterface* pInterfaceWithBulkPipeOut = NULL;
+            int iBulkPipeOutNumber = -1;
+            
+            //the endpoint table says where the pipe is, so no interface has to be opened to look
+            Ath3kEndpoint endpoint;
+            bool bCached = false;
+            if (this->GetBulkOutEndpoint(m_pUploadDevice, &endpoint, &bCached))
+            {
+                pInterfaceWithBulkPipeOut = this->FindInterface(m_pUploadDevice, &endpoint);
+                if (pInterfaceWithBulkPipeOut != NULL)
                 {
-                    IOLog("%s::%p::start -> device configuration recieved\n", this->getName(), this);
-                    
-                    //set the configuration for the device
-                    kResult = pDeviceRaw->SetConfiguration(this, pDeviceConfiguration->bConfigurationValue);
-                    if (kResult != KERN_SUCCESS)
-                    {
-                        IOLog("%s::%p::start -> error setting device configuration (%08x)\n", this->getName(), this,
-                              kResult);
-                    }
-                    else
-                    {
-                        IOLog("%s::%p::start -> device configured\n", this->getName(), this);
-                        
-                        //get the interface with the bulk pipe out
-                        IOUSBInterface* pInterfaceWithBulkPipeOut = this->GetInterfaceWithBulkPipeOut(pDeviceRaw);
-                        if (pInterfaceWithBulkPipeOut != NULL)
-                        {
-                            //open the interface
-                            if (!pInterfaceWithBulkPipeOut->open(this))
-                            {
-                                IOLog("%s::%p::start -> error opening interface\n", this->getName(), this);
-                            }
-                            else
-                            {
-                                //get the bulk pipe number
-                                int iBulkPipeOutNumber = this->GetBulkPipeOutNumber(pInterfaceWithBulkPipeOut);
-                                if (iBulkPipeOutNumber >= 0)
-                                {
-                                    IOLog("%s::%p::start -> using bulk pipe #%d\n", this->getName(), this,
-                                          iBulkPipeOutNumber);
-                                    
-                                    //get the pointer to the bulk pipe
-                                    IOUSBPipe* pBulkPipe = pInterfaceWithBulkPipeOut->GetPipeObj(iBulkPipeOutNumber);
-                                    if (pBulkPipe != NULL)
-                                    {
-                                        IOLog("%s::%p::start -> bulk pipe assigned\n", this->getName(), this);
-                                        
-                                        
-                                        //start the actual transfer
-                                        //stage 1: use the control request to set the device to receive
-                                        //         and transfer the first 20 bytes from the firmware
-                                        
-                                        //set up parameters for the transfer
-                                        int iFirmwareRemaining = sizeof(g_bytesFirmware);
-                                        int iPosition = 0;
-                                        int iTransferSize = 20;
-                                        
-                                        //set up memory - create a buffer in kernel io memory
-                                        unsigned char* pBufferTransfer = (unsigned char*)::IOMalloc(BULK_SIZE);
-                                        if (pBufferTransfer != NULL)
-                                        {
-                                            IOLog("%s::%p::start -> kernel io memory allocated\n", this->getName(), this);
-                                            
-                                            //copy firmware from global buffer to the kernel io memory
-                                            ::memcpy(pBufferTransfer, g_bytesFirmware, iTransferSize);
-                                            
-                                            //create the request
-                                            IOUSBDevRequest requestWriteFirmware;
-                                            requestWriteFirmware.bmRequestType = USBmakebmRequestType(kUSBOut, kUSBVendor,
-                                                                                                      kUSBDevice);
-                                            requestWriteFirmware.bRequest = USB_REQ_DFU_DNLOAD;
-                                            requestWriteFirmware.wIndex = 0;
-                                            requestWriteFirmware.wValue = 0;
-                                            requestWriteFirmware.wLength = iTransferSize;
-                                            requestWriteFirmware.pData = pBufferTransfer;
-                                            
-                                            //send the request
-                                            kResult = pDeviceRaw->DeviceRequest(&requestWriteFirmware, 10000, 10000);
-                                            if (kResult != KERN_SUCCESS)
-                                            {
-                                                IOLog("%s::%p::start -> error sending control request (%08x)\n",
-                                                      this->getName(), this, kResult);
-                                            }
-                                            else
-                                            {
-                                                IOLog("%s::%p::start -> control request sent\n", this->getName(), this);
-                                                
-                                                //update the counters
-                                                iPosition += iTransferSize;
-                                                iFirmwareRemaining -= iTransferSize;
-                                                
-                                                //set the memorydescriptor we will need in the bulk request
-                                                IOMemoryDescriptor* pDescriptorBuffer = IOMemoryDescriptor::withAddress(pBufferTransfer,
-                                                                                                                        BULK_SIZE,
-                                                                                                                        kIODirectionNone);
-                                                if (pDescriptorBuffer != NULL)
-                                                {
-                                                    kResult = pDescriptorBuffer->prepare();
-                                                    if (kResult != KERN_SUCCESS)
-                                                    {
-                                                        IOLog("%s::%p::start -> error preparing io memory descriptor (%08x)\n", this->getName(),
-                                                              this, kResult);
-                                                    }
-                                                    else
-                                                    {
-                                                        //loop through the rest of the firmware and transfer through the bulk pipe
-                                                        while (iFirmwareRemaining > 0)
-                                                        {
-                                                            //is memcpy the right one to use???!?!
-                                                            iTransferSize = MIN(iFirmwareRemaining, BULK_SIZE);
-                                                            ::memcpy(pBufferTransfer, g_bytesFirmware + iPosition, iTransferSize);
-                                                            
-                                                            kResult = pBulkPipe->Write(pDescriptorBuffer, 10000, 10000, iTransferSize);
-                                                            if (kResult != KERN_SUCCESS)
-                                                            {
-                                                                IOLog("%s::%p::start -> error writing to bulk pipe (%08x)\n", this->getName(),
-                                                                      this, kResult);
-                                                                
-                                                                break;
-                                                            }
-                                                            else
-                                                            {
-                                                                iPosition += iTransferSize;
-                                                                iFirmwareRemaining -= iTransferSize;
-                                                            }
-                                                        }
-                                                        
-                                                        kResult = pDescriptorBuffer->complete();
-                                                        if (kResult != KERN_SUCCESS)
-                                                        {
-                                                            IOLog("%s::%p::start -> error completing memory descriptor (%08x)\n", this->getName(),
-                                                                  this, kResult);
-                                                        }
-                                                        else
-                                                        {
-                                                            IOLog("%s::%p::start -> memory descriptor completed\n", this->getName(), this);
-                                                        }
-                                                        pDescriptorBuffer->release();
-                                                        IOLog("%s::%p::start -> memory descriptor released\n", this->getName(), this);
-                                                    }
-                                                }
-                                                else
-                                                {
-                                                    IOLog("%s::%p::start -> error creating descriptor for io memory\n", this->getName(), this);
-                                                }
-                                                
-                                                //check if we transferred everything
-                                                if (iFirmwareRemaining <= 0)
-                                                {
-                                                    IOLog("%s::%p::start -> transfer successful (%d bytes)\n", this->getName(), this, iPosition);
-                                                    
-                                                    //reset the device to clean the interfaces
-                                                    /*kResult = pDeviceRaw->ResetDevice();
-                                                     if (kResult != KERN_SUCCESS)
-                                                     {
-                                                     IOLog("%s::%p::start -> error resetting device for final (%08x)\n", this->getName(), this, kResult);
-                                                     }
-                                                     else
-                                                     {
-                                                     IOLog("%s::%p::start -> device final reset\n", this->getName(), this);
-                                                     
-                                                     //re-configure the device
-                                                     kResult = pDeviceRaw->SetConfiguration(this, pDeviceConfiguration->bConfigurationValue);
-                                                     if (kResult != KERN_SUCCESS)
-                                                     {
-                                                     IOLog("%s::%p::start -> error reconfiguring the device (%08x)\n", this->getName(), this,
-                                                     kResult);
-                                                     }
-                                                     else
-                                                     {
-                                                     IOLog("%s::%p::start -> device reconfigured\n", this->getName(), this);
-                                                     }
-                                                     }*/
-                                                }
-                                                else
-                                                {
-                                                    IOLog("%s::%p::start -> error: transfer failed, bytes remaining: %d, position %d\n",
-                                                          this->getName(), this, iFirmwareRemaining, iPosition);
-                                                }
-                                            }
-                                            
-                                            //clean up - unallocate kernel io memory
-                                            ::IOFree(pBufferTransfer, BULK_SIZE);
-                                            IOLog("%s::%p::start -> kernel io memory free\n", this->getName(), this);
-                                        }
-                                        else
-                                        {
-                                            IOLog("%s::%p::start -> error allocating kernel io memory\n", this->getName(),
-                                                  this);
-                                        }
-                                        
-                                        //clean up - release the pipe
-                                        //pBulkPipe->release();
-                                        //IOLog("%s::%p::start -> bulk pipe out released\n", this->getName(), this);
-                                    }
-                                    else
-                                    {
-                                        IOLog("%s::%p::start -> could not assign bulk pipe\n", this->getName(), this);
-                                    }
-                                }
-                                else
-                                {
-                                    IOLog("%s::%p::start -> error getting bulk pipe out #\n", this->getName(), this);
-                                }
-                                
-                                //clean up
-                                pInterfaceWithBulkPipeOut->close(this);
-                                //pInterfaceWithBulkPipeOut->release();
-                                IOLog("%s::%p::start -> interface closed\n", this->getName(), this);
-                            }
-                        }
-                        else
-                        {
-                            IOLog("%s::%p::start -> error getting interface with bulk pipe\n", this->getName(), this);
-                        }
-                    }
+                    iBulkPipeOutNumber = endpoint.uIndex;
+                    m_trace.Record(kAth3kTraceInfo, kAth3kTraceEndpoint, m_uTraceDevice, endpoint.bEndpointAddress,
+                                   endpoint.bInterfaceNumber, bCached);
                 }
-                else
+            }
+            
+            //get the interface with the bulk pipe out
+            if (pInterfaceWithBulkPipeOut == NULL)
+            {
+                pInterfaceWithBulkPipeOut = this->GetInterfaceWithBulkPipeOut(m_pUploadDevice);
+            }
+            if (pInterfaceWithBulkPipeOut == NULL)
+            {
+                IOLog("%s::%p::RunUploadStep -> error getting interface with bulk pipe\n", this->getName(), this);
+                return(kAth3kErrorNoDevice);
+            }
+            
+            //open the interface
+            if (!pInterfaceWithBulkPipeOut->open(this))
+            {
+                IOLog("%s::%p::RunUploadStep -> error opening interface\n", this->getName(), this);
+                return(kAth3kErrorNoDevice);
+            }
+            m_pUploadInterface = pInterfaceWithBulkPipeOut;
+            
+            //a table that does not match the pipes is not trusted, we walk them instead
+            if (iBulkPipeOutNumber >= 0)
+            {
+                IOUSBPipe* pPipe = pInterfaceWithBulkPipeOut->GetPipeObj(iBulkPipeOutNumber);
+                if ((pPipe == NULL) || (pPipe->GetType() != kUSBBulk) || (pPipe->GetDirection() != kUSBOut))
                 {
-                    IOLog("%s::%p::start -> error getting configuration descriptor\n", this->getName(), this);
+                    iBulkPipeOutNumber = -1;
                 }
             }
             
+            //get the bulk pipe number
+            if (iBulkPipeOutNumber < 0) iBulkPipeOutNumber = this->GetBulkPipeOutNumber(pInterfaceWithBulkPipeOut);
+            if (iBulkPipeOutNumber < 0)
+            {
+                IOLog("%s::%p::RunUploadStep -> error getting bulk pipe out #\n", this->getName(), this);
+                return(kAth3kErrorNoDevice);
+            }
+            
+            //get the pointer to the bulk pipe
+            m_pUploadPipe = pInterfaceWithBulkPipeOut->GetPipeObj(iBulkPipeOutNumber);
+            if (m_pUploadPipe == NULL)
+            {
+                IOLog("%s::%p::RunUploadStep -> could not assign bulk pipe\n", this->getName(), this);
+                return(kAth3kErrorNoDevice);
+            }
+            uDetail = iBulkPipeOutNumber;
+            break;
+        }
+            
+        case kAth3kStepClearStall:
+            //clears the halt on our side and sends CLEAR_FEATURE(ENDPOINT_HALT) to the device
+            kResult = m_pUploadPipe->ClearPipeStall(true);
+            if (kResult != KERN_SUCCESS)
+            {
+                IOLog("%s::%p::RunUploadStep -> error clearing bulk pipe stall (%08x)\n", this->getName(), this, kResult);
+            }
+            break;
+            
+        case kAth3kStepClose:
             //clean up
-            pDeviceRaw->close(this);
-            //pDeviceRaw->release();
-            IOLog("%s::%p::start -> device closed\n", this->getName(), this);
+            m_pUploadPipe = NULL;
+            if (m_pUploadInterface != NULL)
+            {
+                m_pUploadInterface->close(this);
+                m_pUploadInterface = NULL;
+            }
+            
+            m_pUploadDevice->close(this);
+            break;
+    }
+    
+    m_trace.Record(kAth3kTraceInfo, kAth3kTraceStepDone, m_uTraceDevice, iStep, GetEngineResult(kResult), uDetail);
+    return(GetEngineResult(kResult));
+}
+
+int local_IOath3kfrmwr::SendUploadControl(const Ath3kControlRequest* pRequest, const uint8_t* pData, UInt32 uTimeoutMs)
+{
+    //create the request
+    IOUSBDevRequest requestWriteFirmware;
+    requestWriteFirmware.bmRequestType = pRequest->bmRequestType;
+    requestWriteFirmware.bRequest = pRequest->bRequest;
+    requestWriteFirmware.wIndex = pRequest->wIndex;
+    requestWriteFirmware.wValue = pRequest->wValue;
+    requestWriteFirmware.wLength = pRequest->wLength;
+    requestWriteFirmware.pData = (void*)pData;
+    
+    //send the request
+    IOReturn kResult = m_pUploadDevice->DeviceRequest(&requestWriteFirmware, uTimeoutMs, uTimeoutMs);
+    if (kResult != KERN_SUCCESS)
+    {
+        IOLog("%s::%p::SendUploadControl -> error sending control request (%08x)\n", this->getName(), this, kResult);
+    }
+    else
+    {
+        m_trace.Record(kAth3kTraceInfo, kAth3kTraceControlSent, m_uTraceDevice);
+    }
+    
+    return(GetEngineResult(kResult));
+}
+
+//
+// BorrowPoolBuffer
+// a wired staging buffer of at least iCapacity bytes. the smallest free one in the pool that
+// fits is a hit. a miss allocates one for an empty entry, or for a free entry whose buffer
+// is too small. with every entry lent out the buffer is not pooled (*piEntry is -1) and is
+// freed again when it comes back
+//
+IOBufferMemoryDescriptor* local_IOath3kfrmwr::BorrowPoolBuffer(int iCapacity, int* piEntry)
+{
+    vm_size_t uCapacity = IORound((vm_size_t)iCapacity, PAGE_SIZE);
+    UInt32 uAllMask = (1U << BUFFER_POOL_ENTRIES) - 1;
+    int iEntry = -1;
+    
+    for (;;)
+    {
+        UInt32 uFree = __atomic_load_n(&g_bufferPool.uFreeMask, __ATOMIC_ACQUIRE);
+        UInt32 uUsed = __atomic_load_n(&g_bufferPool.uUsedMask, __ATOMIC_ACQUIRE);
+        int iFit = -1;
+        int iSmall = -1;
+        
+        for (int iEntryCounter = 0; iEntryCounter < BUFFER_POOL_ENTRIES; iEntryCounter++)
+        {
+            if ((uFree & (1U << iEntryCounter)) == 0) continue;
+            
+            vm_size_t uEntryCapacity = g_bufferPool.aCapacities[iEntryCounter];
+            if (uEntryCapacity < uCapacity) iSmall = iEntryCounter;
+            else if ((iFit < 0) || (uEntryCapacity < g_bufferPool.aCapacities[iFit])) iFit = iEntryCounter;
+        }
+        
+        //somebody else got to the entry first when the swap fails, so we look again
+        if (iFit >= 0)
+        {
+            if (!__atomic_compare_exchange_n(&g_bufferPool.uFreeMask, &uFree, uFree & ~(1U << iFit), false,
+                                             __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) continue;
+            
+            __atomic_fetch_add(&g_bufferPool.uHits, 1, __ATOMIC_RELAXED);
+            CountPoolBorrow();
+            *piEntry = iFit;
+            return(g_bufferPool.aBuffers[iFit]);
+        }
+        if (uUsed != uAllMask)
+        {
+            int iEmpty = __builtin_ctz(~uUsed);
+            if (!__atomic_compare_exchange_n(&g_bufferPool.uUsedMask, &uUsed, uUsed | (1U << iEmpty), false,
+                                             __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) continue;
+            
+            iEntry = iEmpty;
+            break;
+        }
+        if (iSmall >= 0)
+        {
+            if (!__atomic_compare_exchange_n(&g_bufferPool.uFreeMask, &uFree, uFree & ~(1U << iSmall), false,
+                                             __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) continue;
+            
+            iEntry = iSmall;
+            break;
         }
+        
+        break;
+    }
+    
+    __atomic_fetch_add(&g_bufferPool.uMisses, 1, __ATOMIC_RELAXED);
+    
+    //the entry is ours now - drop the buffer that was too small
+    if ((iEntry >= 0) && (g_bufferPool.aBuffers[iEntry] != NULL))
+    {
+        g_bufferPool.aBuffers[iEntry]->complete();
+        g_bufferPool.aBuffers[iEntry]->release();
+        g_bufferPool.aBuffers[iEntry] = NULL;
+        g_bufferPool.aCapacities[iEntry] = 0;
+    }
+    
+    IOReturn kResult = kIOReturnNoMemory;
+    IOBufferMemoryDescriptor* pBuffer = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, kIODirectionOut,
+                                                                                         uCapacity,
+                                                                                         BUFFER_POOL_PHYSICAL_MASK);
+    if (pBuffer != NULL) kResult = pBuffer->prepare();
+    if (kResult != kIOReturnSuccess)
+    {
+        IOLog("%s::%p::BorrowPoolBuffer -> error allocating staging buffer of %u bytes (%08x)\n", this->getName(), this,
+              (unsigned int)uCapacity, kResult);
+        if (pBuffer != NULL) pBuffer->release();
+        
+        //the entry goes back empty
+        if (iEntry >= 0) __atomic_fetch_and(&g_bufferPool.uUsedMask, ~(1U << iEntry), __ATOMIC_RELEASE);
+        return(NULL);
+    }
+    
+    if (iEntry >= 0)
+    {
+        g_bufferPool.aBuffers[iEntry] = pBuffer;
+        g_bufferPool.aCapacities[iEntry] = uCapacity;
+    }
+    
+    CountPoolBorrow();
+    *piEntry = iEntry;
+    return(pBuffer);
+}
+
+//a buffer of the pool is free again once its bit is back, buffers outside of it are freed
+void local_IOath3kfrmwr::ReturnPoolBuffer(IOBufferMemoryDescriptor* pBuffer, int iEntry)
+{
+    __atomic_fetch_sub(&g_bufferPool.iBorrowed, 1, __ATOMIC_RELAXED);
+    
+    if (iEntry >= 0)
+    {
+        __atomic_fetch_or(&g_bufferPool.uFreeMask, 1U << iEntry, __ATOMIC_RELEASE);
+        return;
+    }
+    
+    pBuffer->complete();
+    pBuffer->release();
+}
+
+//
+// GetUploadSlotBuffer
+// the staging buffer of a slot, borrowed from the pool when it is first needed and swapped
+// for a bigger one when a bigger chunk comes along
+//
+uint8_t* local_IOath3kfrmwr::GetUploadSlotBuffer(int iSlot, int iCapacity)
+{
+    UploadSlot* pSlot = &m_aUploadSlots[iSlot];
+    
+    if ((pSlot->pBuffer != NULL) && (pSlot->pBuffer->getCapacity() >= (vm_size_t)iCapacity))
+    {
+        return((uint8_t*)pSlot->pBuffer->getBytesNoCopy());
+    }
+    
+    if (pSlot->pBuffer != NULL)
+    {
+        this->ReturnPoolBuffer(pSlot->pBuffer, pSlot->iPoolEntry);
+        pSlot->pBuffer = NULL;
     }
-    else IOLog("%s::%p::start -> error casting provider to usb device\n", this->getName(), this);
     
-    //remove our driver
-    //this->stop(provider);
+    pSlot->pBuffer = this->BorrowPoolBuffer(iCapacity, &pSlot->iPoolEntry);
+    if (pSlot->pBuffer == NULL) return(NULL);
     
-    return(false);
+    return((uint8_t*)pSlot->pBuffer->getBytesNoCopy());
+}
+
+//
+// SubmitBulkWrite
+// queues one chunk on the bulk pipe, from the staging buffer of the slot or in zero copy
+// mode as a subrange of the image, which is described and wired once for the whole upload.
+// the engine works the timeouts out from how fast the writes before went
+//
+int local_IOath3kfrmwr::SubmitBulkWrite(int iSlot, const uint8_t* pData, int iLength, bool bInPlace, UInt32 uNoDataMs,
+                                        UInt32 uCompletionMs)
+{
+    UploadSlot* pSlot = &m_aUploadSlots[iSlot];
+    IOMemoryDescriptor* pDescriptorWrite = pSlot->pBuffer;
+    IOReturn kResult = kIOReturnSuccess;
+    
+    if (bInPlace)
+    {
+        //the image is page aligned and stays in the cache while we hold it
+        if (m_pDescriptorImage == NULL) m_pDescriptorImage = this->GetFirmwareDescriptor();
+        if (m_pDescriptorImage == NULL) return(kAth3kErrorNoMemory);
+        
+        //drop the subrange of the previous write on this slot and describe the next chunk in place
+        if (pSlot->pSubRange != NULL) pSlot->pSubRange->release();
+        pSlot->pSubRange = IOSubMemoryDescriptor::withSubRange(m_pDescriptorImage, pData - m_pFirmwareImage, iLength,
+                                                               kIODirectionOut);
+        pDescriptorWrite = pSlot->pSubRange;
+    }
+    
+    if (pDescriptorWrite == NULL) return(kAth3kErrorNoMemory);
+    
+    pSlot->iLength = iLength;
+    pSlot->completion.target = this;
+    pSlot->completion.action = &local_IOath3kfrmwr::BulkWriteComplete;
+    pSlot->completion.parameter = pSlot;
+    
+    kResult = m_pUploadPipe->Write(pDescriptorWrite, uNoDataMs, uCompletionMs, iLength, &pSlot->completion);
+    if (kResult != kIOReturnSuccess)
+    {
+        IOLog("%s::%p::SubmitBulkWrite -> error queueing bulk write (%08x)\n", this->getName(), this, kResult);
+    }
+    else m_trace.Record(kAth3kTraceDebug, kAth3kTraceWriteSubmitted, m_uTraceDevice, iSlot, iLength, uNoDataMs);
+    
+    return(GetEngineResult(kResult));
+}
+
+void local_IOath3kfrmwr::ReleaseUploadSlots(void)
+{
+    for (int iSlotCounter = 0; iSlotCounter < UPLOAD_QUEUE_DEPTH_MAX; iSlotCounter++)
+    {
+        UploadSlot* pSlot = &m_aUploadSlots[iSlotCounter];
+        
+        if (pSlot->pSubRange != NULL)
+        {
+            pSlot->pSubRange->release();
+            pSlot->pSubRange = NULL;
+        }
+        if (pSlot->pBuffer != NULL)
+        {
+            this->ReturnPoolBuffer(pSlot->pBuffer, pSlot->iPoolEntry);
+            pSlot->pBuffer = NULL;
+        }
+    }
+    
+    //how well the pool served the uploads so far
+    UInt32 uHits = __atomic_load_n(&g_bufferPool.uHits, __ATOMIC_RELAXED);
+    UInt32 uMisses = __atomic_load_n(&g_bufferPool.uMisses, __ATOMIC_RELAXED);
+    SInt32 iPeak = __atomic_load_n(&g_bufferPool.iBorrowedPeak, __ATOMIC_RELAXED);
+    this->setProperty("BufferPoolHits", uHits, 32);
+    this->setProperty("BufferPoolMisses", uMisses, 32);
+    this->setProperty("BufferPoolPeak", iPeak, 32);
+    m_trace.Record(kAth3kTraceInfo, kAth3kTraceBufferPool, m_uTraceDevice, uHits, uMisses, iPeak);
+}
+
+//the transport only forwards to the driver - the steps are synchronous there, so their
+//results are queued like the bulk completions and the engine sees them on its next round
+int local_IOath3kfrmwr::UsbTransport::StartStep(int iStep)
+{
+    m_pOwner->PostUploadEvent(iStep, -1, m_pOwner->RunUploadStep(iStep), 0);
+    return(kAth3kSuccess);
+}
+
+int local_IOath3kfrmwr::UsbTransport::SendControl(const Ath3kControlRequest* pRequest, const uint8_t* pData,
+                                                  uint32_t uTimeoutMs)
+{
+    m_pOwner->PostUploadEvent(kAth3kStepControl, -1, m_pOwner->SendUploadControl(pRequest, pData, uTimeoutMs), 0);
+    return(kAth3kSuccess);
+}
+
+int local_IOath3kfrmwr::UsbTransport::GetPacketSize(void)
+{
+    return(m_pOwner->GetPacketSize(m_pOwner->m_pUploadPipe));
+}
+
+int local_IOath3kfrmwr::UsbTransport::GetSpeed(void)
+{
+    switch (m_pOwner->m_pUploadDevice->GetSpeed())
+    {
+        case kUSBDeviceSpeedLow:
+            return(kAth3kSpeedLow);
+            
+        case kUSBDeviceSpeedFull:
+            return(kAth3kSpeedFull);
+            
+        case kUSBDeviceSpeedHigh:
+            return(kAth3kSpeedHigh);
+            
+        default:
+            return(kAth3kSpeedSuper);
+    }
+}
+
+uint8_t* local_IOath3kfrmwr::UsbTransport::GetSlotBuffer(int iSlot, int iCapacity)
+{
+    return(m_pOwner->GetUploadSlotBuffer(iSlot, iCapacity));
+}
+
+int local_IOath3kfrmwr::UsbTransport::BulkWrite(int iSlot, const uint8_t* pData, int iLength, bool bInPlace,
+                                                uint32_t uNoDataMs, uint32_t uCompletionMs)
+{
+    return(m_pOwner->SubmitBulkWrite(iSlot, pData, iLength, bInPlace, uNoDataMs, uCompletionMs));
+}
+
+void local_IOath3kfrmwr::UsbTransport::AbortBulk(void)
+{
+    m_pOwner->m_pUploadPipe->Abort();
+}
+
+uint64_t local_IOath3kfrmwr::UsbTransport::GetTimeNanoseconds(void)
+{
+    return(GetUptimeNanoseconds());
 }
 
 void local_IOath3kfrmwr::stop(IOService *provider)
 {
-    IOLog("%s(%p)::stop\n", getName(), this);
+    m_trace.Record(kAth3kTraceInfo, kAth3kTraceStop, m_uTraceDevice);
+    
+    //an upload that never got a slot can just leave the queue
+    bool bDequeued = false;
+    IOLockLock(g_lockClass.pLock);
+    if (g_loaderService.pQueue != NULL)
+    {
+        unsigned int uIndex = g_loaderService.pQueue->getNextIndexOfObject(this, 0);
+        if (uIndex != (unsigned int)-1)
+        {
+            g_loaderService.pQueue->removeObject(uIndex);
+            bDequeued = true;
+        }
+    }
+    IOLockUnlock(g_lockClass.pLock);
+    
+    if (bDequeued)
+    {
+        m_bUploadRunning = false;
+        this->release();
+    }
+    
+    //the upload still uses the provider - wait for it to finish
+    IOLockLock(m_pLockUpload);
+    while (m_bUploadRunning)
+    {
+        IOLockSleep(m_pLockUpload, &m_bUploadRunning, THREAD_UNINT);
+    }
+    IOLockUnlock(m_pLockUpload);
+    
     super::stop(provider);
 }
 
@@ -3,15 +3,132 @@
 #define __IOATH3KFRMWR__
 
 #include <IOKit/IOService.h>
+#include <IOKit/IOLocks.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/usb/USB.h>
+#include <kern/thread_call.h>
+
+#include "ath3k-endpoints.h"
+#include "ath3k-engine.h"
+#include "ath3k-trace.h"
+
+//number of bulk writes we keep queued on the pipe at once
+#define UPLOAD_QUEUE_DEPTH_MIN      2
+#define UPLOAD_QUEUE_DEPTH_MAX      ATH3K_QUEUE_DEPTH_MAX
+#define UPLOAD_QUEUE_DEPTH_DEFAULT  4
+
+//stalled or timed out bulk writes an upload recovers from before it fails
+#define UPLOAD_RECOVERIES_DEFAULT   2
+
+//completions waiting for the upload thread - one per queued write plus the running step
+#define UPLOAD_EVENTS_MAX           (UPLOAD_QUEUE_DEPTH_MAX + 2)
 
 class local_IOath3kfrmwr : public IOService
 {
     OSDeclareDefaultStructors(local_IOath3kfrmwr)
 
 private:
+    //the engine's view of the device. the IOKit side of every call is done by the driver.
+    //final, so the body loop the engine is specialized on for it calls it directly
+    class UsbTransport final : public Ath3kTransport
+    {
+    public:
+        local_IOath3kfrmwr* m_pOwner;
+        
+        virtual int StartStep(int iStep);
+        virtual int SendControl(const Ath3kControlRequest* pRequest, const uint8_t* pData, uint32_t uTimeoutMs);
+        virtual int GetPacketSize(void);
+        virtual int GetSpeed(void);
+        virtual uint8_t* GetSlotBuffer(int iSlot, int iCapacity);
+        virtual int BulkWrite(int iSlot, const uint8_t* pData, int iLength, bool bInPlace, uint32_t uNoDataMs,
+                              uint32_t uCompletionMs);
+        virtual void AbortBulk(void);
+        virtual uint64_t GetTimeNanoseconds(void);
+    };
+    
+    //one in-flight bulk write with either its own staging buffer or a subrange of the image
+    struct UploadSlot
+    {
+        IOBufferMemoryDescriptor* pBuffer;
+        int iPoolEntry;         //where pBuffer came from in the buffer pool, -1 if from outside
+        IOMemoryDescriptor* pSubRange;
+        IOUSBCompletion completion;
+        int iLength;
+    };
+    
+    //a finished step or bulk write (iSlot >= 0) for the engine
+    struct UploadEvent
+    {
+        int iStep;
+        int iSlot;
+        int iResult;
+        int iBytesDone;
+    };
+    
+    IOLock* m_pLockUpload;
+    UploadEvent m_aUploadEvents[UPLOAD_EVENTS_MAX];
+    int m_iUploadEvents;
+    
+    Ath3kUploadEngine m_engine;
+    UsbTransport m_transport;
+    IOUSBDevice* m_pUploadDevice;
+    IOUSBInterface* m_pUploadInterface;
+    IOUSBPipe* m_pUploadPipe;
+    IOMemoryDescriptor* m_pDescriptorImage;
+    UploadSlot m_aUploadSlots[UPLOAD_QUEUE_DEPTH_MAX];
+    const unsigned char* m_pFirmwareImage;
+    
+    thread_call_t m_pThreadCallUpload;
+    IOService* m_pUploadProvider;
+    bool m_bUploadRunning;
+    
+    //events of the instance, written without a lock and only turned into text by DumpTrace
+    Ath3kTraceRecord* m_pTraceRecords;
+    Ath3kTraceRing m_trace;
+    UInt32 m_uTraceDevice;
+    
     IOUSBInterface* GetInterfaceWithBulkPipeOut(IOUSBDevice* pDeviceToSearch);
+    bool GetBulkOutEndpoint(IOUSBDevice* pDevice, Ath3kEndpoint* pEndpoint, bool* pbCached);
+    IOUSBInterface* FindInterface(IOUSBDevice* pDevice, const Ath3kEndpoint* pEndpoint);
     int GetBulkPipeOutNumber(IOUSBInterface* pInterface);
     
+    int GetUploadQueueDepth(void);
+    bool GetUploadZeroCopy(void);
+    bool GetUploadVerifySha256(void);
+    bool GetUploadSingleTransfer(void);
+    int GetUploadRecoveries(void);
+    UInt32 GetUploadTimeout(const char* pKey);
+    int GetMaxConcurrentUploads(void);
+    int GetTraceLevel(void);
+    int GetFirmwareState(IOUSBDevice* pDevice);
+    void DumpTrace(void);
+    void ScheduleUpload(IOService* provider);
+    void FinishUpload(bool bUploaded);
+    static void UploadThread(thread_call_param_t pParam0, thread_call_param_t pParam1);
+    bool UploadFirmware(IOService* provider);
+    
+    UInt32 GetFirmwareCacheIdle(void);
+    IOReturn RetainFirmware(void);
+    void ReleaseFirmware(void);
+    IOMemoryDescriptor* GetFirmwareDescriptor(void);
+    bool GetUploadAutoTune(void);
+    int GetPacketSize(IOUSBPipe* pBulkPipe);
+    int GetUploadChunkSize(IOUSBDevice* pDevice, bool* pbTuned);
+    void SaveTunedChunkSize(IOUSBDevice* pDevice, int iChunkSize);
+    
+    void RunEngine(const Ath3kUploadConfig* pConfig);
+    void PublishUploadTiming(const Ath3kUploadTiming* pTiming);
+    void PostUploadEvent(int iStep, int iSlot, int iResult, int iBytesDone);
+    int RunUploadStep(int iStep);
+    int SendUploadControl(const Ath3kControlRequest* pRequest, const uint8_t* pData, UInt32 uTimeoutMs);
+    IOBufferMemoryDescriptor* BorrowPoolBuffer(int iCapacity, int* piEntry);
+    void ReturnPoolBuffer(IOBufferMemoryDescriptor* pBuffer, int iEntry);
+    uint8_t* GetUploadSlotBuffer(int iSlot, int iCapacity);
+    int SubmitBulkWrite(int iSlot, const uint8_t* pData, int iLength, bool bInPlace, UInt32 uNoDataMs,
+                        UInt32 uCompletionMs);
+    void ReleaseUploadSlots(void);
+    static void BulkWriteComplete(void* target, void* parameter, IOReturn status, UInt32 bufferSizeRemaining);
+    
 public:
     virtual bool init(OSDictionary* dictionary = 0);
     virtual void free(void);
@@ -26,4 +143,3 @@ public:
 };
 
 #endif //__IOATH3KFRMWR__ 
-
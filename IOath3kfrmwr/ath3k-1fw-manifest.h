@@ -0,0 +1,13 @@
+/* generated by tools/fwembed.py from ath3k-1fw.bin - do not edit */
+#ifndef ATH3K_1FW_MANIFEST
+#define ATH3K_1FW_MANIFEST 
+
+#define ATH3K_FIRMWARE_VERSION          "ath3k-1fw"
+#define ATH3K_FIRMWARE_SIZE             246804
+#define ATH3K_FIRMWARE_CRC32            0x978E28B3
+#define ATH3K_FIRMWARE_SHA256           "e51feca60698858fdf8150135360a26fb4742323eea73a4d42f15410f00e7683"
+#define ATH3K_FIRMWARE_SHA256_BYTES     0xe5, 0x1f, 0xec, 0xa6, 0x06, 0x98, 0x85, 0x8f, 0xdf, 0x81, 0x50, 0x13, 0x53, 0x60, 0xa2, 0x6f, 0xb4, 0x74, 0x23, 0x23, 0xee, 0xa7, 0x3a, 0x4d, 0x42, 0xf1, 0x54, 0x10, 0xf0, 0x0e, 0x76, 0x83
+#define ATH3K_FIRMWARE_COMPRESSED_SIZE  187843
+#define ATH3K_FIRMWARE_HEADER_BYTES     0x00, 0x00, 0x50, 0x00, 0x90, 0x01, 0x90, 0x00, 0x00, 0xc4, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0xff, 0x07, 0x00
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef ATH3K_1FW_PLAN
+#define ATH3K_1FW_PLAN
+
+#include "ath3k-1fw-manifest.h"
+#include "ath3k-plan.h"
+
+//the DFU header of the image from the manifest, checked against the size of the image when
+//the driver is built - a header that does not describe the image it heads fails the build
+static constexpr uint8_t g_aFirmwareHeader[] = { ATH3K_FIRMWARE_HEADER_BYTES };
+
+static_assert(sizeof(g_aFirmwareHeader) == ATH3K_DFU_HEADER_SIZE, "the manifest has no complete DFU header");
+static_assert(Ath3kDfuBodyLength(g_aFirmwareHeader) == ATH3K_FIRMWARE_SIZE - ATH3K_DFU_HEADER_SIZE,
+              "the DFU header of the firmware does not match the size of the image");
+
+//the chunks of the body for every chunk size the engine derives from an endpoint, and the
+//whole body in one for UploadMode Single. other chunk sizes are cut at run time
+static const Ath3kChunkPlan g_aFirmwarePlans[] =
+{
+    Ath3kChunkTable<ATH3K_FIRMWARE_SIZE, 512>::GetPlan(),
+    Ath3kChunkTable<ATH3K_FIRMWARE_SIZE, 1024>::GetPlan(),
+    Ath3kChunkTable<ATH3K_FIRMWARE_SIZE, 2048>::GetPlan(),
+    Ath3kChunkTable<ATH3K_FIRMWARE_SIZE, 4096>::GetPlan(),
+    Ath3kChunkTable<ATH3K_FIRMWARE_SIZE, 8192>::GetPlan(),
+    Ath3kChunkTable<ATH3K_FIRMWARE_SIZE, 16384>::GetPlan(),
+    Ath3kChunkTable<ATH3K_FIRMWARE_SIZE, 32768>::GetPlan(),
+    Ath3kChunkTable<ATH3K_FIRMWARE_SIZE, 65536>::GetPlan(),
+    Ath3kChunkTable<ATH3K_FIRMWARE_SIZE, ATH3K_FIRMWARE_SIZE - ATH3K_DFU_HEADER_SIZE>::GetPlan()
+};
+
+#define ATH3K_FIRMWARE_PLANS    (int)(sizeof(g_aFirmwarePlans) / sizeof(g_aFirmwarePlans[0]))
+
+#endif
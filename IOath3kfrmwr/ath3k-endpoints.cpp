@@ -0,0 +1,77 @@
+/*
+ Endpoint table parsed from a full configuration descriptor, see ath3k-endpoints.h. Plain
+ C++ without IOKit so it can be used outside the kernel as well.
+ */
+#include <string.h>
+
+#include "ath3k-endpoints.h"
+
+bool Ath3kEndpointTable::Parse(const uint8_t* pDescriptor, int iLength)
+{
+    memset(m_aEndpoints, 0, sizeof(m_aEndpoints));
+    m_iEndpoints = 0;
+    m_bConfigurationValue = 0;
+    
+    //the configuration descriptor itself first, its wTotalLength covers everything after it
+    if ((pDescriptor == NULL) || (iLength < 9) || (pDescriptor[1] != ATH3K_DESCRIPTOR_CONFIGURATION)) return(false);
+    
+    int iTotalLength = pDescriptor[2] | (pDescriptor[3] << 8);
+    if (iTotalLength < iLength) iLength = iTotalLength;
+    m_bConfigurationValue = pDescriptor[5];
+    
+    int iInterface = -1;
+    int iAlternateSetting = 0;
+    int iIndex = 0;
+    
+    for (int iPosition = 0; iPosition + 2 <= iLength; )
+    {
+        int iDescriptorLength = pDescriptor[iPosition];
+        if ((iDescriptorLength < 2) || (iPosition + iDescriptorLength > iLength)) return(false);
+        
+        const uint8_t* pCurrent = pDescriptor + iPosition;
+        switch (pCurrent[1])
+        {
+            case ATH3K_DESCRIPTOR_INTERFACE:
+                if (iDescriptorLength < 9) return(false);
+                iInterface = pCurrent[2];
+                iAlternateSetting = pCurrent[3];
+                iIndex = 0;
+                break;
+            
+            case ATH3K_DESCRIPTOR_ENDPOINT:
+            {
+                //an endpoint outside of any interface or more of them than fit
+                if ((iDescriptorLength < 7) || (iInterface < 0) || (m_iEndpoints >= ATH3K_ENDPOINTS_MAX)) return(false);
+                
+                Ath3kEndpoint* pEndpoint = &m_aEndpoints[m_iEndpoints++];
+                pEndpoint->bInterfaceNumber = (uint8_t)iInterface;
+                pEndpoint->bAlternateSetting = (uint8_t)iAlternateSetting;
+                pEndpoint->bEndpointAddress = pCurrent[2];
+                pEndpoint->bmAttributes = pCurrent[3];
+                pEndpoint->wMaxPacketSize = (uint16_t)(pCurrent[4] | (pCurrent[5] << 8));
+                pEndpoint->uIndex = (uint8_t)iIndex++;
+                break;
+            }
+        }
+        
+        iPosition += iDescriptorLength;
+    }
+    
+    return(true);
+}
+
+const Ath3kEndpoint* Ath3kEndpointTable::FindBulkOut(void) const
+{
+    for (int iEndpoint = 0; iEndpoint < m_iEndpoints; iEndpoint++)
+    {
+        const Ath3kEndpoint* pEndpoint = &m_aEndpoints[iEndpoint];
+        
+        if ((pEndpoint->bAlternateSetting == 0) && ((pEndpoint->bmAttributes & ATH3K_ENDPOINT_TYPE_MASK) == ATH3K_ENDPOINT_TYPE_BULK) &&
+            !(pEndpoint->bEndpointAddress & ATH3K_ENDPOINT_DIRECTION_IN))
+        {
+            return(pEndpoint);
+        }
+    }
+    
+    return(NULL);
+}
@@ -0,0 +1,53 @@
+/* Ath3kEndpointTable class */
+#ifndef __ATH3K_ENDPOINTS__
+#define __ATH3K_ENDPOINTS__
+
+#include <stdint.h>
+
+//endpoints of a configuration we keep, the AR3011 has 6 over 2 interfaces
+#define ATH3K_ENDPOINTS_MAX         16
+
+//descriptor types and endpoint attributes from chapter 9 of the USB spec
+#define ATH3K_DESCRIPTOR_CONFIGURATION  2
+#define ATH3K_DESCRIPTOR_INTERFACE      4
+#define ATH3K_DESCRIPTOR_ENDPOINT       5
+#define ATH3K_ENDPOINT_TYPE_MASK        0x03
+#define ATH3K_ENDPOINT_TYPE_BULK        0x02
+#define ATH3K_ENDPOINT_DIRECTION_IN     0x80
+
+struct Ath3kEndpoint
+{
+    uint8_t bInterfaceNumber;
+    uint8_t bAlternateSetting;
+    uint8_t bEndpointAddress;
+    uint8_t bmAttributes;
+    uint16_t wMaxPacketSize;
+    uint8_t uIndex;             //position among the endpoints of its interface, as the pipes are numbered
+};
+
+//
+// the endpoints of a full configuration descriptor in one flat table, so the bulk out pipe
+// can be looked up without opening interfaces and walking their pipes. Parse() only reads
+// the descriptor, the caller keeps the table for as long as it likes
+//
+class Ath3kEndpointTable
+{
+private:
+    Ath3kEndpoint m_aEndpoints[ATH3K_ENDPOINTS_MAX];
+    int m_iEndpoints;
+    uint8_t m_bConfigurationValue;
+    
+public:
+    //false if the descriptor is malformed or has more endpoints than fit
+    bool Parse(const uint8_t* pDescriptor, int iLength);
+    
+    //the first bulk out endpoint in the default alternate setting, which is the one the
+    //interfaces come up in. NULL if there is none
+    const Ath3kEndpoint* FindBulkOut(void) const;
+    
+    int GetEndpointCount(void) const { return(m_iEndpoints); }
+    const Ath3kEndpoint* GetEndpoint(int iEndpoint) const { return(&m_aEndpoints[iEndpoint]); }
+    uint8_t GetConfigurationValue(void) const { return(m_bConfigurationValue); }
+};
+
+#endif //__ATH3K_ENDPOINTS__
@@ -0,0 +1,211 @@
+/*
+ The body of the upload, see ath3k-engine.h: the loop that keeps the bulk writes going, as
+ templates over the transport and the chunk policy. Ath3kUploadEngine::Start() runs it on
+ the abstract transport with the chunks worked out at run time; StartWith() builds it for
+ one transport class and one policy, so the transport calls in it are direct and the chunk
+ arithmetic is folded into constants. Include it where StartWith() is called.
+ */
+#ifndef __ATH3K_ENGINE_BODY__
+#define __ATH3K_ENGINE_BODY__
+
+#include "ath3k-engine.h"
+#include "ath3k-plan.h"
+
+//
+// StartWith
+// Start() for the body specialized on Transport and ChunkPolicy. Transport has to be the
+// class pTransport really is, and should be final, or the calls stay virtual. the policy
+// overrides the chunk settings of the config
+//
+template <class Transport, class ChunkPolicy>
+void Ath3kUploadEngine::StartWith(Transport* pTransport, const Ath3kUploadConfig* pConfig)
+{
+    Ath3kUploadConfig config = *pConfig;
+    
+    if (ChunkPolicy::kChunkSize != 0) config.bAutoTune = false;
+    if (ChunkPolicy::kChunkSize > 0)
+    {
+        config.iChunkSize = ChunkPolicy::kChunkSize;
+        config.bSingleTransfer = false;
+    }
+    if (ChunkPolicy::kChunkSize < 0) config.bSingleTransfer = true;
+    
+    this->Start(pTransport, &config);
+    m_pfnPumpBody = &Ath3kUploadEngine::PumpBodyWith<Transport, ChunkPolicy>;
+}
+
+//
+// PrepareSlot
+// sets a free slot up with the next chunk, unless it still holds one the link had no room
+// for. a fixed chunk size or the whole body is known from the policy, otherwise the chunk
+// comes from the plan where there is one, and starts where the plan says. in zero copy
+// mode the slot points into the image, otherwise the chunk is copied or expanded into the
+// staging buffer of the slot
+//
+template <class Transport, class ChunkPolicy>
+int Ath3kUploadEngine::PrepareSlotWith(int iSlot)
+{
+    Slot* pSlot = &m_aSlots[iSlot];
+    if (pSlot->bPrepared) return(kAth3kSuccess);
+    
+    pSlot->iPosition = m_iSubmitPosition;
+    
+    if (ChunkPolicy::kChunkSize > 0)
+    {
+        pSlot->iLength = Min(m_config.iImageSize - m_iSubmitPosition, (int)ChunkPolicy::kChunkSize);
+    }
+    else if (ChunkPolicy::kChunkSize < 0)
+    {
+        pSlot->iLength = m_config.iImageSize - m_iSubmitPosition;
+    }
+    else
+    {
+        const Ath3kPlannedChunk* pChunk = this->GetPlannedChunk(m_iSubmitPosition);
+        if (pChunk != NULL)
+        {
+            //a plan that goes back would send bytes twice. one that skips ahead leaves bytes
+            //out, the verifier turns that down
+            if (pChunk->iPosition < m_iSubmitPosition) return(kAth3kErrorCorrupt);
+            
+            pSlot->iPosition = pChunk->iPosition;
+            pSlot->iLength = pChunk->iLength;
+        }
+        else
+        {
+            int iChunkSize = m_bTuning ? m_iTuneCandidate : m_iChunkSize;
+            int iLimit = m_bTuning ? m_iWindowEnd : m_config.iImageSize;
+            
+            pSlot->iLength = Min(iLimit - m_iSubmitPosition, iChunkSize);
+        }
+    }
+    
+    if (m_config.bZeroCopy)
+    {
+        pSlot->pData = m_config.pImage + pSlot->iPosition;
+    }
+    else
+    {
+        uint8_t* pBuffer = static_cast<Transport*>(m_pTransport)->GetSlotBuffer(iSlot, pSlot->iLength);
+        if (pBuffer == NULL) return(kAth3kErrorNoMemory);
+        
+        int iResult = this->CopyImage(pBuffer, pSlot->iPosition, pSlot->iLength);
+        if (iResult != kAth3kSuccess) return(iResult);
+        
+        pSlot->pData = pBuffer;
+    }
+    
+    //hashed while the chunk is still in the cache from the copy. a bad image shows with
+    //the last chunk, which then never goes out
+    if (!m_verifier.Update(pSlot->iPosition, pSlot->pData, pSlot->iLength)) return(kAth3kErrorCorrupt);
+    
+    pSlot->bPrepared = true;
+    
+    return(kAth3kSuccess);
+}
+
+//
+// PumpBody
+// keeps up to iQueueDepth bulk writes in flight until the whole image is submitted, so the
+// bus does not idle between chunks. a tune window is drained and timed before the next
+// one starts. on error, or to recover from a failed write, whatever is still queued gets
+// aborted
+//
+template <class Transport, class ChunkPolicy>
+void Ath3kUploadEngine::PumpBodyWith(void)
+{
+    Transport* pTransport = static_cast<Transport*>(m_pTransport);
+    
+    //only the chunks of the endpoint policy are ever tuned
+    const bool bTunes = (ChunkPolicy::kChunkSize == 0);
+    
+    m_bLinkBusy = false;
+    
+    while (true)
+    {
+        while ((m_iResult == kAth3kSuccess) && (m_iRecovery == kRecoveryNone) &&
+               (m_iSubmitPosition < m_config.iImageSize) && (m_iSlotsBusy < m_iQueueDepth) &&
+               !(bTunes && m_bTuning && (m_iSubmitPosition >= m_iWindowEnd)))
+        {
+            //a chunk the link turned down goes first, it is already expanded
+            int iSlot = -1;
+            for (int iSlotCounter = 0; iSlotCounter < m_iQueueDepth; iSlotCounter++)
+            {
+                if (m_aSlots[iSlotCounter].bBusy) continue;
+                if ((iSlot < 0) || m_aSlots[iSlotCounter].bPrepared) iSlot = iSlotCounter;
+                if (m_aSlots[iSlotCounter].bPrepared) break;
+            }
+            
+            Slot* pSlot = &m_aSlots[iSlot];
+            uint32_t uNoDataMs = 0;
+            uint32_t uCompletionMs = 0;
+            int iResult = this->PrepareSlotWith<Transport, ChunkPolicy>(iSlot);
+            if (iResult == kAth3kSuccess)
+            {
+                pSlot->iOutstanding = m_iSubmitPosition - m_iAckPosition + pSlot->iLength;
+                this->GetWriteTimeouts(pSlot, &uNoDataMs, &uCompletionMs);
+                iResult = pTransport->BulkWrite(iSlot, pSlot->pData, pSlot->iLength, m_config.bZeroCopy, uNoDataMs,
+                                                uCompletionMs);
+            }
+            
+            if (iResult == kAth3kBusy)
+            {
+                if (m_config.pObserver != NULL) m_config.pObserver->WriteRefused(iSlot, pTransport->GetTimeNanoseconds());
+                m_bLinkBusy = true;
+                return;
+            }
+            if (iResult != kAth3kSuccess)
+            {
+                //a pipe that halted under a write still in flight - its completion says where to go on
+                if ((iResult == kAth3kErrorStall) && (m_iSlotsBusy > 0)) break;
+                
+                if (!this->Recover(iResult, m_iSubmitPosition)) this->Fail(iResult);
+                break;
+            }
+            
+            pSlot->uSubmitted = pTransport->GetTimeNanoseconds();
+            m_timing.aNoDataTimeout[GetLatencyBucket(uNoDataMs * 1000000ULL)]++;
+            if ((m_timing.uNoDataTimeoutMaxMs == 0) || (uNoDataMs < m_timing.uNoDataTimeoutMinMs))
+            {
+                m_timing.uNoDataTimeoutMinMs = uNoDataMs;
+            }
+            m_timing.uNoDataTimeoutMaxMs = Max(m_timing.uNoDataTimeoutMaxMs, uNoDataMs);
+            m_timing.uCompletionTimeoutMaxMs = Max(m_timing.uCompletionTimeoutMaxMs, uCompletionMs);
+            
+            if (m_config.pObserver != NULL)
+            {
+                m_config.pObserver->WriteSubmitted(iSlot, pSlot->iPosition, pSlot->iLength, pSlot->uSubmitted);
+            }
+            pSlot->bBusy = true;
+            pSlot->bPrepared = false;
+            m_iSlotsBusy++;
+            m_iSubmitPosition = pSlot->iPosition + pSlot->iLength;
+        }
+        
+        if ((m_iResult != kAth3kSuccess) || (m_iRecovery != kRecoveryNone))
+        {
+            //cancel whatever is still queued so we do not wait for the timeouts
+            if (!m_bAborted && (m_iSlotsBusy > 0))
+            {
+                m_bAborted = true;
+                pTransport->AbortBulk();
+            }
+            if (m_iSlotsBusy > 0) return;
+            
+            if (m_iResult != kAth3kSuccess) this->SetStep(kAth3kStepClose);
+            else this->StartRecovery();
+            return;
+        }
+        
+        if (m_iSlotsBusy > 0) return;
+        
+        if (!bTunes || !m_bTuning)
+        {
+            if (m_iAckPosition >= m_config.iImageSize) this->SetStep(kAth3kStepClose);
+            return;
+        }
+        
+        this->FinishTuneWindow();
+    }
+}
+
+#endif //__ATH3K_ENGINE_BODY__
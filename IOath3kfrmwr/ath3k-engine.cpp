@@ -0,0 +1,599 @@
+/*
+ The firmware upload as a state machine over an abstract transport, see ath3k-engine.h.
+ Plain C++ without IOKit so the same code can run outside the kernel.
+ */
+#include <string.h>
+
+#include "ath3k-engine.h"
+#include "ath3k-engine-body.h"
+#include "ath3k-plan.h"
+
+//fraction bits of the rate estimate, which would be a few ns per byte on a fast bus
+#define ENGINE_RATE_SHIFT   8
+
+void Ath3kUploadEngine::Start(Ath3kTransport* pTransport, const Ath3kUploadConfig* pConfig)
+{
+    m_pTransport = pTransport;
+    m_config = *pConfig;
+    
+    m_iStep = kAth3kStepOpen;
+    m_bStepPending = false;
+    m_bDeviceOpen = false;
+    m_iResult = kAth3kSuccess;
+    m_iFailedStep = kAth3kStepDone;
+    
+    memset(m_aSlots, 0, sizeof(m_aSlots));
+    m_iQueueDepth = Min(Max(m_config.iQueueDepth, 1), ATH3K_QUEUE_DEPTH_MAX);
+    m_iSlotsBusy = 0;
+    m_iPacketSize = 0;
+    m_iChunkSize = 0;
+    m_pPlan = NULL;
+    m_iSubmitPosition = 0;
+    m_iAckPosition = 0;
+    m_iBytesCopied = 0;
+    m_bAborted = false;
+    m_bLinkBusy = false;
+    
+    m_bTuning = false;
+    m_iTuneCandidate = 0;
+    m_iWindowEnd = 0;
+    m_uWindowStart = 0;
+    m_iBestChunkSize = 0;
+    m_uBestBytes = 0;
+    m_uBestNanoseconds = 0;
+    m_iTunedChunkSize = 0;
+    
+    m_iRecovery = kRecoveryNone;
+    m_iResumePosition = 0;
+    m_iRecoveries = 0;
+    m_iWastedBytes = 0;
+    m_uRecoveryStart = 0;
+    
+    m_uRateMean = 0;
+    m_uRateDeviation = 0;
+    m_iRateSamples = 0;
+    m_iTimeoutBackoff = 0;
+    if (m_config.uTimeoutMinMs == 0) m_config.uTimeoutMinMs = ATH3K_TIMEOUT_MIN_MS;
+    if (m_config.uTimeoutMaxMs == 0) m_config.uTimeoutMaxMs = ATH3K_TIMEOUT_MAX_MS;
+    m_config.uTimeoutMaxMs = Max(m_config.uTimeoutMaxMs, m_config.uTimeoutMinMs);
+    
+    m_verifier.Init(m_config.pDigest, m_config.iImageSize);
+    
+    memset(&m_timing, 0, sizeof(m_timing));
+    m_uStart = m_pTransport->GetTimeNanoseconds();
+    m_uStepStart = m_uStart;
+    m_pfnPumpBody = &Ath3kUploadEngine::PumpBodyWith<Ath3kTransport, Ath3kChunkEndpoint>;
+    
+    if (m_config.pObserver != NULL) m_config.pObserver->StepStarted(m_iStep, m_uStart);
+    
+    //there is nothing to describe in place when the image is compressed
+    if (m_config.pImage == NULL)
+    {
+        m_config.bZeroCopy = false;
+        m_decoderFirmware.Init(m_config.pImageCompressed, m_config.iImageCompressedSize, m_config.pDecoderWindow);
+    }
+}
+
+//
+// SetStep
+// moves on to iStep and books the time since the last step change to the one we leave
+//
+void Ath3kUploadEngine::SetStep(int iStep)
+{
+    uint64_t uNow = m_pTransport->GetTimeNanoseconds();
+    
+    m_timing.aStepNanoseconds[m_iStep] += uNow - m_uStepStart;
+    m_uStepStart = uNow;
+    
+    if (m_config.pObserver != NULL)
+    {
+        m_config.pObserver->StepFinished(m_iStep, (m_iFailedStep == m_iStep) ? m_iResult : kAth3kSuccess, uNow);
+        if (iStep != kAth3kStepDone) m_config.pObserver->StepStarted(iStep, uNow);
+    }
+    
+    m_iStep = iStep;
+    
+    if (iStep == kAth3kStepDone) m_timing.uTotalNanoseconds = uNow - m_uStart;
+}
+
+int Ath3kUploadEngine::GetLatencyBucket(uint64_t uNanoseconds)
+{
+    uint64_t uLimit = ATH3K_LATENCY_BUCKET_US * 1000ULL;
+    int iBucket = 0;
+    
+    while ((iBucket < ATH3K_LATENCY_BUCKETS - 1) && (uNanoseconds >= uLimit))
+    {
+        uLimit *= 2;
+        iBucket++;
+    }
+    
+    return(iBucket);
+}
+
+bool Ath3kUploadEngine::IsFirmwareRunning(int iDeviceRelease, int iState)
+{
+    if (iDeviceRelease > ATH3K_BCD_DEVICE_ROM) return(true);
+    
+    return((iState >= 0) && ((iState & ATH3K_STATE_MODE_MASK) == ATH3K_STATE_NORMAL_MODE));
+}
+
+void Ath3kUploadEngine::Fail(int iResult)
+{
+    //keep the first error - later ones are usually aborts caused by it
+    if (m_iResult != kAth3kSuccess) return;
+    
+    m_iResult = iResult;
+    m_iFailedStep = m_iStep;
+}
+
+//
+// CopyImage
+// fills a staging buffer with the next iLength bytes of the image - a plain copy, or the
+// decoder expanding them in place. the compressed image can only be read front to back
+//
+int Ath3kUploadEngine::CopyImage(uint8_t* pDestination, int iPosition, int iLength)
+{
+    m_iBytesCopied += iLength;
+    
+    if (m_config.pImage == NULL)
+    {
+        return((m_decoderFirmware.Decode(pDestination, iLength) == iLength) ? kAth3kSuccess : kAth3kErrorCorrupt);
+    }
+    
+    memcpy(pDestination, m_config.pImage + iPosition, iLength);
+    return(kAth3kSuccess);
+}
+
+//
+// SeekImage
+// the next CopyImage() reads from iPosition. only the decoder has to do something for it:
+// it starts over and expands everything before iPosition once more, into the staging
+// buffer of the first slot
+//
+int Ath3kUploadEngine::SeekImage(int iPosition)
+{
+    if (m_config.pImage != NULL) return(kAth3kSuccess);
+    
+    m_decoderFirmware.Init(m_config.pImageCompressed, m_config.iImageCompressedSize, m_config.pDecoderWindow);
+    
+    for (int iSkipped = 0; iSkipped < iPosition;)
+    {
+        int iLength = Min(iPosition - iSkipped, Max(m_iChunkSize, ATH3K_CHUNK_SIZE_MIN));
+        
+        uint8_t* pBuffer = m_pTransport->GetSlotBuffer(0, iLength);
+        if (pBuffer == NULL) return(kAth3kErrorNoMemory);
+        
+        int iResult = this->CopyImage(pBuffer, iSkipped, iLength);
+        if (iResult != kAth3kSuccess) return(iResult);
+        
+        iSkipped += iLength;
+    }
+    
+    return(kAth3kSuccess);
+}
+
+//
+// SendHeader
+// the control request that puts the device into download mode carries the first 20
+// bytes of the image, straight from it or through our own copy
+//
+int Ath3kUploadEngine::SendHeader(void)
+{
+    const uint8_t* pData = m_config.pImage;
+    
+    if (!m_config.bZeroCopy)
+    {
+        int iResult = this->CopyImage(m_aHeader, 0, ATH3K_DFU_HEADER_SIZE);
+        if (iResult != kAth3kSuccess) return(iResult);
+        
+        pData = m_aHeader;
+    }
+    
+    //the header is in the checksums like the rest of the image. after a restart it is
+    //already counted and the verifier passes over it
+    if (!m_verifier.Update(0, pData, ATH3K_DFU_HEADER_SIZE)) return(kAth3kErrorCorrupt);
+    
+    Ath3kControlRequest request;
+    request.bmRequestType = ATH3K_DFU_REQUEST_TYPE;
+    request.bRequest = ATH3K_DFU_REQUEST_DNLOAD;
+    request.wValue = 0;
+    request.wIndex = 0;
+    request.wLength = ATH3K_DFU_HEADER_SIZE;
+    
+    //nothing to measure the device by yet
+    return(m_pTransport->SendControl(&request, pData, m_config.uTimeoutMaxMs));
+}
+
+//
+// PlanChunkSize
+// a fixed chunk size from the config, or one worked out from the endpoint packet size and
+// the bus speed. chunks are always whole packets so no write ends in a short packet before
+// the last one
+//
+int Ath3kUploadEngine::PlanChunkSize(void)
+{
+    int iChunkSize = m_config.iChunkSize;
+    
+    if (m_config.bSingleTransfer) return(m_config.iImageSize - ATH3K_DFU_HEADER_SIZE);
+    
+    if (iChunkSize <= 0)
+    {
+        //enough packets per write to cover several (micro)frames of the bus
+        switch (m_pTransport->GetSpeed())
+        {
+            case kAth3kSpeedLow:
+            case kAth3kSpeedFull:
+                iChunkSize = m_iPacketSize * 64;
+                break;
+            
+            case kAth3kSpeedHigh:
+                iChunkSize = m_iPacketSize * 32;
+                break;
+            
+            default:
+                iChunkSize = m_iPacketSize * 16;
+                break;
+        }
+    }
+    
+    iChunkSize = Max(iChunkSize, ATH3K_CHUNK_SIZE_MIN);
+    iChunkSize = Min(iChunkSize, ATH3K_CHUNK_SIZE_MAX);
+    iChunkSize = Max(iChunkSize - (iChunkSize % m_iPacketSize), m_iPacketSize);
+    
+    return(iChunkSize);
+}
+
+//
+// NextTuneWindow
+// moves the auto-tune on to the next candidate chunk size, from ATH3K_CHUNK_SIZE_MIN to
+// ATH3K_CHUNK_SIZE_MAX in powers of two. every candidate gets a window of a few writes,
+// but never the last bytes of the image. false when there is nothing left to try
+//
+bool Ath3kUploadEngine::NextTuneWindow(void)
+{
+    int iCandidate = (m_iTuneCandidate == 0) ? ATH3K_CHUNK_SIZE_MIN : m_iTuneCandidate * 2;
+    
+    for (; iCandidate <= ATH3K_CHUNK_SIZE_MAX; iCandidate *= 2)
+    {
+        if ((iCandidate % m_iPacketSize) != 0) continue;
+        
+        int iWindow = Max(iCandidate, ATH3K_AUTOTUNE_WINDOW);
+        if (iWindow >= m_config.iImageSize - m_iSubmitPosition) break;
+        
+        m_iTuneCandidate = iCandidate;
+        m_iWindowEnd = m_iSubmitPosition + iWindow;
+        m_uWindowStart = m_pTransport->GetTimeNanoseconds();
+        
+        return(true);
+    }
+    
+    return(false);
+}
+
+//
+// FinishTuneWindow
+// the window of the current candidate has drained - keep it if it beat the best so far and
+// go on with the next one, or settle on the best when all of them had their turn
+//
+void Ath3kUploadEngine::FinishTuneWindow(void)
+{
+    uint64_t uElapsed = m_pTransport->GetTimeNanoseconds() - m_uWindowStart;
+    uint64_t uWindow = Max(m_iTuneCandidate, ATH3K_AUTOTUNE_WINDOW);
+    
+    //faster if bytes / time beats the best so far - cross multiplied to stay in integers
+    if ((m_iBestChunkSize == 0) || (uWindow * m_uBestNanoseconds > m_uBestBytes * uElapsed))
+    {
+        m_iBestChunkSize = m_iTuneCandidate;
+        m_uBestBytes = uWindow;
+        m_uBestNanoseconds = uElapsed;
+    }
+    
+    if (!this->NextTuneWindow())
+    {
+        m_bTuning = false;
+        if (m_iBestChunkSize > 0)
+        {
+            m_iChunkSize = m_iBestChunkSize;
+            m_iTunedChunkSize = m_iBestChunkSize;
+        }
+    }
+}
+
+void Ath3kUploadEngine::Pump(void)
+{
+    while ((m_iStep != kAth3kStepDone) && !m_bStepPending)
+    {
+        int iResult = kAth3kSuccess;
+        
+        switch (m_iStep)
+        {
+            case kAth3kStepBody:
+                //the body moves on from the write completions
+                (this->*m_pfnPumpBody)();
+                if (m_iStep == kAth3kStepBody) return;
+                continue;
+            
+            case kAth3kStepControl:
+                iResult = this->SendHeader();
+                break;
+            
+            default:
+                iResult = m_pTransport->StartStep(m_iStep);
+                break;
+        }
+        
+        if (iResult == kAth3kSuccess) m_bStepPending = true;
+        else this->FinishStep(iResult);
+    }
+}
+
+void Ath3kUploadEngine::StepComplete(int iStep, int iResult)
+{
+    if (!m_bStepPending || (iStep != m_iStep)) return;
+    
+    m_bStepPending = false;
+    this->FinishStep(iResult);
+}
+
+//
+// FinishStep
+// moves on to the next step, or straight to closing the device once one failed. the
+// status is only informational, the upload goes ahead without it. a cleared stall leads
+// back into the body
+//
+void Ath3kUploadEngine::FinishStep(int iResult)
+{
+    switch (m_iStep)
+    {
+        case kAth3kStepOpen:
+            m_bDeviceOpen = (iResult == kAth3kSuccess);
+            break;
+        
+        case kAth3kStepGetStatus:
+            iResult = kAth3kSuccess;
+            break;
+        
+        case kAth3kStepFindPipe:
+            if (iResult == kAth3kSuccess)
+            {
+                m_iPacketSize = Max(m_pTransport->GetPacketSize(), 8);
+                m_iChunkSize = this->PlanChunkSize();
+                
+                //a restart keeps what the auto-tune found before it
+                if (m_iTunedChunkSize > 0) m_iChunkSize = m_iTunedChunkSize;
+            }
+            break;
+        
+        case kAth3kStepControl:
+            if (iResult == kAth3kSuccess)
+            {
+                m_iSubmitPosition = ATH3K_DFU_HEADER_SIZE;
+                m_iAckPosition = ATH3K_DFU_HEADER_SIZE;
+                
+                //first attach of this device model - measure while we upload
+                if (m_config.bAutoTune && !m_config.bSingleTransfer) m_bTuning = this->NextTuneWindow();
+                
+                if (m_iRecovery == kRecoveryRestart) this->FinishRecovery();
+            }
+            break;
+        
+        case kAth3kStepClearStall:
+            //the device kept what it took before the stall, the body goes on from there
+            if (iResult == kAth3kSuccess) iResult = this->SeekImage(m_iResumePosition);
+            if (iResult == kAth3kSuccess)
+            {
+                m_iSubmitPosition = m_iResumePosition;
+                m_iAckPosition = m_iResumePosition;
+                
+                this->FinishRecovery();
+                this->SetStep(kAth3kStepBody);
+                return;
+            }
+            
+            //a pipe that does not clear leaves the device in a state we do not know
+            if (iResult != kAth3kErrorNoDevice)
+            {
+                this->RestartUpload();
+                return;
+            }
+            break;
+        
+        case kAth3kStepClose:
+            m_bDeviceOpen = false;
+            this->SetStep(kAth3kStepDone);
+            return;
+    }
+    
+    if (iResult != kAth3kSuccess)
+    {
+        this->Fail(iResult);
+        this->SetStep(m_bDeviceOpen ? kAth3kStepClose : kAth3kStepDone);
+    }
+    else this->SetStep(m_iStep + 1);
+}
+
+//
+// GetWriteTimeouts
+// the no-data timeout is how long the chunk of the slot may take at the mean rate plus four
+// deviations, as TCP works out its retransmission timeout, doubled for every timeout so far
+// and within the bounds of the config. it catches a device that stopped taking data. the
+// completion timeout only bounds a write that keeps trickling: a margin over what all the
+// bytes in flight up to its end take at the mean rate, and never under the ceiling
+//
+void Ath3kUploadEngine::GetWriteTimeouts(const Slot* pSlot, uint32_t* puNoDataMs, uint32_t* puCompletionMs)
+{
+    if (m_iRateSamples < ATH3K_TIMEOUT_SAMPLES)
+    {
+        *puNoDataMs = *puCompletionMs = m_config.uTimeoutMaxMs;
+        return;
+    }
+    
+    uint64_t uNoDataNs = ((m_uRateMean + 4 * m_uRateDeviation) * (uint64_t)pSlot->iLength) >> ENGINE_RATE_SHIFT;
+    uint64_t uNoDataMs = ((uNoDataNs + 999999) / 1000000) << m_iTimeoutBackoff;
+    
+    uNoDataMs = Max(uNoDataMs, (uint64_t)m_config.uTimeoutMinMs);
+    *puNoDataMs = (uint32_t)Min(uNoDataMs, (uint64_t)m_config.uTimeoutMaxMs);
+    
+    uint64_t uCompletionNs = (m_uRateMean * (uint64_t)pSlot->iOutstanding) >> ENGINE_RATE_SHIFT;
+    uint64_t uCompletionMs = ATH3K_TIMEOUT_MARGIN * ((uCompletionNs + 999999) / 1000000);
+    *puCompletionMs = (uint32_t)Min(Max(uCompletionMs, (uint64_t)m_config.uTimeoutMaxMs), (uint64_t)0xffffffff);
+}
+
+//
+// UpdateRate
+// folds a write that came back after uLatency into the rate estimate, weighted like the
+// smoothed round trip time of TCP: 1/8 for the mean, 1/4 for the deviation
+//
+void Ath3kUploadEngine::UpdateRate(uint64_t uLatency, int iOutstanding)
+{
+    uint64_t uSample = (uLatency << ENGINE_RATE_SHIFT) / Max(iOutstanding, 1);
+    
+    if (m_iRateSamples++ == 0)
+    {
+        m_uRateMean = Max(uSample, (uint64_t)1);
+        m_uRateDeviation = uSample / 2;
+        return;
+    }
+    
+    uint64_t uError = (uSample > m_uRateMean) ? uSample - m_uRateMean : m_uRateMean - uSample;
+    m_uRateDeviation = (3 * m_uRateDeviation + uError) / 4;
+    m_uRateMean = Max((7 * m_uRateMean + uSample) / 8, (uint64_t)1);
+}
+
+//
+// GetPlannedChunk
+// the chunk starting at iPosition from the plan of the current chunk size, NULL if there is
+// none. the auto-tune cuts its windows itself
+//
+const Ath3kPlannedChunk* Ath3kUploadEngine::GetPlannedChunk(int iPosition)
+{
+    if (m_bTuning) return(NULL);
+    
+    if ((m_pPlan == NULL) || (m_pPlan->iChunkSize != m_iChunkSize))
+    {
+        m_pPlan = NULL;
+        for (int iPlan = 0; iPlan < m_config.iPlans; iPlan++)
+        {
+            const Ath3kChunkPlan* pPlan = &m_config.pPlans[iPlan];
+            if ((pPlan->iChunkSize == m_iChunkSize) && (pPlan->iImageSize == m_config.iImageSize)) m_pPlan = pPlan;
+        }
+        if (m_pPlan == NULL) return(NULL);
+    }
+    
+    int iOffset = iPosition - ATH3K_DFU_HEADER_SIZE;
+    if ((iOffset % m_iChunkSize) != 0) return(NULL);
+    
+    return(&m_pPlan->pChunks[iOffset / m_iChunkSize]);
+}
+
+void Ath3kUploadEngine::WriteComplete(int iSlot, int iResult, int iBytesDone)
+{
+    if ((iSlot < 0) || (iSlot >= m_iQueueDepth)) return;
+    
+    Slot* pSlot = &m_aSlots[iSlot];
+    if (!pSlot->bBusy) return;
+    
+    pSlot->bBusy = false;
+    m_iSlotsBusy--;
+    
+    if (m_config.pObserver != NULL)
+    {
+        m_config.pObserver->WriteCompleted(iSlot, iResult, iBytesDone, m_pTransport->GetTimeNanoseconds());
+    }
+    
+    if ((iResult == kAth3kSuccess) && (iBytesDone != pSlot->iLength)) iResult = kAth3kErrorUnderrun;
+    
+    if (iResult != kAth3kSuccess)
+    {
+        //the rest of the queue going down after the write we recover from
+        if (m_iRecovery != kRecoveryNone) return;
+        
+        //writes complete in order, so everything before this one is acknowledged
+        if (!this->Recover(iResult, pSlot->iPosition + Min(Max(iBytesDone, 0), pSlot->iLength)))
+        {
+            this->Fail(iResult);
+        }
+    }
+    else
+    {
+        m_iAckPosition += pSlot->iLength;
+        
+        uint64_t uLatency = m_pTransport->GetTimeNanoseconds() - pSlot->uSubmitted;
+        if ((m_timing.uChunks == 0) || (uLatency < m_timing.uChunkMinNanoseconds)) m_timing.uChunkMinNanoseconds = uLatency;
+        m_timing.uChunkMaxNanoseconds = Max(m_timing.uChunkMaxNanoseconds, uLatency);
+        m_timing.uChunkSumNanoseconds += uLatency;
+        m_timing.aChunkLatency[GetLatencyBucket(uLatency)]++;
+        m_timing.uChunks++;
+        
+        this->UpdateRate(uLatency, pSlot->iOutstanding);
+    }
+}
+
+//
+// Recover
+// sets up the recovery from a bulk write that failed with iResult, with the device holding
+// the image up to iPosition. false if the error is not one we recover from, or the upload
+// is out of recoveries
+//
+bool Ath3kUploadEngine::Recover(int iResult, int iPosition)
+{
+    if ((m_iResult != kAth3kSuccess) || (m_iRecoveries >= m_config.iMaxRecoveries)) return(false);
+    if ((iResult != kAth3kErrorStall) && (iResult != kAth3kErrorTimeout)) return(false);
+    
+    m_iRecovery = (iResult == kAth3kErrorStall) ? kRecoveryResume : kRecoveryRestart;
+    m_iResumePosition = iPosition;
+    
+    //a device that is just slower than we thought gets more time from now on
+    if (iResult == kAth3kErrorTimeout) m_iTimeoutBackoff = Min(m_iTimeoutBackoff + 1, 8);
+    m_iRecoveries++;
+    m_uRecoveryStart = m_pTransport->GetTimeNanoseconds();
+    
+    return(true);
+}
+
+//
+// StartRecovery
+// the queue has drained after a failed bulk write. a stall is cleared and the body resumes
+// where the device stopped taking data. a device that stopped answering altogether does not
+// pick up where it was, so a timeout restarts the sequence from the reset
+//
+void Ath3kUploadEngine::StartRecovery(void)
+{
+    m_bAborted = false;
+    
+    //windows measured across a fault say nothing about the chunk size
+    m_bTuning = false;
+    m_config.bAutoTune = false;
+    
+    for (int iSlot = 0; iSlot < ATH3K_QUEUE_DEPTH_MAX; iSlot++) m_aSlots[iSlot].bPrepared = false;
+    
+    if (m_iRecovery == kRecoveryResume) this->SetStep(kAth3kStepClearStall);
+    else this->RestartUpload();
+}
+
+//
+// RestartUpload
+// everything the device took so far is lost: back to the reset, and the image from the top
+//
+void Ath3kUploadEngine::RestartUpload(void)
+{
+    m_iRecovery = kRecoveryRestart;
+    m_iWastedBytes += m_iResumePosition;
+    m_iResumePosition = 0;
+    
+    int iResult = this->SeekImage(0);
+    if (iResult != kAth3kSuccess)
+    {
+        this->Fail(iResult);
+        this->SetStep(kAth3kStepClose);
+        return;
+    }
+    
+    this->SetStep(kAth3kStepReset);
+}
+
+void Ath3kUploadEngine::FinishRecovery(void)
+{
+    m_timing.uRecoveryNanoseconds += m_pTransport->GetTimeNanoseconds() - m_uRecoveryStart;
+    m_iRecovery = kRecoveryNone;
+}
@@ -0,0 +1,380 @@
+/* Ath3kUploadEngine class */
+#ifndef __ATH3K_ENGINE__
+#define __ATH3K_ENGINE__
+
+#include <stdint.h>
+
+#include "ath3k-fwcodec.h"
+#include "ath3k-verify.h"
+
+//the DFU download: a vendor control request with the first 20 bytes of the image,
+//then the rest of it through the bulk out pipe
+#define ATH3K_DFU_REQUEST_TYPE      0x40    //host to device, vendor, device
+#define ATH3K_DFU_REQUEST_DNLOAD    1
+#define ATH3K_DFU_HEADER_SIZE       20
+
+//telling a device that already runs the firmware from one in the boot ROM: the ROM
+//enumerates with bcdDevice 0x0001, and GETSTATE (as in the Linux ath3k driver) answers
+//with the mode in the low bits of one byte
+#define ATH3K_BCD_DEVICE_ROM        0x0001
+#define ATH3K_STATE_REQUEST_TYPE    0xC0    //device to host, vendor, device
+#define ATH3K_REQUEST_GETSTATE      0x05
+#define ATH3K_STATE_MODE_MASK       0x3F
+#define ATH3K_STATE_NORMAL_MODE     0x0E
+
+//range of bulk writes the engine keeps in flight and the chunk sizes it derives or tunes
+#define ATH3K_QUEUE_DEPTH_MAX       8
+#define ATH3K_CHUNK_SIZE_MIN        512
+#define ATH3K_CHUNK_SIZE_MAX        65536
+#define ATH3K_AUTOTUNE_WINDOW       16384
+
+//timeouts of the bulk writes, worked out from the rate the writes before them went at. the
+//control request and the writes before ATH3K_TIMEOUT_SAMPLES of them came back get the
+//ceiling - the first ones only fill the buffers of the device
+#define ATH3K_TIMEOUT_MIN_MS        50
+#define ATH3K_TIMEOUT_MAX_MS        2000
+#define ATH3K_TIMEOUT_SAMPLES       8
+#define ATH3K_TIMEOUT_MARGIN        4       //completion timeout against the time the rate needs
+
+//chunk latency histogram: bucket 0 holds writes done in less than ATH3K_LATENCY_BUCKET_US,
+//every further one twice the range of the one before, the last one everything slower
+#define ATH3K_LATENCY_BUCKETS       16
+#define ATH3K_LATENCY_BUCKET_US     64
+
+//cut at compile time, see ath3k-plan.h
+struct Ath3kChunkPlan;
+struct Ath3kPlannedChunk;
+
+//results of the transport operations and of the whole upload
+enum
+{
+    kAth3kSuccess = 0,
+    kAth3kBusy,             //BulkWrite only: the link is full, the engine retries when it is pumped again
+    kAth3kErrorIO,
+    kAth3kErrorNoDevice,
+    kAth3kErrorNoMemory,
+    kAth3kErrorStall,
+    kAth3kErrorTimeout,
+    kAth3kErrorUnderrun,
+    kAth3kErrorAborted,
+    kAth3kErrorCorrupt
+};
+
+//the steps of one upload, in the order the engine runs them
+enum
+{
+    kAth3kStepOpen = 0,
+    kAth3kStepGetStatus,
+    kAth3kStepReset,
+    kAth3kStepConfigure,
+    kAth3kStepFindPipe,
+    kAth3kStepControl,
+    kAth3kStepBody,
+    kAth3kStepClose,
+    kAth3kStepClearStall,   //only after a stalled bulk write, the body goes on from there
+    kAth3kStepDone,
+    kAth3kStepCount
+};
+
+enum
+{
+    kAth3kSpeedLow = 0,
+    kAth3kSpeedFull,
+    kAth3kSpeedHigh,
+    kAth3kSpeedSuper
+};
+
+//setup packet of the control request, in host byte order
+struct Ath3kControlRequest
+{
+    uint8_t bmRequestType;
+    uint8_t bRequest;
+    uint16_t wValue;
+    uint16_t wIndex;
+    uint16_t wLength;
+};
+
+//
+// the device side of an upload. every operation that starts something finishes later
+// through StepComplete() or WriteComplete() on the engine - never from inside the call,
+// so the engine does not have to be reentrant. an operation that fails right away just
+// returns the error and gets no completion
+//
+class Ath3kTransport
+{
+public:
+    //open, get status, reset, configure, find the bulk out pipe, clear its stall and close
+    virtual int StartStep(int iStep) = 0;
+    virtual int SendControl(const Ath3kControlRequest* pRequest, const uint8_t* pData, uint32_t uTimeoutMs) = 0;
+    
+    //what the pipe found by kAth3kStepFindPipe looks like
+    virtual int GetPacketSize(void) = 0;
+    virtual int GetSpeed(void) = 0;
+    
+    //staging memory of a slot, at least iCapacity bytes. the transport keeps it between
+    //uploads and only has to grow it
+    virtual uint8_t* GetSlotBuffer(int iSlot, int iCapacity) = 0;
+    
+    //bInPlace means pData points into the image handed to the engine, which the transport
+    //may describe directly instead of a staging buffer. the write fails with kAth3kErrorTimeout
+    //once no data moved for uNoDataMs while it was the one on the bus, or when it is not done
+    //uCompletionMs after it was queued - the no-data and completion timeouts of IOUSBPipe
+    virtual int BulkWrite(int iSlot, const uint8_t* pData, int iLength, bool bInPlace, uint32_t uNoDataMs,
+                          uint32_t uCompletionMs) = 0;
+    virtual void AbortBulk(void) = 0;
+    
+    //monotonic clock the auto-tune measures with - the simulator runs on a virtual one
+    virtual uint64_t GetTimeNanoseconds(void) = 0;
+};
+
+//
+// how the body is cut into bulk writes, as a type the engine is specialized on by
+// StartWith(). Ath3kChunkEndpoint is what Start() does: the chunk size of the config or the
+// one derived from the endpoint, the auto-tune and the chunk plans. the other two fix it at
+// compile time
+//
+struct Ath3kChunkEndpoint
+{
+    enum { kChunkSize = 0 };
+};
+
+//whole kilobytes, so every chunk is whole packets of any bulk endpoint
+template <int iChunkSize>
+struct Ath3kChunkFixed
+{
+    static_assert((iChunkSize >= ATH3K_CHUNK_SIZE_MIN) && (iChunkSize <= ATH3K_CHUNK_SIZE_MAX) && (iChunkSize % 1024 == 0),
+                  "fixed chunks are whole kilobytes between ATH3K_CHUNK_SIZE_MIN and ATH3K_CHUNK_SIZE_MAX");
+    
+    enum { kChunkSize = iChunkSize };
+};
+
+//the whole body in one write, like bSingleTransfer
+struct Ath3kChunkWhole
+{
+    enum { kChunkSize = -1 };
+};
+
+//
+// optional listener for what the engine does, with the time of the transport clock. called
+// from inside the engine, so it must not call back into it
+//
+class Ath3kUploadObserver
+{
+public:
+    virtual void StepStarted(int iStep, uint64_t uTime) = 0;
+    virtual void StepFinished(int iStep, int iResult, uint64_t uTime) = 0;
+    virtual void WriteSubmitted(int iSlot, int iPosition, int iLength, uint64_t uTime) = 0;
+    
+    //the link had no room, the engine tries again after the next completion
+    virtual void WriteRefused(int iSlot, uint64_t uTime) = 0;
+    virtual void WriteCompleted(int iSlot, int iResult, int iBytesDone, uint64_t uTime) = 0;
+};
+
+//where the time of an upload went, on the clock of the transport
+struct Ath3kUploadTiming
+{
+    uint64_t aStepNanoseconds[kAth3kStepCount];     //from starting a step to moving on from it
+    uint64_t uTotalNanoseconds;
+    
+    //from a failed bulk write until the body went on again, over all recoveries
+    uint64_t uRecoveryNanoseconds;
+    
+    //bulk writes from submit to completion, the failed ones left out
+    uint32_t aChunkLatency[ATH3K_LATENCY_BUCKETS];
+    uint32_t uChunks;
+    uint64_t uChunkMinNanoseconds;
+    uint64_t uChunkMaxNanoseconds;
+    uint64_t uChunkSumNanoseconds;
+    
+    //no-data timeouts the bulk writes were given, bucketed like the latencies, and the
+    //longest completion timeout
+    uint32_t aNoDataTimeout[ATH3K_LATENCY_BUCKETS];
+    uint32_t uNoDataTimeoutMinMs;
+    uint32_t uNoDataTimeoutMaxMs;
+    uint32_t uCompletionTimeoutMaxMs;
+};
+
+struct Ath3kUploadConfig
+{
+    //the raw image, or the LZ4 packed one together with the decoder history window
+    const uint8_t* pImage;
+    const uint8_t* pImageCompressed;
+    int iImageCompressedSize;
+    uint8_t* pDecoderWindow;
+    int iImageSize;
+    
+    //0 derives the chunk size from the endpoint, bSingleTransfer sends the body in one write
+    int iChunkSize;
+    int iQueueDepth;
+    bool bZeroCopy;
+    bool bSingleTransfer;
+    bool bAutoTune;
+    
+    //stalled or timed out bulk writes the engine recovers from before it gives up, 0 fails
+    //the upload on the first one
+    int iMaxRecoveries;
+    
+    //bounds of the no-data timeouts, the upper one also the least completion timeout. 0 for
+    //ATH3K_TIMEOUT_MIN_MS and ATH3K_TIMEOUT_MAX_MS
+    uint32_t uTimeoutMinMs;
+    uint32_t uTimeoutMaxMs;
+    
+    //checksums the image is checked against as the chunks go out, NULL for none. a mismatch
+    //fails the upload with kAth3kErrorCorrupt before the last chunk is submitted
+    const Ath3kImageDigest* pDigest;
+    
+    //chunk plans of the image, as many chunk sizes as iPlans. a chunk size without a plan
+    //is cut at run time, and so is the body after a resume in the middle of a chunk
+    const Ath3kChunkPlan* pPlans;
+    int iPlans;
+    
+    Ath3kUploadObserver* pObserver;
+};
+
+//
+// the DFU sequence as an event driven state machine. Start() sets it up, Pump() submits
+// whatever can go out now and the completions move it on, until IsDone(). nothing in here
+// blocks, allocates or depends on the platform, so the kext, the simulator and the
+// benchmarks all run the same code
+//
+class Ath3kUploadEngine
+{
+private:
+    enum
+    {
+        kRecoveryNone = 0,
+        kRecoveryResume,        //clear the stall and go on where the device stopped taking data
+        kRecoveryRestart        //reset the device and send the whole image again
+    };
+    
+    struct Slot
+    {
+        const uint8_t* pData;
+        int iPosition;
+        int iLength;
+        int iOutstanding;       //bytes in flight when it was queued, its own included
+        uint64_t uSubmitted;
+        bool bBusy;
+        bool bPrepared;
+    };
+    
+    Ath3kTransport* m_pTransport;
+    Ath3kUploadConfig m_config;
+    Ath3kFirmwareDecoder m_decoderFirmware;
+    Ath3kImageVerifier m_verifier;
+    
+    int m_iStep;
+    bool m_bStepPending;
+    bool m_bDeviceOpen;
+    int m_iResult;
+    int m_iFailedStep;
+    
+    uint8_t m_aHeader[ATH3K_DFU_HEADER_SIZE];
+    
+    Slot m_aSlots[ATH3K_QUEUE_DEPTH_MAX];
+    int m_iQueueDepth;
+    int m_iSlotsBusy;
+    int m_iPacketSize;
+    int m_iChunkSize;
+    const Ath3kChunkPlan* m_pPlan;
+    int m_iSubmitPosition;
+    int m_iAckPosition;
+    int m_iBytesCopied;
+    bool m_bAborted;
+    bool m_bLinkBusy;
+    
+    //auto-tune: the window of the candidate being measured and the best one so far
+    bool m_bTuning;
+    int m_iTuneCandidate;
+    int m_iWindowEnd;
+    uint64_t m_uWindowStart;
+    int m_iBestChunkSize;
+    uint64_t m_uBestBytes;
+    uint64_t m_uBestNanoseconds;
+    int m_iTunedChunkSize;
+    
+    //recovery from a failed bulk write: what is under way and where the body resumes
+    int m_iRecovery;
+    int m_iResumePosition;
+    int m_iRecoveries;
+    int m_iWastedBytes;
+    uint64_t m_uRecoveryStart;
+    
+    //nanoseconds per byte in flight the writes took, mean and deviation in fixed point, and
+    //how often a timeout doubled the timeouts since
+    uint64_t m_uRateMean;
+    uint64_t m_uRateDeviation;
+    int m_iRateSamples;
+    int m_iTimeoutBackoff;
+    
+    Ath3kUploadTiming m_timing;
+    uint64_t m_uStart;
+    uint64_t m_uStepStart;
+    
+    //the body loop Start() or StartWith() picked, see ath3k-engine-body.h
+    void (Ath3kUploadEngine::*m_pfnPumpBody)(void);
+    
+    void SetStep(int iStep);
+    void Fail(int iResult);
+    void FinishStep(int iResult);
+    //the engine does its clamping on one type at a time, A and B have to agree
+    template <typename T> static T Min(T A, T B) { return((A < B) ? A : B); }
+    template <typename T> static T Max(T A, T B) { return((A < B) ? B : A); }
+    
+    int CopyImage(uint8_t* pDestination, int iPosition, int iLength);
+    int SeekImage(int iPosition);
+    int SendHeader(void);
+    int PlanChunkSize(void);
+    bool NextTuneWindow(void);
+    void FinishTuneWindow(void);
+    const Ath3kPlannedChunk* GetPlannedChunk(int iPosition);
+    template <class Transport, class ChunkPolicy> int PrepareSlotWith(int iSlot);
+    void GetWriteTimeouts(const Slot* pSlot, uint32_t* puNoDataMs, uint32_t* puCompletionMs);
+    void UpdateRate(uint64_t uLatency, int iOutstanding);
+    template <class Transport, class ChunkPolicy> void PumpBodyWith(void);
+    bool Recover(int iResult, int iPosition);
+    void StartRecovery(void);
+    void RestartUpload(void);
+    void FinishRecovery(void);
+
+public:
+    void Start(Ath3kTransport* pTransport, const Ath3kUploadConfig* pConfig);
+    template <class Transport, class ChunkPolicy> void StartWith(Transport* pTransport, const Ath3kUploadConfig* pConfig);
+    void Pump(void);
+    
+    void StepComplete(int iStep, int iResult);
+    void WriteComplete(int iSlot, int iResult, int iBytesDone);
+    
+    bool IsDone(void) const { return(m_iStep == kAth3kStepDone); }
+    bool IsLinkBusy(void) const { return(m_bLinkBusy); }
+    int GetStep(void) const { return(m_iStep); }
+    int GetResult(void) const { return(m_iResult); }
+    int GetFailedStep(void) const { return(m_iFailedStep); }
+    
+    //bytes the device acknowledged, header included, and how many went through the cpu
+    int GetPosition(void) const { return(m_iAckPosition); }
+    int GetBytesCopied(void) const { return(m_iBytesCopied); }
+    
+    //every byte of the image went out and matched the digest of the config
+    bool IsImageVerified(void) const { return(m_verifier.IsVerified()); }
+    
+    int GetQueueDepth(void) const { return(m_iQueueDepth); }
+    int GetPacketSize(void) const { return(m_iPacketSize); }
+    int GetChunkSize(void) const { return(m_iChunkSize); }
+    
+    //the chunk size the auto-tune settled on, 0 if it did not run to the end
+    int GetTunedChunkSize(void) const { return(m_iTunedChunkSize); }
+    
+    //failed bulk writes the upload recovered from, and the bytes the device had taken that
+    //had to go again because of them
+    int GetRecoveries(void) const { return(m_iRecoveries); }
+    int GetWastedBytes(void) const { return(m_iWastedBytes); }
+    
+    const Ath3kUploadTiming* GetTiming(void) const { return(&m_timing); }
+    static int GetLatencyBucket(uint64_t uNanoseconds);
+    
+    //iState is the byte GETSTATE returned, or -1 if the device did not answer it
+    static bool IsFirmwareRunning(int iDeviceRelease, int iState);
+};
+
+#endif //__ATH3K_ENGINE__
@@ -0,0 +1,141 @@
+/*
+ Streaming decoder for the compressed firmware image, see tools/fwpack.py for the format.
+ Plain C++ without IOKit so the same code can run outside the kernel.
+ */
+#include <string.h>
+
+#include "ath3k-fwcodec.h"
+
+#define LZ_MIN_MATCH    4
+#define LZ_WINDOW_MASK  (ATH3K_LZ_WINDOW_SIZE - 1)
+
+void Ath3kFirmwareDecoder::Init(const uint8_t* pSource, uint32_t uSourceLength, uint8_t* pWindow)
+{
+    m_pSource = pSource;
+    m_uSourceLength = uSourceLength;
+    m_uSourcePosition = 0;
+    
+    m_pWindow = pWindow;
+    m_uWindowPosition = 0;
+    
+    m_uLiteralsRemaining = 0;
+    m_uMatchRemaining = 0;
+    m_uMatchOffset = 0;
+    m_uToken = 0;
+    m_bMatchPending = false;
+    m_bCorrupt = false;
+}
+
+//lengths of 15 continue in the following bytes until one is not 255
+bool Ath3kFirmwareDecoder::ReadLength(uint32_t* puLength)
+{
+    uint8_t uByte = 255;
+    
+    while (uByte == 255)
+    {
+        if (m_uSourcePosition >= m_uSourceLength) return(false);
+        
+        uByte = m_pSource[m_uSourcePosition++];
+        *puLength += uByte;
+    }
+    
+    return(true);
+}
+
+bool Ath3kFirmwareDecoder::StartSequence(void)
+{
+    m_uToken = m_pSource[m_uSourcePosition++];
+    m_uLiteralsRemaining = m_uToken >> 4;
+    
+    if ((m_uLiteralsRemaining == 15) && !this->ReadLength(&m_uLiteralsRemaining)) return(false);
+    if (m_uLiteralsRemaining > m_uSourceLength - m_uSourcePosition) return(false);
+    
+    m_bMatchPending = true;
+    
+    return(true);
+}
+
+bool Ath3kFirmwareDecoder::StartMatch(void)
+{
+    m_bMatchPending = false;
+    
+    //the last sequence of the block has literals only
+    if (m_uSourcePosition == m_uSourceLength) return(true);
+    if (m_uSourceLength - m_uSourcePosition < 2) return(false);
+    
+    m_uMatchOffset = m_pSource[m_uSourcePosition] | (m_pSource[m_uSourcePosition + 1] << 8);
+    m_uSourcePosition += 2;
+    
+    //offsets may not point before the start of the output or outside the window
+    if ((m_uMatchOffset == 0) || (m_uMatchOffset > m_uWindowPosition)) return(false);
+    
+    m_uMatchRemaining = (m_uToken & 15) + LZ_MIN_MATCH;
+    if (((m_uToken & 15) == 15) && !this->ReadLength(&m_uMatchRemaining)) return(false);
+    
+    return(true);
+}
+
+int Ath3kFirmwareDecoder::Decode(uint8_t* pDestination, uint32_t uLength)
+{
+    uint32_t uProduced = 0;
+    
+    if (m_bCorrupt) return(-1);
+    
+    while (uProduced < uLength)
+    {
+        if (m_uLiteralsRemaining > 0)
+        {
+            //literals come straight from the source, in pieces that do not wrap the window
+            uint32_t uCount = uLength - uProduced;
+            uint32_t uWindowOffset = m_uWindowPosition & LZ_WINDOW_MASK;
+            
+            if (uCount > m_uLiteralsRemaining) uCount = m_uLiteralsRemaining;
+            if (uCount > ATH3K_LZ_WINDOW_SIZE - uWindowOffset) uCount = ATH3K_LZ_WINDOW_SIZE - uWindowOffset;
+            
+            ::memcpy(pDestination + uProduced, m_pSource + m_uSourcePosition, uCount);
+            ::memcpy(m_pWindow + uWindowOffset, m_pSource + m_uSourcePosition, uCount);
+            
+            m_uSourcePosition += uCount;
+            m_uWindowPosition += uCount;
+            m_uLiteralsRemaining -= uCount;
+            uProduced += uCount;
+        }
+        else if (m_uMatchRemaining > 0)
+        {
+            //matches may overlap their own output, so copy byte by byte through the window
+            uint32_t uCount = uLength - uProduced;
+            if (uCount > m_uMatchRemaining) uCount = m_uMatchRemaining;
+            
+            for (uint32_t uCounter = 0; uCounter < uCount; uCounter++)
+            {
+                uint8_t uByte = m_pWindow[(m_uWindowPosition - m_uMatchOffset) & LZ_WINDOW_MASK];
+                
+                m_pWindow[m_uWindowPosition & LZ_WINDOW_MASK] = uByte;
+                pDestination[uProduced + uCounter] = uByte;
+                m_uWindowPosition++;
+            }
+            
+            m_uMatchRemaining -= uCount;
+            uProduced += uCount;
+        }
+        else if (m_bMatchPending)
+        {
+            if (!this->StartMatch())
+            {
+                m_bCorrupt = true;
+                return(-1);
+            }
+        }
+        else if (m_uSourcePosition < m_uSourceLength)
+        {
+            if (!this->StartSequence())
+            {
+                m_bCorrupt = true;
+                return(-1);
+            }
+        }
+        else break;
+    }
+    
+    return((int)uProduced);
+}
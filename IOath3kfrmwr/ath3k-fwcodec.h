@@ -0,0 +1,44 @@
+/* Ath3kFirmwareDecoder class */
+#ifndef __ATH3K_FWCODEC__
+#define __ATH3K_FWCODEC__
+
+#include <stdint.h>
+
+//matches reach at most this far back, the caller provides a history window of this size
+#define ATH3K_LZ_WINDOW_SIZE    65536
+
+//
+// streaming decoder for the LZ4 block produced by tools/fwpack.py. Decode() can be called
+// with any output size, so each transfer buffer is filled just in time during the upload
+// while the expanded image never exists in one piece
+//
+class Ath3kFirmwareDecoder
+{
+private:
+    const uint8_t* m_pSource;
+    uint32_t m_uSourceLength;
+    uint32_t m_uSourcePosition;
+    
+    uint8_t* m_pWindow;
+    uint32_t m_uWindowPosition;
+    
+    uint32_t m_uLiteralsRemaining;
+    uint32_t m_uMatchRemaining;
+    uint32_t m_uMatchOffset;
+    uint8_t m_uToken;
+    bool m_bMatchPending;
+    bool m_bCorrupt;
+    
+    bool ReadLength(uint32_t* puLength);
+    bool StartSequence(void);
+    bool StartMatch(void);
+    
+public:
+    void Init(const uint8_t* pSource, uint32_t uSourceLength, uint8_t* pWindow);
+    
+    //returns the number of bytes written to pDestination, less than uLength only at the
+    //end of the stream, or -1 if the stream is corrupt
+    int Decode(uint8_t* pDestination, uint32_t uLength);
+};
+
+#endif //__ATH3K_FWCODEC__
@@ -0,0 +1,106 @@
+/* Ath3kChunkPlan and Ath3kChunkTable classes */
+#ifndef __ATH3K_PLAN__
+#define __ATH3K_PLAN__
+
+#include <stdint.h>
+
+#include "ath3k-engine.h"
+
+//the DFU header as the images carry it: five little endian words, the third of them the
+//length of the body that follows through the bulk pipe
+#define ATH3K_DFU_HEADER_BODY_LENGTH    8
+
+//chunks a plan may have - one per packet of the smallest chunk over an image of 256 KB
+#define ATH3K_PLAN_CHUNKS_MAX           512
+
+//one bulk write of the body: where in the image it starts and how long it is
+struct Ath3kPlannedChunk
+{
+    int iPosition;
+    int iLength;
+};
+
+//the body of an image of iImageSize bytes cut into iChunkSize chunks, only the last one
+//shorter. built by Ath3kChunkTable at compile time, the engine just walks it
+struct Ath3kChunkPlan
+{
+    int iImageSize;
+    int iChunkSize;
+    int iChunks;
+    const Ath3kPlannedChunk* pChunks;
+};
+
+//
+// the header and the plan as constant expressions, one return statement each for C++11
+//
+constexpr uint32_t Ath3kDfuHeaderWord(const uint8_t* pHeader, int iOffset)
+{
+    return((uint32_t)pHeader[iOffset] | ((uint32_t)pHeader[iOffset + 1] << 8) | ((uint32_t)pHeader[iOffset + 2] << 16) |
+           ((uint32_t)pHeader[iOffset + 3] << 24));
+}
+
+constexpr uint32_t Ath3kDfuBodyLength(const uint8_t* pHeader)
+{
+    return(Ath3kDfuHeaderWord(pHeader, ATH3K_DFU_HEADER_BODY_LENGTH));
+}
+
+constexpr int Ath3kPlanChunkCount(int iImageSize, int iChunkSize)
+{
+    return((iImageSize - ATH3K_DFU_HEADER_SIZE + iChunkSize - 1) / iChunkSize);
+}
+
+constexpr Ath3kPlannedChunk Ath3kPlanChunk(int iImageSize, int iChunkSize, int iChunk)
+{
+    return(Ath3kPlannedChunk{ ATH3K_DFU_HEADER_SIZE + iChunk * iChunkSize,
+                              (iImageSize - ATH3K_DFU_HEADER_SIZE - iChunk * iChunkSize < iChunkSize) ?
+                              iImageSize - ATH3K_DFU_HEADER_SIZE - iChunk * iChunkSize : iChunkSize });
+}
+
+//0, 1, .. iCount - 1 as a parameter pack, the table is expanded over it
+template <int... iIndices> struct Ath3kPlanIndices { };
+
+template <int iCount, int... iIndices>
+struct Ath3kMakePlanIndices : Ath3kMakePlanIndices<iCount - 1, iCount - 1, iIndices...> { };
+
+template <int... iIndices>
+struct Ath3kMakePlanIndices<0, iIndices...>
+{
+    typedef Ath3kPlanIndices<iIndices...> Type;
+};
+
+//
+// the chunks of an image of iImageSize bytes at iChunkSize, as a constant table. an image
+// too small for its header, or a plan that does not end with the last byte of the image,
+// stops the build
+//
+template <int iImageSize, int iChunkSize,
+          typename Indices = typename Ath3kMakePlanIndices<Ath3kPlanChunkCount(iImageSize, iChunkSize)>::Type>
+class Ath3kChunkTable;
+
+template <int iImageSize, int iChunkSize, int... iIndices>
+class Ath3kChunkTable<iImageSize, iChunkSize, Ath3kPlanIndices<iIndices...> >
+{
+private:
+    static_assert(iImageSize > ATH3K_DFU_HEADER_SIZE, "the image has no body after the DFU header");
+    static_assert(iChunkSize > 0, "chunks need at least one byte");
+    static_assert(sizeof...(iIndices) <= ATH3K_PLAN_CHUNKS_MAX, "too many chunks for one plan");
+    static_assert(Ath3kPlanChunk(iImageSize, iChunkSize, sizeof...(iIndices) - 1).iPosition +
+                  Ath3kPlanChunk(iImageSize, iChunkSize, sizeof...(iIndices) - 1).iLength == iImageSize,
+                  "the chunks do not end with the image");
+    
+    static const Ath3kPlannedChunk m_aChunks[sizeof...(iIndices)];
+
+public:
+    static constexpr Ath3kChunkPlan GetPlan(void)
+    {
+        return(Ath3kChunkPlan{ iImageSize, iChunkSize, (int)sizeof...(iIndices), m_aChunks });
+    }
+};
+
+template <int iImageSize, int iChunkSize, int... iIndices>
+const Ath3kPlannedChunk Ath3kChunkTable<iImageSize, iChunkSize, Ath3kPlanIndices<iIndices...> >::m_aChunks[] =
+{
+    Ath3kPlanChunk(iImageSize, iChunkSize, iIndices)...
+};
+
+#endif //__ATH3K_PLAN__
@@ -0,0 +1,117 @@
+/*
+ Lock-free trace ring of the driver, see ath3k-trace.h. Plain C++ without IOKit so the
+ simulator and the benchmarks can use it as well.
+ */
+#include <string.h>
+
+#if KERNEL
+#include <libkern/libkern.h>
+#else
+#include <stdio.h>
+#endif
+
+#include "ath3k-trace.h"
+
+static const char* g_aLevelNames[] = { "error", "info", "debug" };
+
+//text of the events, with the arguments as unsigned long long
+static const char* g_aEventFormats[kAth3kTraceEventCount] =
+{
+    "init",
+    "free",
+    "attach",
+    "detach",
+    "probe -> bcdDevice %04llx, state %02llx, firmware running %llu",
+    "start -> upload scheduled, matching thread held for %llu us",
+    "stop",
+    "upload queued (#%llu)",
+    "firmware -> %llu bytes resident, %llu cache hits, %llu misses",
+    "step %llu done (%llu), %08llx",
+    "control request sent",
+    "packet size %llu, chunk size %llu, queue depth %llu",
+    "bulk write queued on slot %llu, %llu bytes, no data timeout %llu ms",
+    "bulk write on slot %llu done (%llu), %llu bytes",
+    "tuned chunk size %llu",
+    "upload finished (%llu), position %llu, %llu bytes copied",
+    "%llu devices ready in %llu ms (%llu failed)",
+    "bulk out endpoint %02llx on interface %llu, cached table %llu",
+    "buffer pool -> %llu hits, %llu misses, peak %llu"
+};
+
+void Ath3kTraceRing::Init(Ath3kTraceRecord* pRecords, uint32_t uRecords, uint64_t (*pfnClock)(void))
+{
+    m_pRecords = pRecords;
+    m_uMask = uRecords - 1;
+    m_uTicket = 0;
+    m_iLevel = kAth3kTraceInfo;
+    m_pfnClock = pfnClock;
+    
+    if (m_pRecords != NULL) memset(m_pRecords, 0, uRecords * sizeof(Ath3kTraceRecord));
+}
+
+void Ath3kTraceRing::Record(int iLevel, int iEvent, uint32_t uDevice, uint64_t uArg0, uint64_t uArg1, uint64_t uArg2)
+{
+    if (!this->IsEnabled(iLevel)) return;
+    
+    uint32_t uTicket = __atomic_fetch_add(&m_uTicket, 1, __ATOMIC_RELAXED);
+    Ath3kTraceRecord* pRecord = &m_pRecords[uTicket & m_uMask];
+    
+    //readers skip the record until the sequence is back
+    __atomic_store_n(&pRecord->uSequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    
+    pRecord->uTimestamp = m_pfnClock();
+    pRecord->aArgs[0] = uArg0;
+    pRecord->aArgs[1] = uArg1;
+    pRecord->aArgs[2] = uArg2;
+    pRecord->uDevice = uDevice;
+    pRecord->uEvent = (uint16_t)iEvent;
+    pRecord->uLevel = (uint8_t)iLevel;
+    
+    __atomic_store_n(&pRecord->uSequence, uTicket + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t Ath3kTraceRing::Read(Ath3kTraceRecord* pRecords, uint32_t uRecords) const
+{
+    if (m_pRecords == NULL) return(0);
+    
+    uint32_t uEnd = __atomic_load_n(&m_uTicket, __ATOMIC_ACQUIRE);
+    uint32_t uStart = (uEnd > m_uMask + 1) ? uEnd - (m_uMask + 1) : 0;
+    uint32_t uCopied = 0;
+    
+    if (uEnd - uStart > uRecords) uStart = uEnd - uRecords;
+    
+    for (uint32_t uTicket = uStart; uTicket != uEnd; uTicket++)
+    {
+        const Ath3kTraceRecord* pRecord = &m_pRecords[uTicket & m_uMask];
+        
+        if (__atomic_load_n(&pRecord->uSequence, __ATOMIC_ACQUIRE) != uTicket + 1) continue;
+        memcpy(&pRecords[uCopied], pRecord, sizeof(Ath3kTraceRecord));
+        
+        //a writer that got to the record while we copied it leaves a different sequence
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&pRecord->uSequence, __ATOMIC_RELAXED) != uTicket + 1) continue;
+        
+        uCopied++;
+    }
+    
+    return(uCopied);
+}
+
+int Ath3kTraceRing::Format(const Ath3kTraceRecord* pRecord, char* pszLine, size_t uLineSize)
+{
+    int iLength = snprintf(pszLine, uLineSize, "[%llu.%06llu] %s %08x: ",
+                           (unsigned long long)(pRecord->uTimestamp / 1000000000ULL),
+                           (unsigned long long)((pRecord->uTimestamp / 1000ULL) % 1000000ULL),
+                           (pRecord->uLevel <= kAth3kTraceDebug) ? g_aLevelNames[pRecord->uLevel] : "?", pRecord->uDevice);
+    if ((iLength < 0) || ((size_t)iLength >= uLineSize)) return(iLength);
+    
+    if (pRecord->uEvent >= kAth3kTraceEventCount)
+    {
+        return(iLength + snprintf(pszLine + iLength, uLineSize - iLength, "event %u", pRecord->uEvent));
+    }
+    
+    return(iLength + snprintf(pszLine + iLength, uLineSize - iLength, g_aEventFormats[pRecord->uEvent],
+                              (unsigned long long)pRecord->aArgs[0], (unsigned long long)pRecord->aArgs[1],
+                              (unsigned long long)pRecord->aArgs[2]));
+}
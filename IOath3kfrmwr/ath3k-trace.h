@@ -0,0 +1,92 @@
+/* Ath3kTraceRing class */
+#ifndef __ATH3K_TRACE__
+#define __ATH3K_TRACE__
+
+#include <stddef.h>
+#include <stdint.h>
+
+//records a driver instance keeps - a power of two, the oldest ones are overwritten
+#define ATH3K_TRACE_RECORDS         256
+#define ATH3K_TRACE_ARGS            3
+#define ATH3K_TRACE_LINE_SIZE       160
+
+enum
+{
+    kAth3kTraceError = 0,
+    kAth3kTraceInfo,
+    kAth3kTraceDebug
+};
+
+//what happened - the reader turns the id and the arguments into text, see ath3k-trace.cpp
+enum
+{
+    kAth3kTraceInit = 0,
+    kAth3kTraceFree,
+    kAth3kTraceAttach,
+    kAth3kTraceDetach,
+    kAth3kTraceProbe,           //bcdDevice, GETSTATE answer (0xff without), firmware running
+    kAth3kTraceStart,           //matching thread held (us)
+    kAth3kTraceStop,
+    kAth3kTraceUploadQueued,    //position in the queue
+    kAth3kTraceFirmware,        //resident bytes, cache hits, misses
+    kAth3kTraceStepDone,        //step, result, detail
+    kAth3kTraceControlSent,
+    kAth3kTraceUploadConfig,    //packet size, chunk size, queue depth
+    kAth3kTraceWriteSubmitted,  //slot, length
+    kAth3kTraceWriteComplete,   //slot, result, bytes done
+    kAth3kTraceChunkTuned,      //chunk size
+    kAth3kTraceUploadDone,      //result, position, bytes copied
+    kAth3kTraceLoaderDone,      //devices, ms, failed
+    kAth3kTraceEndpoint,        //endpoint address, interface, from the cache
+    kAth3kTraceBufferPool,      //hits, misses, most buffers lent out at once
+    kAth3kTraceEventCount
+};
+
+//one event as it sits in the ring. uSequence is the ticket it was written with plus one,
+//0 while a writer is filling the record in
+struct Ath3kTraceRecord
+{
+    uint64_t uTimestamp;
+    uint64_t aArgs[ATH3K_TRACE_ARGS];
+    uint32_t uSequence;
+    uint32_t uDevice;
+    uint16_t uEvent;
+    uint8_t uLevel;
+    uint8_t uReserved;
+};
+
+//
+// fixed size binary records in a ring that any number of threads write to without taking a
+// lock: a writer takes a ticket with one atomic add and owns the record it maps to. nothing
+// is formatted when an event happens - Read() copies the records out and Format() turns them
+// into text, both off the hot path
+//
+class Ath3kTraceRing
+{
+private:
+    Ath3kTraceRecord* m_pRecords;
+    uint32_t m_uMask;
+    uint32_t m_uTicket;
+    int m_iLevel;
+    uint64_t (*m_pfnClock)(void);
+
+public:
+    //uRecords must be a power of two, pfnClock returns monotonic nanoseconds
+    void Init(Ath3kTraceRecord* pRecords, uint32_t uRecords, uint64_t (*pfnClock)(void));
+    
+    void SetLevel(int iLevel) { m_iLevel = iLevel; }
+    bool IsEnabled(int iLevel) const { return((m_pRecords != NULL) && (iLevel <= m_iLevel)); }
+    
+    void Record(int iLevel, int iEvent, uint32_t uDevice, uint64_t uArg0 = 0, uint64_t uArg1 = 0, uint64_t uArg2 = 0);
+    
+    //copies the records still in the ring to pRecords, oldest first, and returns how many.
+    //records a writer is busy with or overwrites meanwhile are left out
+    uint32_t Read(Ath3kTraceRecord* pRecords, uint32_t uRecords) const;
+    
+    //events written so far, including the ones that were overwritten
+    uint32_t GetCount(void) const { return(__atomic_load_n(&m_uTicket, __ATOMIC_RELAXED)); }
+    
+    static int Format(const Ath3kTraceRecord* pRecord, char* pszLine, size_t uLineSize);
+};
+
+#endif //__ATH3K_TRACE__
@@ -0,0 +1,233 @@
+/*
+ Checksums of the firmware image, see ath3k-verify.h. Plain C++ without IOKit so the
+ simulator and the benchmarks can use it as well.
+ */
+#include <string.h>
+
+#include "ath3k-verify.h"
+
+#define CRC32_POLYNOMIAL    0xEDB88320
+
+#define SHA256_ROTR(X,N)    (((X) >> (N)) | ((X) << (32 - (N))))
+
+//the eight tables of slice-by-8: table n advances the CRC of a byte by n more zero bytes.
+//built when the kext (or the program) is loaded, so the uploads only ever read them
+static struct Crc32Tables
+{
+    uint32_t aTables[8][256];
+    
+    Crc32Tables()
+    {
+        for (uint32_t uByte = 0; uByte < 256; uByte++)
+        {
+            uint32_t uValue = uByte;
+            for (int iBit = 0; iBit < 8; iBit++) uValue = (uValue & 1) ? (CRC32_POLYNOMIAL ^ (uValue >> 1)) : (uValue >> 1);
+            aTables[0][uByte] = uValue;
+        }
+        for (int iTable = 1; iTable < 8; iTable++)
+        {
+            for (int iByte = 0; iByte < 256; iByte++)
+            {
+                uint32_t uValue = aTables[iTable - 1][iByte];
+                aTables[iTable][iByte] = aTables[0][uValue & 0xFF] ^ (uValue >> 8);
+            }
+        }
+    }
+} g_crc32Tables;
+
+static const uint32_t g_aSha256Constants[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+uint32_t Ath3kCrc32(uint32_t uCrc32, const uint8_t* pData, size_t uLength)
+{
+    const uint32_t (*aTables)[256] = g_crc32Tables.aTables;
+    
+    uCrc32 = ~uCrc32;
+    
+    //eight bytes at a time, read a byte at a time so neither alignment nor byte order matter
+    while (uLength >= 8)
+    {
+        uint32_t uLow = uCrc32 ^ ((uint32_t)pData[0] | ((uint32_t)pData[1] << 8) | ((uint32_t)pData[2] << 16) |
+                                  ((uint32_t)pData[3] << 24));
+        
+        uCrc32 = aTables[7][uLow & 0xFF] ^ aTables[6][(uLow >> 8) & 0xFF] ^ aTables[5][(uLow >> 16) & 0xFF] ^
+                 aTables[4][uLow >> 24] ^ aTables[3][pData[4]] ^ aTables[2][pData[5]] ^ aTables[1][pData[6]] ^
+                 aTables[0][pData[7]];
+        
+        pData += 8;
+        uLength -= 8;
+    }
+    
+    while (uLength-- > 0) uCrc32 = aTables[0][(uCrc32 ^ *pData++) & 0xFF] ^ (uCrc32 >> 8);
+    
+    return(~uCrc32);
+}
+
+void Ath3kSha256::Init(void)
+{
+    m_aState[0] = 0x6a09e667;
+    m_aState[1] = 0xbb67ae85;
+    m_aState[2] = 0x3c6ef372;
+    m_aState[3] = 0xa54ff53a;
+    m_aState[4] = 0x510e527f;
+    m_aState[5] = 0x9b05688c;
+    m_aState[6] = 0x1f83d9ab;
+    m_aState[7] = 0x5be0cd19;
+    m_uLength = 0;
+}
+
+void Ath3kSha256::Transform(const uint8_t* pBlock)
+{
+    uint32_t aSchedule[64];
+    
+    for (int iWord = 0; iWord < 16; iWord++)
+    {
+        aSchedule[iWord] = ((uint32_t)pBlock[iWord * 4] << 24) | ((uint32_t)pBlock[iWord * 4 + 1] << 16) |
+                           ((uint32_t)pBlock[iWord * 4 + 2] << 8) | (uint32_t)pBlock[iWord * 4 + 3];
+    }
+    for (int iWord = 16; iWord < 64; iWord++)
+    {
+        uint32_t uSigma0 = SHA256_ROTR(aSchedule[iWord - 15], 7) ^ SHA256_ROTR(aSchedule[iWord - 15], 18) ^
+                           (aSchedule[iWord - 15] >> 3);
+        uint32_t uSigma1 = SHA256_ROTR(aSchedule[iWord - 2], 17) ^ SHA256_ROTR(aSchedule[iWord - 2], 19) ^
+                           (aSchedule[iWord - 2] >> 10);
+        aSchedule[iWord] = aSchedule[iWord - 16] + uSigma0 + aSchedule[iWord - 7] + uSigma1;
+    }
+    
+    uint32_t uA = m_aState[0], uB = m_aState[1], uC = m_aState[2], uD = m_aState[3];
+    uint32_t uE = m_aState[4], uF = m_aState[5], uG = m_aState[6], uH = m_aState[7];
+    
+    for (int iRound = 0; iRound < 64; iRound++)
+    {
+        uint32_t uSum1 = SHA256_ROTR(uE, 6) ^ SHA256_ROTR(uE, 11) ^ SHA256_ROTR(uE, 25);
+        uint32_t uChoice = (uE & uF) ^ (~uE & uG);
+        uint32_t uTemp1 = uH + uSum1 + uChoice + g_aSha256Constants[iRound] + aSchedule[iRound];
+        uint32_t uSum0 = SHA256_ROTR(uA, 2) ^ SHA256_ROTR(uA, 13) ^ SHA256_ROTR(uA, 22);
+        uint32_t uMajority = (uA & uB) ^ (uA & uC) ^ (uB & uC);
+        uint32_t uTemp2 = uSum0 + uMajority;
+        
+        uH = uG;
+        uG = uF;
+        uF = uE;
+        uE = uD + uTemp1;
+        uD = uC;
+        uC = uB;
+        uB = uA;
+        uA = uTemp1 + uTemp2;
+    }
+    
+    m_aState[0] += uA;
+    m_aState[1] += uB;
+    m_aState[2] += uC;
+    m_aState[3] += uD;
+    m_aState[4] += uE;
+    m_aState[5] += uF;
+    m_aState[6] += uG;
+    m_aState[7] += uH;
+}
+
+void Ath3kSha256::Update(const uint8_t* pData, size_t uLength)
+{
+    size_t uFill = (size_t)(m_uLength % ATH3K_SHA256_BLOCK_SIZE);
+    m_uLength += uLength;
+    
+    //top up a block left over from the last call first
+    if (uFill > 0)
+    {
+        size_t uCopy = ATH3K_SHA256_BLOCK_SIZE - uFill;
+        if (uCopy > uLength) uCopy = uLength;
+        
+        memcpy(m_aBlock + uFill, pData, uCopy);
+        pData += uCopy;
+        uLength -= uCopy;
+        
+        if (uFill + uCopy < ATH3K_SHA256_BLOCK_SIZE) return;
+        this->Transform(m_aBlock);
+    }
+    
+    //whole blocks straight from the caller
+    for (; uLength >= ATH3K_SHA256_BLOCK_SIZE; uLength -= ATH3K_SHA256_BLOCK_SIZE)
+    {
+        this->Transform(pData);
+        pData += ATH3K_SHA256_BLOCK_SIZE;
+    }
+    
+    memcpy(m_aBlock, pData, uLength);
+}
+
+void Ath3kSha256::Final(uint8_t* pDigest)
+{
+    uint64_t uBits = m_uLength * 8;
+    size_t uFill = (size_t)(m_uLength % ATH3K_SHA256_BLOCK_SIZE);
+    
+    //a 1 bit, zeros up to 8 bytes short of a block, and the length in bits big endian
+    m_aBlock[uFill++] = 0x80;
+    if (uFill > ATH3K_SHA256_BLOCK_SIZE - 8)
+    {
+        memset(m_aBlock + uFill, 0, ATH3K_SHA256_BLOCK_SIZE - uFill);
+        this->Transform(m_aBlock);
+        uFill = 0;
+    }
+    memset(m_aBlock + uFill, 0, ATH3K_SHA256_BLOCK_SIZE - 8 - uFill);
+    for (int iByte = 0; iByte < 8; iByte++) m_aBlock[ATH3K_SHA256_BLOCK_SIZE - 1 - iByte] = (uint8_t)(uBits >> (iByte * 8));
+    this->Transform(m_aBlock);
+    
+    for (int iWord = 0; iWord < 8; iWord++)
+    {
+        pDigest[iWord * 4] = (uint8_t)(m_aState[iWord] >> 24);
+        pDigest[iWord * 4 + 1] = (uint8_t)(m_aState[iWord] >> 16);
+        pDigest[iWord * 4 + 2] = (uint8_t)(m_aState[iWord] >> 8);
+        pDigest[iWord * 4 + 3] = (uint8_t)m_aState[iWord];
+    }
+}
+
+void Ath3kImageVerifier::Init(const Ath3kImageDigest* pDigest, int iSize)
+{
+    m_pDigest = pDigest;
+    m_iSize = iSize;
+    m_iPosition = 0;
+    m_uCrc32 = 0;
+    m_bMatches = false;
+    
+    if ((m_pDigest != NULL) && (m_pDigest->pSha256 != NULL)) m_sha256.Init();
+}
+
+bool Ath3kImageVerifier::Update(int iPosition, const uint8_t* pData, int iLength)
+{
+    if ((m_pDigest == NULL) || this->IsComplete()) return(true);
+    
+    //a gap leaves bytes out, so the image can never match any more. what was hashed
+    //before is not hashed again
+    int iSkip = m_iPosition - iPosition;
+    if (iSkip < 0) return(false);
+    if (iSkip >= iLength) return(true);
+    
+    pData += iSkip;
+    iLength -= iSkip;
+    if (iLength > m_iSize - m_iPosition) iLength = m_iSize - m_iPosition;
+    
+    m_uCrc32 = Ath3kCrc32(m_uCrc32, pData, iLength);
+    if (m_pDigest->pSha256 != NULL) m_sha256.Update(pData, iLength);
+    m_iPosition += iLength;
+    
+    if (!this->IsComplete()) return(true);
+    
+    m_bMatches = (m_uCrc32 == m_pDigest->uCrc32);
+    if (m_pDigest->pSha256 != NULL)
+    {
+        uint8_t aSha256[ATH3K_SHA256_SIZE];
+        m_sha256.Final(aSha256);
+        m_bMatches = m_bMatches && (memcmp(aSha256, m_pDigest->pSha256, ATH3K_SHA256_SIZE) == 0);
+    }
+    
+    return(m_bMatches);
+}
@@ -0,0 +1,67 @@
+/* Ath3kSha256 and Ath3kImageVerifier classes */
+#ifndef __ATH3K_VERIFY__
+#define __ATH3K_VERIFY__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ATH3K_SHA256_SIZE       32
+#define ATH3K_SHA256_BLOCK_SIZE 64
+
+//CRC-32 (IEEE) as zlib computes it, continued from uCrc32 - start with 0. slice-by-8, so
+//eight bytes take eight table lookups and no dependency on the byte before
+uint32_t Ath3kCrc32(uint32_t uCrc32, const uint8_t* pData, size_t uLength);
+
+//what the image has to hash to, from the manifest. pSha256 NULL checks the CRC only
+struct Ath3kImageDigest
+{
+    uint32_t uCrc32;
+    const uint8_t* pSha256;
+};
+
+//
+// streaming SHA-256 (FIPS 180-4), fed in pieces of any size
+//
+class Ath3kSha256
+{
+private:
+    uint32_t m_aState[8];
+    uint8_t m_aBlock[ATH3K_SHA256_BLOCK_SIZE];
+    uint64_t m_uLength;
+    
+    void Transform(const uint8_t* pBlock);
+
+public:
+    void Init(void);
+    void Update(const uint8_t* pData, size_t uLength);
+    void Final(uint8_t* pDigest);
+};
+
+//
+// hashes the image as it goes out, chunk by chunk, and tells once the last byte is in
+// whether it is the one of the manifest. chunks have to come in order of their position;
+// bytes that were hashed before (a chunk sent again after a fault) are skipped, so every
+// byte counts once, and a chunk past the hashed position fails the image
+//
+class Ath3kImageVerifier
+{
+private:
+    const Ath3kImageDigest* m_pDigest;
+    int m_iSize;
+    int m_iPosition;
+    uint32_t m_uCrc32;
+    Ath3kSha256 m_sha256;
+    bool m_bMatches;
+
+public:
+    void Init(const Ath3kImageDigest* pDigest, int iSize);
+    
+    //false for a gap, or once the image is complete and does not match the digest
+    bool Update(int iPosition, const uint8_t* pData, int iLength);
+    
+    bool IsComplete(void) const { return(m_iPosition >= m_iSize); }
+    bool IsVerified(void) const { return(this->IsComplete() && m_bMatches); }
+    int GetPosition(void) const { return(m_iPosition); }
+};
+
+#endif //__ATH3K_VERIFY__
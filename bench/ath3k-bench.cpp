@@ -0,0 +1,847 @@
+/*
+ Benchmarks of the firmware upload: the engine runs the whole sequence against the simulated
+ dongles of sim/ath3k-sim.h over a matrix of chunk sizes, queue depths and image handling,
+ plus the single transfer mode, recovery from faults, the LZ decoder and the image checksums
+ against the bus, the specialized body loops of the engine against the generic one, several
+ dongles at once and the per hub in flight budget.
+ 
+ Time to ready, throughput, writes and allocations come from the simulator and are exact for
+ a given build. CPU time per MB is measured for real, by running the engine against a
+ transport that completes everything at once. -c compares a run against baselines written
+ by -w and fails on a regression.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ath3k-sim.h"
+#include "ath3k-engine-body.h"
+#include "ath3k-1fw-plan.h"
+
+#define BENCH_NS_PER_MS         1000000.0
+#define BENCH_FAULT_OFFSET      123392      //about half of the image, on a chunk boundary
+#define BENCH_CPU_SLACK_MS      0.05        //cpu noise below this per MB is never a regression
+#define BENCH_VERIFY_SHARE      1.0         //most the checksums may add to an upload, in percent
+#define BENCH_VERIFY_CHUNK      4096        //what the verifier is fed at a time when it runs alone
+#define BENCH_CHECKSUM_BATCHES  15          //the checksums are quick, the best of many batches of them
+#define BENCH_ENGINE_REPEATS    20          //the engine alone is quick, its batches are this much longer
+
+extern "C"
+{
+    extern const unsigned char g_bytesFirmware[];              /* ATH3K_FIRMWARE_SIZE */
+    extern const unsigned char g_bytesFirmwareCompressed[];    /* ATH3K_FIRMWARE_COMPRESSED_SIZE */
+}
+
+//how the engine gets at the image
+enum
+{
+    kBenchZeroCopy = 0,
+    kBenchStaged,
+    kBenchCompressed,
+    kBenchSingle,
+    kBenchSingleStaged
+};
+
+static const char* g_aModeNames[] = { "zerocopy", "staged", "lz", "single", "single-staged" };
+
+//how the engine is started: Start() on the abstract transport, or StartWith() built for the
+//null transport and a chunk policy
+enum
+{
+    kBenchEngineGeneric = 0,
+    kBenchEngineEndpoint,
+    kBenchEngineFixed,
+    kBenchEngineWhole
+};
+
+#define BENCH_ENGINE_FIXED_CHUNK    4096
+
+struct BenchResult
+{
+    double dReadyMs;
+    double dCpuMsPerMB;     //0 where it was not measured
+    int iAllocations;
+    int iWrites;
+    bool bSuccess;
+};
+
+struct BenchOptions
+{
+    const char* pFilter;
+    int iRepeats;
+    double dTolerance;      //allowed slowdown of the simulated times, in percent
+    double dCpuFactor;      //allowed slowdown of the cpu time, as a factor
+};
+
+static BenchOptions g_options;
+static std::map<std::string, BenchResult> g_mapResults;
+static std::vector<std::string> g_aOrder;
+static bool g_bFailed = false;
+
+static bool IsSelected(const std::string& strName)
+{
+    return((g_options.pFilter == NULL) || (strName.find(g_options.pFilter) != std::string::npos));
+}
+
+static void Record(const std::string& strName, const BenchResult& result)
+{
+    printf("%-34s %s  ready %10.3f ms  %7.1f KB/s", strName.c_str(), result.bSuccess ? "ok    " : "FAILED",
+           result.dReadyMs, result.dReadyMs > 0 ? ATH3K_FIRMWARE_SIZE / result.dReadyMs : 0.0);
+    if (result.dCpuMsPerMB > 0) printf("  cpu %7.3f ms/MB", result.dCpuMsPerMB);
+    printf("  writes %4d  allocs %d\n", result.iWrites, result.iAllocations);
+    
+    if (!result.bSuccess) g_bFailed = true;
+    
+    g_mapResults[strName] = result;
+    g_aOrder.push_back(strName);
+}
+
+static void MakeUploadConfig(int iMode, int iChunkSize, int iQueueDepth, uint8_t* pDecoderWindow, Ath3kUploadConfig* pConfig)
+{
+    memset(pConfig, 0, sizeof(*pConfig));
+    pConfig->pImage = g_bytesFirmware;
+    pConfig->iImageSize = ATH3K_FIRMWARE_SIZE;
+    pConfig->iChunkSize = iChunkSize;
+    pConfig->iQueueDepth = iQueueDepth;
+    pConfig->bZeroCopy = (iMode == kBenchZeroCopy) || (iMode == kBenchSingle);
+    pConfig->bSingleTransfer = (iMode == kBenchSingle) || (iMode == kBenchSingleStaged);
+    pConfig->pPlans = g_aFirmwarePlans;
+    pConfig->iPlans = ATH3K_FIRMWARE_PLANS;
+    
+    if (iMode == kBenchCompressed)
+    {
+        pConfig->pImage = NULL;
+        pConfig->pImageCompressed = g_bytesFirmwareCompressed;
+        pConfig->iImageCompressedSize = ATH3K_FIRMWARE_COMPRESSED_SIZE;
+        pConfig->pDecoderWindow = pDecoderWindow;
+    }
+}
+
+//
+// BenchNullTransport
+// completes every step and write as soon as the engine asks for the next event, so all
+// that is left to measure is the engine itself and the copies or decoding it does
+//
+class BenchNullTransport final : public Ath3kTransport
+{
+private:
+    struct Event
+    {
+        int iStep;
+        int iSlot;
+        int iBytes;
+    };
+    
+    Event m_aEvents[ATH3K_QUEUE_DEPTH_MAX + 2];
+    int m_iHead;
+    int m_iCount;
+    std::vector<uint8_t> m_aBuffers[ATH3K_QUEUE_DEPTH_MAX];
+    
+    void Post(int iStep, int iSlot, int iBytes)
+    {
+        Event* pEvent = &m_aEvents[(m_iHead + m_iCount) % (ATH3K_QUEUE_DEPTH_MAX + 2)];
+        pEvent->iStep = iStep;
+        pEvent->iSlot = iSlot;
+        pEvent->iBytes = iBytes;
+        m_iCount++;
+    }
+
+public:
+    bool Run(Ath3kUploadEngine* pEngine, const Ath3kUploadConfig* pConfig, int iEngine)
+    {
+        m_iHead = 0;
+        m_iCount = 0;
+        
+        switch (iEngine)
+        {
+            case kBenchEngineEndpoint:
+                pEngine->StartWith<BenchNullTransport, Ath3kChunkEndpoint>(this, pConfig);
+                break;
+            
+            case kBenchEngineFixed:
+                pEngine->StartWith<BenchNullTransport, Ath3kChunkFixed<BENCH_ENGINE_FIXED_CHUNK> >(this, pConfig);
+                break;
+            
+            case kBenchEngineWhole:
+                pEngine->StartWith<BenchNullTransport, Ath3kChunkWhole>(this, pConfig);
+                break;
+            
+            default:
+                pEngine->Start(this, pConfig);
+                break;
+        }
+        pEngine->Pump();
+        
+        while (!pEngine->IsDone() && (m_iCount > 0))
+        {
+            Event event = m_aEvents[m_iHead];
+            m_iHead = (m_iHead + 1) % (ATH3K_QUEUE_DEPTH_MAX + 2);
+            m_iCount--;
+            
+            if (event.iStep == kAth3kStepBody) pEngine->WriteComplete(event.iSlot, kAth3kSuccess, event.iBytes);
+            else pEngine->StepComplete(event.iStep, kAth3kSuccess);
+            pEngine->Pump();
+        }
+        
+        return(pEngine->IsDone() && (pEngine->GetResult() == kAth3kSuccess));
+    }
+    
+    virtual int StartStep(int iStep) { this->Post(iStep, -1, 0); return(kAth3kSuccess); }
+    virtual int SendControl(const Ath3kControlRequest*, const uint8_t*, uint32_t) { this->Post(kAth3kStepControl, -1, 0); return(kAth3kSuccess); }
+    virtual int GetPacketSize(void) { return(64); }
+    virtual int GetSpeed(void) { return(kAth3kSpeedFull); }
+    
+    virtual uint8_t* GetSlotBuffer(int iSlot, int iCapacity)
+    {
+        if ((int)m_aBuffers[iSlot].size() < iCapacity) m_aBuffers[iSlot].resize(iCapacity);
+        return(&m_aBuffers[iSlot][0]);
+    }
+    
+    virtual int BulkWrite(int iSlot, const uint8_t*, int iLength, bool, uint32_t, uint32_t) { this->Post(kAth3kStepBody, iSlot, iLength); return(kAth3kSuccess); }
+    virtual void AbortBulk(void) { }
+    virtual uint64_t GetTimeNanoseconds(void) { return(0); }
+};
+
+static uint64_t GetCpuNanoseconds(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+    
+    return((uint64_t)time.tv_sec * 1000000000ULL + time.tv_nsec);
+}
+
+//
+// MeasureCpu
+// cpu time of one upload per MB of image, the best of three batches to keep the noise of
+// other processes out
+//
+static double MeasureCpu(int iMode, int iChunkSize, int iQueueDepth, const Ath3kImageDigest* pDigest, int iEngine)
+{
+    static uint8_t s_aDecoderWindow[ATH3K_LZ_WINDOW_SIZE];
+    static Ath3kUploadEngine s_engine;
+    BenchNullTransport transport;
+    
+    Ath3kUploadConfig config;
+    MakeUploadConfig(iMode, iChunkSize, iQueueDepth, s_aDecoderWindow, &config);
+    config.pDigest = pDigest;
+    
+    //warm up, and grow the staging buffers outside of the measurement
+    if (!transport.Run(&s_engine, &config, iEngine)) return(-1);
+    
+    uint64_t uBest = UINT64_MAX;
+    for (int iBatch = 0; iBatch < 3; iBatch++)
+    {
+        uint64_t uStart = GetCpuNanoseconds();
+        for (int iRepeat = 0; iRepeat < g_options.iRepeats; iRepeat++) transport.Run(&s_engine, &config, iEngine);
+        
+        uint64_t uElapsed = GetCpuNanoseconds() - uStart;
+        if (uElapsed < uBest) uBest = uElapsed;
+    }
+    
+    double dMB = (double)ATH3K_FIRMWARE_SIZE * g_options.iRepeats / (1024.0 * 1024.0);
+    return(uBest / BENCH_NS_PER_MS / dMB);
+}
+
+//
+// RunDevices
+// uploads to iDevices dongles, at most iConcurrency at a time, on one shared link or on
+// a link each. the result is the time until the last of them runs its firmware
+//
+static BenchResult RunDevices(int iDevices, bool bSharedLink, int iConcurrency, const Ath3kSimLinkConfig* pLinkConfig,
+                              const Ath3kSimDeviceConfig* pDeviceConfig, int iMode, int iChunkSize, int iQueueDepth)
+{
+    Ath3kSimScheduler scheduler;
+    std::vector<Ath3kSimLink> aLinks(bSharedLink ? 1 : iDevices);
+    std::vector<Ath3kSimDevice> aDevices(iDevices);
+    std::vector<Ath3kUploadEngine> aEngines(iDevices);
+    std::vector<std::vector<uint8_t> > aWindows(iDevices, std::vector<uint8_t>(ATH3K_LZ_WINDOW_SIZE));
+    
+    for (size_t uLink = 0; uLink < aLinks.size(); uLink++) aLinks[uLink].Init(&scheduler, pLinkConfig);
+    
+    for (int iDevice = 0; iDevice < iDevices; iDevice++)
+    {
+        Ath3kSimDeviceConfig config = *pDeviceConfig;
+        config.uSeed = pDeviceConfig->uSeed + iDevice;
+        aDevices[iDevice].Init(&scheduler, &aLinks[bSharedLink ? 0 : iDevice], &config);
+    }
+    
+    //the loader starts the next upload as soon as one of the running ones is done
+    int iStarted = 0;
+    int iDone = 0;
+    std::vector<bool> aFinished(iDevices, false);
+    
+    while (iDone < iDevices)
+    {
+        while ((iStarted < iDevices) && (iStarted - iDone < iConcurrency))
+        {
+            Ath3kUploadConfig config;
+            MakeUploadConfig(iMode, iChunkSize, iQueueDepth, &aWindows[iStarted][0], &config);
+            aDevices[iStarted].StartUpload(&aEngines[iStarted], &config);
+            iStarted++;
+        }
+        
+        if (!scheduler.RunNext()) break;
+        
+        for (int iDevice = 0; iDevice < iStarted; iDevice++)
+        {
+            if (aFinished[iDevice] || !aEngines[iDevice].IsDone()) continue;
+            
+            aFinished[iDevice] = true;
+            iDone++;
+        }
+    }
+    
+    BenchResult result;
+    memset(&result, 0, sizeof(result));
+    result.bSuccess = (iDone == iDevices);
+    
+    for (int iDevice = 0; iDevice < iDevices; iDevice++)
+    {
+        Ath3kSimDevice* pDevice = &aDevices[iDevice];
+        
+        if (!pDevice->IsRunningFirmware() || (aEngines[iDevice].GetResult() != kAth3kSuccess)) result.bSuccess = false;
+        result.iAllocations += pDevice->GetAllocations();
+        result.iWrites += pDevice->GetWrites();
+    }
+    result.dReadyMs = scheduler.GetTime() / BENCH_NS_PER_MS;
+    
+    return(result);
+}
+
+static void GetDefaultConfigs(Ath3kSimLinkConfig* pLinkConfig, Ath3kSimDeviceConfig* pDeviceConfig)
+{
+    Ath3kSimDevice::GetDefaultLinkConfig(pLinkConfig);
+    Ath3kSimDevice::GetDefaultConfig(pDeviceConfig);
+}
+
+//
+// BenchMatrix
+// one dongle, every combination of image handling, chunk size and queue depth
+//
+static void BenchMatrix(void)
+{
+    static const int s_aChunkSizes[] = { 0, 1024, 4096, 16384, 65536 };
+    static const int s_aQueueDepths[] = { 1, 2, 4, 8 };
+    
+    Ath3kSimLinkConfig configLink;
+    Ath3kSimDeviceConfig configDevice;
+    GetDefaultConfigs(&configLink, &configDevice);
+    
+    for (int iMode = kBenchZeroCopy; iMode <= kBenchSingleStaged; iMode++)
+    {
+        bool bSingle = (iMode == kBenchSingle) || (iMode == kBenchSingleStaged);
+        
+        for (size_t uChunk = 0; uChunk < sizeof(s_aChunkSizes) / sizeof(s_aChunkSizes[0]); uChunk++)
+        {
+            for (size_t uDepth = 0; uDepth < sizeof(s_aQueueDepths) / sizeof(s_aQueueDepths[0]); uDepth++)
+            {
+                //one write has nothing to vary
+                if (bSingle && ((uChunk > 0) || (uDepth > 0))) continue;
+                
+                char szName[64];
+                if (bSingle) snprintf(szName, sizeof(szName), "matrix/%s", g_aModeNames[iMode]);
+                else if (s_aChunkSizes[uChunk] == 0) snprintf(szName, sizeof(szName), "matrix/%s/cauto/q%d", g_aModeNames[iMode], s_aQueueDepths[uDepth]);
+                else snprintf(szName, sizeof(szName), "matrix/%s/c%d/q%d", g_aModeNames[iMode], s_aChunkSizes[uChunk], s_aQueueDepths[uDepth]);
+                
+                if (!IsSelected(szName)) continue;
+                
+                BenchResult result = RunDevices(1, true, 1, &configLink, &configDevice, iMode, s_aChunkSizes[uChunk], s_aQueueDepths[uDepth]);
+                result.dCpuMsPerMB = MeasureCpu(iMode, s_aChunkSizes[uChunk], s_aQueueDepths[uDepth], NULL, kBenchEngineGeneric);
+                if (result.dCpuMsPerMB < 0) result.bSuccess = false;
+                
+                Record(szName, result);
+            }
+        }
+    }
+}
+
+//
+// RunRecovery
+// one upload with a STALL or a hung device halfway through (iFault 1 or 2, 0 for none).
+// bRetry leaves the failure to the caller, which uploads again from the start like after
+// a replug, otherwise the engine recovers by itself. *piWasted gets the bytes the device
+// had taken that went again
+//
+static BenchResult RunRecovery(int iMode, int iFault, bool bRetry, int* piWasted, uint64_t* puRecoveryNs)
+{
+    static uint8_t s_aDecoderWindow[ATH3K_LZ_WINDOW_SIZE];
+    
+    Ath3kSimLinkConfig configLink;
+    Ath3kSimDeviceConfig configDevice;
+    GetDefaultConfigs(&configLink, &configDevice);
+    if (iFault == 1) configDevice.iStallAtOffset = BENCH_FAULT_OFFSET;
+    if (iFault == 2) configDevice.iHangAtOffset = BENCH_FAULT_OFFSET;
+    
+    Ath3kSimScheduler scheduler;
+    Ath3kSimLink link;
+    Ath3kSimDevice device;
+    Ath3kUploadEngine engine;
+    Ath3kUploadConfig config;
+    
+    link.Init(&scheduler, &configLink);
+    device.Init(&scheduler, &link, &configDevice);
+    MakeUploadConfig(iMode, 0, 2, s_aDecoderWindow, &config);
+    config.iMaxRecoveries = bRetry ? 0 : 1;
+    
+    BenchResult result;
+    memset(&result, 0, sizeof(result));
+    *piWasted = 0;
+    
+    //with bRetry the first upload is expected to fail, the second one to go through
+    uint64_t uRetry = 0;
+    for (int iAttempt = 0; iAttempt < 2; iAttempt++)
+    {
+        uRetry = scheduler.GetTime();
+        device.StartUpload(&engine, &config);
+        while (!engine.IsDone() && scheduler.RunNext());
+        
+        if (engine.GetResult() == kAth3kSuccess) break;
+        *piWasted = device.GetReceived();
+    }
+    
+    if (!bRetry) *piWasted = engine.GetWastedBytes();
+    *puRecoveryNs = engine.GetTiming()->uRecoveryNanoseconds;
+    
+    result.bSuccess = device.IsRunningFirmware() && ((iFault == 0) || (device.GetStalls() + device.GetTimeouts() > 0));
+    if (!bRetry) result.bSuccess = result.bSuccess && (engine.GetRecoveries() == (iFault != 0 ? 1 : 0));
+    result.dReadyMs = (uRetry + device.GetTimeToReady()) / BENCH_NS_PER_MS;
+    result.iWrites = device.GetWrites();
+    result.iAllocations = device.GetAllocations();
+    
+    return(result);
+}
+
+//
+// BenchRecovery
+// what a STALL or a hung device halfway through costs chunked, compressed and single
+// transfer uploads. "retry" notices the failure and uploads again from the start, the
+// other one is the engine's own recovery: the stall cleared and the body resumed where it
+// stopped, or a reset and the image once more for the device that stopped answering
+//
+static void BenchRecovery(void)
+{
+    static const int s_aModes[] = { kBenchZeroCopy, kBenchCompressed, kBenchSingle };
+    
+    for (size_t uMode = 0; uMode < sizeof(s_aModes) / sizeof(s_aModes[0]); uMode++)
+    {
+        int iWasted = 0;
+        uint64_t uRecoveryNs = 0;
+        double dCleanMs = -1;
+        
+        for (int iFault = 1; iFault <= 2; iFault++)
+        {
+            for (int iRetry = 1; iRetry >= 0; iRetry--)
+            {
+                std::string strName = std::string("recovery/") + (iFault == 1 ? "stall/" : "hang/") +
+                                      g_aModeNames[s_aModes[uMode]] + (iRetry ? "/retry" : (iFault == 1 ? "/resume" : "/restart"));
+                if (!IsSelected(strName)) continue;
+                
+                //what the same upload takes without a fault, for the time lost to it
+                if (dCleanMs < 0) dCleanMs = RunRecovery(s_aModes[uMode], 0, false, &iWasted, &uRecoveryNs).dReadyMs;
+                
+                BenchResult result = RunRecovery(s_aModes[uMode], iFault, iRetry != 0, &iWasted, &uRecoveryNs);
+                Record(strName, result);
+                
+                printf("%-34s         lost  %10.3f ms  recovery %8.3f ms  %d bytes sent again\n", "",
+                       result.dReadyMs - dCleanMs, iRetry ? 0.0 : uRecoveryNs / BENCH_NS_PER_MS, iWasted);
+            }
+        }
+    }
+}
+
+//
+// BenchDecode
+// the LZ decoder has to expand the image faster than the bus takes it, or the compressed
+// build slows the upload down. checked against the matrix results, so it runs after them
+//
+static void BenchDecode(void)
+{
+    if (!IsSelected("decode")) return;
+    
+    std::map<std::string, BenchResult>::const_iterator iterRaw = g_mapResults.find("matrix/zerocopy/cauto/q2");
+    std::map<std::string, BenchResult>::const_iterator iterLz = g_mapResults.find("matrix/lz/cauto/q2");
+    if ((iterRaw == g_mapResults.end()) || (iterLz == g_mapResults.end())) return;
+    
+    //the body of one upload on the bus against decoding it
+    double dBusMsPerMB = iterRaw->second.dReadyMs / ((double)ATH3K_FIRMWARE_SIZE / (1024.0 * 1024.0));
+    double dDecodeMsPerMB = iterLz->second.dCpuMsPerMB;
+    bool bKeepsUp = (dDecodeMsPerMB > 0) && (dDecodeMsPerMB < dBusMsPerMB);
+    
+    printf("%-34s %s  decoder %.3f ms/MB against %.3f ms/MB for the upload, %.1fx ahead\n", "decode", bKeepsUp ? "ok    " : "FAILED",
+           dDecodeMsPerMB, dBusMsPerMB, dDecodeMsPerMB > 0 ? dBusMsPerMB / dDecodeMsPerMB : 0.0);
+    
+    if (!bKeepsUp) g_bFailed = true;
+}
+
+//
+// RunVerify
+// one upload with the image checked against pDigest on its way out. it only goes through
+// if the engine saw every byte and they matched
+//
+static BenchResult RunVerify(int iMode, const Ath3kImageDigest* pDigest)
+{
+    static uint8_t s_aDecoderWindow[ATH3K_LZ_WINDOW_SIZE];
+    
+    Ath3kSimLinkConfig configLink;
+    Ath3kSimDeviceConfig configDevice;
+    GetDefaultConfigs(&configLink, &configDevice);
+    
+    Ath3kSimScheduler scheduler;
+    Ath3kSimLink link;
+    Ath3kSimDevice device;
+    Ath3kUploadEngine engine;
+    Ath3kUploadConfig config;
+    
+    link.Init(&scheduler, &configLink);
+    device.Init(&scheduler, &link, &configDevice);
+    MakeUploadConfig(iMode, 0, 2, s_aDecoderWindow, &config);
+    config.pDigest = pDigest;
+    
+    device.StartUpload(&engine, &config);
+    while (!engine.IsDone() && scheduler.RunNext());
+    
+    BenchResult result;
+    memset(&result, 0, sizeof(result));
+    result.bSuccess = device.IsRunningFirmware() && (engine.GetResult() == kAth3kSuccess) && engine.IsImageVerified();
+    result.dReadyMs = device.GetTimeToReady() / BENCH_NS_PER_MS;
+    result.iWrites = device.GetWrites();
+    result.iAllocations = device.GetAllocations();
+    
+    return(result);
+}
+
+//
+// MeasureChecksum
+// cpu time of pfnChecksum over the image per MB, the best of BENCH_CHECKSUM_BATCHES batches
+//
+static double MeasureChecksum(uint32_t (*pfnChecksum)(void))
+{
+    uint64_t uBest = UINT64_MAX;
+    volatile uint32_t uSink = 0;
+    
+    for (int iBatch = 0; iBatch < BENCH_CHECKSUM_BATCHES; iBatch++)
+    {
+        uint64_t uStart = GetCpuNanoseconds();
+        for (int iRepeat = 0; iRepeat < g_options.iRepeats; iRepeat++) uSink = uSink + pfnChecksum();
+        
+        uint64_t uElapsed = GetCpuNanoseconds() - uStart;
+        if (uElapsed < uBest) uBest = uElapsed;
+    }
+    
+    double dMB = (double)ATH3K_FIRMWARE_SIZE * g_options.iRepeats / (1024.0 * 1024.0);
+    return(uBest / BENCH_NS_PER_MS / dMB);
+}
+
+static uint32_t ChecksumSliceBy8(void) { return(Ath3kCrc32(0, g_bytesFirmware, ATH3K_FIRMWARE_SIZE)); }
+
+static uint32_t ChecksumSha256(void)
+{
+    Ath3kSha256 sha256;
+    uint8_t aDigest[ATH3K_SHA256_SIZE];
+    
+    sha256.Init();
+    sha256.Update(g_bytesFirmware, ATH3K_FIRMWARE_SIZE);
+    sha256.Final(aDigest);
+    
+    return(aDigest[0]);
+}
+
+static const uint8_t g_aFirmwareSha256[ATH3K_SHA256_SIZE] = { ATH3K_FIRMWARE_SHA256_BYTES };
+static const Ath3kImageDigest g_aVerifyDigests[] = { { ATH3K_FIRMWARE_CRC32, NULL }, { ATH3K_FIRMWARE_CRC32, g_aFirmwareSha256 } };
+
+//the image through the verifier in chunks, the way the engine hands it over
+static uint32_t VerifyImage(const Ath3kImageDigest* pDigest)
+{
+    Ath3kImageVerifier verifier;
+    verifier.Init(pDigest, ATH3K_FIRMWARE_SIZE);
+    
+    for (int iPosition = 0; iPosition < ATH3K_FIRMWARE_SIZE; iPosition += BENCH_VERIFY_CHUNK)
+    {
+        int iLength = ATH3K_FIRMWARE_SIZE - iPosition;
+        if (iLength > BENCH_VERIFY_CHUNK) iLength = BENCH_VERIFY_CHUNK;
+        verifier.Update(iPosition, g_bytesFirmware + iPosition, iLength);
+    }
+    
+    return(verifier.IsVerified() ? 1 : 0);
+}
+
+static uint32_t VerifyCrc(void) { return(VerifyImage(&g_aVerifyDigests[0])); }
+static uint32_t VerifySha256(void) { return(VerifyImage(&g_aVerifyDigests[1])); }
+
+//
+// BenchVerify
+// checking the image against the manifest while it goes out must not cost the upload
+// anything worth mentioning: what the verifier costs with the CRC, and the SHA-256 on top of
+// it, against the time the bus takes for the upload. the verifier is timed on its own, the
+// difference of two whole uploads would be mostly noise. the cpu time of the whole upload
+// and the checksums on their own go with it
+//
+static void BenchVerify(void)
+{
+    static const int s_aModes[] = { kBenchZeroCopy, kBenchCompressed };
+    static uint32_t (*s_apfnVerify[])(void) = { VerifyCrc, VerifySha256 };
+    static const char* s_aDigestNames[] = { "crc", "sha256" };
+    
+    for (size_t uMode = 0; uMode < sizeof(s_aModes) / sizeof(s_aModes[0]); uMode++)
+    {
+        for (size_t uDigest = 0; uDigest < sizeof(g_aVerifyDigests) / sizeof(g_aVerifyDigests[0]); uDigest++)
+        {
+            std::string strName = std::string("verify/") + g_aModeNames[s_aModes[uMode]] + "/" + s_aDigestNames[uDigest];
+            if (!IsSelected(strName)) continue;
+            
+            BenchResult result = RunVerify(s_aModes[uMode], &g_aVerifyDigests[uDigest]);
+            result.dCpuMsPerMB = MeasureCpu(s_aModes[uMode], 0, 2, &g_aVerifyDigests[uDigest], kBenchEngineGeneric);
+            
+            double dBusMsPerMB = result.dReadyMs / ((double)ATH3K_FIRMWARE_SIZE / (1024.0 * 1024.0));
+            double dAddedMsPerMB = MeasureChecksum(s_apfnVerify[uDigest]);
+            double dShare = (dBusMsPerMB > 0) ? 100.0 * dAddedMsPerMB / dBusMsPerMB : 100.0;
+            if ((result.dCpuMsPerMB < 0) || (dShare > BENCH_VERIFY_SHARE)) result.bSuccess = false;
+            
+            Record(strName, result);
+            printf("%-34s         added %7.3f ms/MB against %.3f ms/MB for the upload, %.2f%%\n", "", dAddedMsPerMB,
+                   dBusMsPerMB, dShare);
+        }
+    }
+    
+    if (!IsSelected("verify/checksums")) return;
+    
+    printf("%-34s         crc slice-by-8 %.3f ms/MB, sha256 %.3f ms/MB\n", "verify/checksums", MeasureChecksum(ChecksumSliceBy8),
+           MeasureChecksum(ChecksumSha256));
+}
+
+//
+// BenchEngine
+// the cpu the driver spends on an upload with the body loop built for the transport and
+// the chunk policy, against the generic loop on the abstract transport with the same
+// chunks: derived from the endpoint, a fixed size, and the whole body in one write
+//
+static void BenchEngine(void)
+{
+    static const int s_aModes[] = { kBenchZeroCopy, kBenchStaged };
+    static const int s_aEngines[] = { kBenchEngineEndpoint, kBenchEngineFixed, kBenchEngineWhole };
+    static const char* s_aEngineNames[] = { "cauto", "fixed", "whole" };
+    
+    int iRepeats = g_options.iRepeats;
+    g_options.iRepeats *= BENCH_ENGINE_REPEATS;
+    
+    for (size_t uMode = 0; uMode < sizeof(s_aModes) / sizeof(s_aModes[0]); uMode++)
+    {
+        for (size_t uEngine = 0; uEngine < sizeof(s_aEngines) / sizeof(s_aEngines[0]); uEngine++)
+        {
+            std::string strName = std::string("engine/") + g_aModeNames[s_aModes[uMode]] + "/" + s_aEngineNames[uEngine];
+            if (!IsSelected(strName)) continue;
+            
+            //the generic loop gets the same chunks through the config
+            int iMode = s_aModes[uMode];
+            int iChunkSize = 0;
+            if (s_aEngines[uEngine] == kBenchEngineFixed) iChunkSize = BENCH_ENGINE_FIXED_CHUNK;
+            if (s_aEngines[uEngine] == kBenchEngineWhole) iMode = (iMode == kBenchZeroCopy) ? kBenchSingle : kBenchSingleStaged;
+            
+            double dGenericMsPerMB = MeasureCpu(iMode, iChunkSize, 2, NULL, kBenchEngineGeneric);
+            double dSpecializedMsPerMB = MeasureCpu(iMode, iChunkSize, 2, NULL, s_aEngines[uEngine]);
+            bool bRan = (dGenericMsPerMB > 0) && (dSpecializedMsPerMB > 0);
+            
+            //per KB, the engine alone is too quick for ms per MB
+            printf("%-34s %s  generic %7.2f ns/KB, specialized %7.2f ns/KB, %.2fx\n", strName.c_str(),
+                   bRan ? "ok    " : "FAILED", dGenericMsPerMB * 1e6 / 1024, dSpecializedMsPerMB * 1e6 / 1024,
+                   bRan ? dGenericMsPerMB / dSpecializedMsPerMB : 0.0);
+            
+            if (!bRan) g_bFailed = true;
+        }
+    }
+    
+    g_options.iRepeats = iRepeats;
+}
+
+//
+// BenchLoader
+// eight dongles on root ports of their own or behind one hub, loaded by the shared loader
+// with a varying concurrency limit. ready is the time until the last one runs
+//
+static void BenchLoader(void)
+{
+    static const int s_aConcurrency[] = { 1, 2, 4, 8 };
+    
+    Ath3kSimLinkConfig configLink;
+    Ath3kSimDeviceConfig configDevice;
+    GetDefaultConfigs(&configLink, &configDevice);
+    
+    for (int iShared = 0; iShared < 2; iShared++)
+    {
+        for (size_t uLimit = 0; uLimit < sizeof(s_aConcurrency) / sizeof(s_aConcurrency[0]); uLimit++)
+        {
+            char szName[64];
+            snprintf(szName, sizeof(szName), "loader/%s/n8/k%d", iShared ? "hub" : "ports", s_aConcurrency[uLimit]);
+            if (!IsSelected(szName)) continue;
+            
+            Record(szName, RunDevices(8, iShared != 0, s_aConcurrency[uLimit], &configLink, &configDevice, kBenchZeroCopy, 0, 2));
+        }
+    }
+}
+
+//
+// BenchHub
+// four dongles behind one hub with the in flight budget of the hub varied, once with
+// devices that take data as fast as the bus brings it and once with slow ones that NAK
+//
+static void BenchHub(void)
+{
+    static const int s_aBudgets[] = { 0, 8192, 16384, 32768 };
+    
+    for (int iSlow = 0; iSlow < 2; iSlow++)
+    {
+        for (size_t uBudget = 0; uBudget < sizeof(s_aBudgets) / sizeof(s_aBudgets[0]); uBudget++)
+        {
+            char szName[64];
+            snprintf(szName, sizeof(szName), "hub/%s/b%d", iSlow ? "slow" : "fast", s_aBudgets[uBudget]);
+            if (!IsSelected(szName)) continue;
+            
+            Ath3kSimLinkConfig configLink;
+            Ath3kSimDeviceConfig configDevice;
+            GetDefaultConfigs(&configLink, &configDevice);
+            configLink.iInFlightLimit = s_aBudgets[uBudget];
+            if (iSlow)
+            {
+                configDevice.iBufferBytes = 4096;
+                configDevice.uDrainBytesPerSecond = 400000;
+            }
+            
+            Record(szName, RunDevices(4, true, 4, &configLink, &configDevice, kBenchZeroCopy, 0, 4));
+        }
+    }
+}
+
+//
+// the baselines are one line per benchmark: name, ready in ms, cpu ms per MB (0 if not
+// measured) and allocations
+//
+static bool WriteBaselines(const char* pPath)
+{
+    FILE* pFile = fopen(pPath, "w");
+    if (pFile == NULL)
+    {
+        perror(pPath);
+        return(false);
+    }
+    
+    fprintf(pFile, "# name ready_ms cpu_ms_per_mb allocations - written by ath3k-bench -w\n");
+    for (size_t uName = 0; uName < g_aOrder.size(); uName++)
+    {
+        const BenchResult& result = g_mapResults[g_aOrder[uName]];
+        fprintf(pFile, "%s %.3f %.3f %d\n", g_aOrder[uName].c_str(), result.dReadyMs, result.dCpuMsPerMB, result.iAllocations);
+    }
+    
+    fclose(pFile);
+    return(true);
+}
+
+static bool CompareBaselines(const char* pPath)
+{
+    FILE* pFile = fopen(pPath, "r");
+    if (pFile == NULL)
+    {
+        perror(pPath);
+        return(false);
+    }
+    
+    int iRegressions = 0;
+    int iCompared = 0;
+    char szLine[256];
+    
+    while (fgets(szLine, sizeof(szLine), pFile) != NULL)
+    {
+        char szName[128];
+        double dReadyMs;
+        double dCpuMsPerMB;
+        int iAllocations;
+        
+        if ((szLine[0] == '#') || (sscanf(szLine, "%127s %lf %lf %d", szName, &dReadyMs, &dCpuMsPerMB, &iAllocations) != 4)) continue;
+        
+        std::map<std::string, BenchResult>::const_iterator iter = g_mapResults.find(szName);
+        if (iter == g_mapResults.end()) continue;
+        
+        const BenchResult& result = iter->second;
+        iCompared++;
+        
+        if (result.dReadyMs > dReadyMs * (1.0 + g_options.dTolerance / 100.0))
+        {
+            printf("REGRESSION %s: ready %.3f ms, baseline %.3f ms\n", szName, result.dReadyMs, dReadyMs);
+            iRegressions++;
+        }
+        if ((dCpuMsPerMB > 0) && (result.dCpuMsPerMB > dCpuMsPerMB * g_options.dCpuFactor) &&
+            (result.dCpuMsPerMB > dCpuMsPerMB + BENCH_CPU_SLACK_MS))
+        {
+            printf("REGRESSION %s: cpu %.3f ms/MB, baseline %.3f ms/MB\n", szName, result.dCpuMsPerMB, dCpuMsPerMB);
+            iRegressions++;
+        }
+        if (result.iAllocations > iAllocations)
+        {
+            printf("REGRESSION %s: %d allocations, baseline %d\n", szName, result.iAllocations, iAllocations);
+            iRegressions++;
+        }
+    }
+    
+    fclose(pFile);
+    
+    printf("%d benchmarks compared against %s, %d regressions\n", iCompared, pPath, iRegressions);
+    return(iRegressions == 0);
+}
+
+static void Usage(void)
+{
+    fprintf(stderr,
+            "usage: ath3k-bench [options]\n"
+            "  -c file        compare against baselines, fail on a regression\n"
+            "  -w file        write the results as baselines\n"
+            "  -f text        only run benchmarks with text in their name\n"
+            "  -r repeats     uploads per cpu measurement (default 20)\n"
+            "  -t percent     allowed slowdown of the simulated times (default 1)\n"
+            "  -u factor      allowed slowdown of the cpu time (default 3)\n");
+}
+
+int main(int argc, char** argv)
+{
+    const char* pCompare = NULL;
+    const char* pWrite = NULL;
+    
+    g_options.pFilter = NULL;
+    g_options.iRepeats = 20;
+    g_options.dTolerance = 1.0;
+    g_options.dCpuFactor = 3.0;
+    
+    int iOption;
+    while ((iOption = getopt(argc, argv, "c:w:f:r:t:u:h")) != -1)
+    {
+        switch (iOption)
+        {
+            case 'c': pCompare = optarg; break;
+            case 'w': pWrite = optarg; break;
+            case 'f': g_options.pFilter = optarg; break;
+            case 'r': g_options.iRepeats = atoi(optarg); break;
+            case 't': g_options.dTolerance = atof(optarg); break;
+            case 'u': g_options.dCpuFactor = atof(optarg); break;
+            default: Usage(); return(2);
+        }
+    }
+    
+    if (g_options.iRepeats < 1) g_options.iRepeats = 1;
+    
+    BenchMatrix();
+    BenchRecovery();
+    BenchDecode();
+    BenchVerify();
+    BenchEngine();
+    BenchLoader();
+    BenchHub();
+    
+    if ((pWrite != NULL) && !WriteBaselines(pWrite)) return(2);
+    if ((pCompare != NULL) && !CompareBaselines(pCompare)) g_bFailed = true;
+    
+    return(g_bFailed ? 1 : 0);
+}
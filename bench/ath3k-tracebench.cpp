@@ -0,0 +1,175 @@
+/*
+ What one event costs the driver: a record in the trace ring of ath3k-trace.h against the
+ line IOLog used to get for it, formatted and written out synchronously. write() of the line
+ to /dev/null stands in for IOLog, which does at least that much, so the gap shown is the
+ smallest one there is. The deferred side, reading the ring and formatting it, is measured
+ as well, and several threads writing at once check that the reader never sees a torn record.
+ */
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ath3k-trace.h"
+
+#define TRACEBENCH_EVENTS       1000000
+#define TRACEBENCH_LOG_EVENTS   100000
+#define TRACEBENCH_THREADS_MAX  8
+
+static Ath3kTraceRecord g_aRecords[ATH3K_TRACE_RECORDS];
+static Ath3kTraceRing g_ring;
+
+static uint64_t GetMonotonicNanoseconds(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return((uint64_t)time.tv_sec * 1000000000ULL + time.tv_nsec);
+}
+
+static double RunRecords(int iEvents)
+{
+    uint64_t uStart = GetMonotonicNanoseconds();
+    for (int iEvent = 0; iEvent < iEvents; iEvent++)
+    {
+        g_ring.Record(kAth3kTraceDebug, kAth3kTraceWriteComplete, 0x1d110000, iEvent & 3, 0, 4096);
+    }
+    return((double)(GetMonotonicNanoseconds() - uStart) / iEvents);
+}
+
+//the timestamp is most of what a record costs where the clock is slow to read
+static double RunClock(int iEvents)
+{
+    uint64_t uSum = 0;
+    uint64_t uStart = GetMonotonicNanoseconds();
+    for (int iEvent = 0; iEvent < iEvents; iEvent++) uSum += GetMonotonicNanoseconds();
+    double dNanoseconds = (double)(GetMonotonicNanoseconds() - uStart) / iEvents;
+    return((uSum != 0) ? dNanoseconds : 0);
+}
+
+//the way the driver logged a finished bulk write before the ring
+static double RunLogLines(int iEvents, int iFd)
+{
+    char szLine[ATH3K_TRACE_LINE_SIZE];
+    
+    uint64_t uStart = GetMonotonicNanoseconds();
+    for (int iEvent = 0; iEvent < iEvents; iEvent++)
+    {
+        int iLength = snprintf(szLine, sizeof(szLine), "%s::%p::BulkWriteComplete -> bulk write on slot %d done (%d), %d bytes\n",
+                               "local_IOath3kfrmwr", (void*)&g_ring, iEvent & 3, 0, 4096);
+        if (write(iFd, szLine, iLength) != iLength) return(-1);
+    }
+    return((double)(GetMonotonicNanoseconds() - uStart) / iEvents);
+}
+
+static void* WriterThread(void* pParam)
+{
+    int iThread = (int)(intptr_t)pParam;
+    for (int iEvent = 0; iEvent < TRACEBENCH_EVENTS; iEvent++)
+    {
+        //every argument carries the same value so a torn record shows
+        uint64_t uValue = ((uint64_t)iThread << 32) | iEvent;
+        g_ring.Record(kAth3kTraceInfo, kAth3kTraceUploadDone, iThread, uValue, uValue, uValue);
+    }
+    return(NULL);
+}
+
+//returns the ns per event over all writers, and counts what the reader saw meanwhile
+static double RunWriters(int iThreads, int* piReads, int* piTorn)
+{
+    pthread_t aThreads[TRACEBENCH_THREADS_MAX];
+    static Ath3kTraceRecord s_aCopy[ATH3K_TRACE_RECORDS];
+    
+    g_ring.Init(g_aRecords, ATH3K_TRACE_RECORDS, &GetMonotonicNanoseconds);
+    *piReads = *piTorn = 0;
+    
+    uint64_t uStart = GetMonotonicNanoseconds();
+    for (int iThread = 0; iThread < iThreads; iThread++)
+    {
+        pthread_create(&aThreads[iThread], NULL, &WriterThread, (void*)(intptr_t)iThread);
+    }
+    
+    while (g_ring.GetCount() < (uint32_t)iThreads * TRACEBENCH_EVENTS)
+    {
+        uint32_t uRecords = g_ring.Read(s_aCopy, ATH3K_TRACE_RECORDS);
+        for (uint32_t uRecord = 0; uRecord < uRecords; uRecord++)
+        {
+            const Ath3kTraceRecord* pRecord = &s_aCopy[uRecord];
+            if ((pRecord->aArgs[0] != pRecord->aArgs[1]) || (pRecord->aArgs[1] != pRecord->aArgs[2]) ||
+                ((pRecord->aArgs[0] >> 32) != pRecord->uDevice))
+            {
+                (*piTorn)++;
+            }
+        }
+        (*piReads)++;
+    }
+    
+    for (int iThread = 0; iThread < iThreads; iThread++) pthread_join(aThreads[iThread], NULL);
+    return((double)(GetMonotonicNanoseconds() - uStart) / ((double)iThreads * TRACEBENCH_EVENTS));
+}
+
+int main(int argc, char** argv)
+{
+    int iThreads = 4;
+    if (argc > 1) iThreads = atoi(argv[1]);
+    if ((iThreads < 1) || (iThreads > TRACEBENCH_THREADS_MAX))
+    {
+        fprintf(stderr, "usage: ath3k-tracebench [writer threads, 1..%d]\n", TRACEBENCH_THREADS_MAX);
+        return(2);
+    }
+    
+    int iFd = open("/dev/null", O_WRONLY);
+    if (iFd < 0)
+    {
+        perror("/dev/null");
+        return(1);
+    }
+    
+    g_ring.Init(g_aRecords, ATH3K_TRACE_RECORDS, &GetMonotonicNanoseconds);
+    g_ring.SetLevel(kAth3kTraceDebug);
+    
+    //warm up, then the best of a few runs
+    double dRecord = RunRecords(TRACEBENCH_EVENTS);
+    double dLog = RunLogLines(TRACEBENCH_LOG_EVENTS, iFd);
+    for (int iRun = 0; iRun < 3; iRun++)
+    {
+        double dRun = RunRecords(TRACEBENCH_EVENTS);
+        if (dRun < dRecord) dRecord = dRun;
+        dRun = RunLogLines(TRACEBENCH_LOG_EVENTS, iFd);
+        if (dRun < dLog) dLog = dRun;
+    }
+    
+    //debug events with the level at info, as they run in the field
+    g_ring.SetLevel(kAth3kTraceInfo);
+    double dFiltered = RunRecords(TRACEBENCH_EVENTS);
+    g_ring.SetLevel(kAth3kTraceDebug);
+    
+    //what DumpTrace does once an upload is over
+    static Ath3kTraceRecord s_aCopy[ATH3K_TRACE_RECORDS];
+    char szLine[ATH3K_TRACE_LINE_SIZE];
+    uint64_t uStart = GetMonotonicNanoseconds();
+    uint32_t uRecords = g_ring.Read(s_aCopy, ATH3K_TRACE_RECORDS);
+    for (uint32_t uRecord = 0; uRecord < uRecords; uRecord++)
+    {
+        Ath3kTraceRing::Format(&s_aCopy[uRecord], szLine, sizeof(szLine));
+    }
+    double dDump = (double)(GetMonotonicNanoseconds() - uStart) / (uRecords ? uRecords : 1);
+    
+    printf("trace ring record             %8.1f ns/event  (%.1f ns of it reading the clock)\n", dRecord,
+           RunClock(TRACEBENCH_EVENTS));
+    printf("trace ring record, filtered   %8.1f ns/event\n", dFiltered);
+    printf("formatted line + write()      %8.1f ns/event  (%.0fx the ring)\n", dLog, dLog / dRecord);
+    printf("read + format, off the path   %8.1f ns/event  (%u records)\n", dDump, uRecords);
+    printf("  %s\n", szLine);
+    
+    int iReads = 0;
+    int iTorn = 0;
+    double dShared = RunWriters(iThreads, &iReads, &iTorn);
+    printf("%d writers on one ring          %8.1f ns/event  (%d reads meanwhile, %d torn records)\n", iThreads,
+           dShared, iReads, iTorn);
+    
+    close(iFd);
+    return((iTorn == 0) ? 0 : 1);
+}
@@ -0,0 +1,707 @@
+/*
+ Discrete event model of AR3011 dongles for running the upload engine without hardware,
+ see ath3k-sim.h.
+ */
+#include <string.h>
+
+#include <algorithm>
+
+#include "ath3k-sim.h"
+#include "ath3k-1fw-manifest.h"
+
+#define SIM_NANOSECONDS_PER_SECOND  1000000000ULL
+#define SIM_US(X)                   ((uint64_t)(X) * 1000ULL)
+#define SIM_MS(X)                   ((uint64_t)(X) * 1000000ULL)
+
+//the largest image the device takes, more than the AR3011 has RAM for
+#define SIM_BODY_SIZE_MAX           (1 << 20)
+
+//events of the link
+enum
+{
+    kSimLinkPacketDone = 0
+};
+
+//events of a device
+enum
+{
+    kSimDeviceStepDone = 0,
+    kSimDeviceControlDone,
+    kSimDeviceTransferEligible,
+    kSimDeviceTransferTimeout,
+    kSimDeviceTransferNoData,
+    kSimDeviceWriteDone,
+    kSimDeviceLinkAvailable
+};
+
+//a write completion travels as one event argument: slot, result and bytes done
+#define SIM_PACK_WRITE(SLOT,RESULT,BYTES)   (((int64_t)(SLOT) << 40) | ((int64_t)(RESULT) << 32) | (uint32_t)(BYTES))
+#define SIM_WRITE_SLOT(ARG)                 ((int)(((ARG) >> 40) & 0xFF))
+#define SIM_WRITE_RESULT(ARG)               ((int)(((ARG) >> 32) & 0xFF))
+#define SIM_WRITE_BYTES(ARG)                ((int)((ARG) & 0xFFFFFFFF))
+
+Ath3kSimScheduler::Ath3kSimScheduler()
+{
+    m_uNow = 0;
+    m_uSequence = 0;
+    m_uEventsRun = 0;
+}
+
+//ordering of the heap - std::push_heap keeps the largest on top, so later is "less"
+bool Ath3kSimScheduler::IsLater(const Event& eventA, const Event& eventB)
+{
+    if (eventA.uTime != eventB.uTime) return(eventA.uTime > eventB.uTime);
+    return(eventA.uSequence > eventB.uSequence);
+}
+
+void Ath3kSimScheduler::Schedule(uint64_t uDelay, Ath3kSimEventTarget* pTarget, int iKind, int64_t iArg)
+{
+    Event event;
+    event.uTime = m_uNow + uDelay;
+    event.uSequence = m_uSequence++;
+    event.pTarget = pTarget;
+    event.iKind = iKind;
+    event.iArg = iArg;
+    
+    m_aEvents.push_back(event);
+    std::push_heap(m_aEvents.begin(), m_aEvents.end(), IsLater);
+}
+
+bool Ath3kSimScheduler::RunNext(void)
+{
+    if (m_aEvents.empty()) return(false);
+    
+    std::pop_heap(m_aEvents.begin(), m_aEvents.end(), IsLater);
+    Event event = m_aEvents.back();
+    m_aEvents.pop_back();
+    
+    m_uNow = event.uTime;
+    m_uEventsRun++;
+    event.pTarget->SimEvent(event.iKind, event.iArg);
+    
+    return(true);
+}
+
+void Ath3kSimScheduler::Run(uint64_t uUntil)
+{
+    while (!m_aEvents.empty() && (m_aEvents.front().uTime <= uUntil)) this->RunNext();
+}
+
+void Ath3kSimLink::Init(Ath3kSimScheduler* pScheduler, const Ath3kSimLinkConfig* pConfig)
+{
+    m_pScheduler = pScheduler;
+    m_config = *pConfig;
+    m_aDevices.clear();
+    m_iNextDevice = 0;
+    m_bBusy = false;
+    m_iInFlightBytes = 0;
+    m_aWaiting.clear();
+    m_uBusyNanoseconds = 0;
+    m_uWastedNanoseconds = 0;
+}
+
+void Ath3kSimLink::AddDevice(Ath3kSimDevice* pDevice)
+{
+    m_aDevices.push_back(pDevice);
+}
+
+//
+// Kick
+// puts the next packet on the wire, taking the devices in turn starting after the one
+// that sent the last packet
+//
+void Ath3kSimLink::Kick(void)
+{
+    if (m_bBusy) return;
+    
+    int iDevices = (int)m_aDevices.size();
+    for (int iDeviceCounter = 0; iDeviceCounter < iDevices; iDeviceCounter++)
+    {
+        int iDevice = (m_iNextDevice + iDeviceCounter) % iDevices;
+        if (!m_aDevices[iDevice]->HasPacket()) continue;
+        
+        int iBytes = m_aDevices[iDevice]->BeginPacket();
+        uint64_t uDuration = m_config.uPacketOverheadNs + (uint64_t)iBytes * SIM_NANOSECONDS_PER_SECOND / m_config.uBytesPerSecond;
+        
+        m_iNextDevice = (iDevice + 1) % iDevices;
+        m_bBusy = true;
+        m_uBusyNanoseconds += uDuration;
+        m_pScheduler->Schedule(uDuration, this, kSimLinkPacketDone, ((int64_t)iDevice << 32) | (uint32_t)iBytes);
+        return;
+    }
+}
+
+//
+// AcquireBytes
+// books iBytes of the in flight budget for a write of pDevice. a write always fits on an
+// idle link, even a bigger one. pDevice hears from LinkAvailable once there is room again
+//
+bool Ath3kSimLink::AcquireBytes(Ath3kSimDevice* pDevice, int iBytes)
+{
+    if (m_config.iInFlightLimit <= 0) return(true);
+    
+    if ((m_iInFlightBytes > 0) && (m_iInFlightBytes + iBytes > m_config.iInFlightLimit))
+    {
+        if (std::find(m_aWaiting.begin(), m_aWaiting.end(), pDevice) == m_aWaiting.end()) m_aWaiting.push_back(pDevice);
+        return(false);
+    }
+    
+    m_iInFlightBytes += iBytes;
+    return(true);
+}
+
+void Ath3kSimLink::ReleaseBytes(int iBytes)
+{
+    if (m_config.iInFlightLimit <= 0) return;
+    
+    m_iInFlightBytes -= iBytes;
+    
+    //everybody waiting gets another try, in the order they were turned down
+    for (size_t uWaiting = 0; uWaiting < m_aWaiting.size(); uWaiting++)
+    {
+        m_pScheduler->Schedule(0, m_aWaiting[uWaiting], kSimDeviceLinkAvailable, 0);
+    }
+    m_aWaiting.clear();
+}
+
+void Ath3kSimLink::SimEvent(int iKind, int64_t iArg)
+{
+    if (iKind != kSimLinkPacketDone) return;
+    
+    int iDevice = (int)(iArg >> 32);
+    int iBytes = (int)(iArg & 0xFFFFFFFF);
+    
+    m_bBusy = false;
+    if (!m_aDevices[iDevice]->DeliverPacket(iBytes))
+    {
+        m_uWastedNanoseconds += m_config.uPacketOverheadNs + (uint64_t)iBytes * SIM_NANOSECONDS_PER_SECOND / m_config.uBytesPerSecond;
+    }
+    
+    this->Kick();
+}
+
+//
+// GetDefaultConfig
+// an AR3011 in boot mode on a full speed port: 64 byte packets and round figures for the
+// steps - reset and configure take the longest. adjust them to match a measured device
+//
+void Ath3kSimDevice::GetDefaultConfig(Ath3kSimDeviceConfig* pConfig)
+{
+    memset(pConfig, 0, sizeof(*pConfig));
+    
+    pConfig->iPacketSize = 64;
+    pConfig->iSpeed = kAth3kSpeedFull;
+    
+    pConfig->uOpenNs = SIM_US(50);
+    pConfig->uStatusNs = SIM_US(500);
+    pConfig->uResetNs = SIM_MS(20);
+    pConfig->uConfigureNs = SIM_MS(2);
+    pConfig->uFindPipeNs = SIM_MS(1);
+    pConfig->uControlNs = SIM_MS(1);
+    pConfig->uCloseNs = SIM_US(50);
+    
+    pConfig->uSubmitNs = SIM_US(50);
+    pConfig->uCompletionNs = SIM_MS(1);
+    
+    pConfig->iBufferBytes = 0;
+    pConfig->uDrainBytesPerSecond = 0;
+    
+    pConfig->iNakPerMille = 0;
+    pConfig->iStallAtOffset = -1;
+    pConfig->iHangAtOffset = -1;
+    pConfig->uSeed = 1;
+    
+    pConfig->uExpectedCrc32 = ATH3K_FIRMWARE_CRC32;
+}
+
+//a full speed bus: 12 Mbit/s less bit stuffing and the framing of every transaction
+void Ath3kSimDevice::GetDefaultLinkConfig(Ath3kSimLinkConfig* pConfig)
+{
+    pConfig->uBytesPerSecond = 1500000;
+    pConfig->uPacketOverheadNs = SIM_US(10);
+    pConfig->iInFlightLimit = 0;
+}
+
+void Ath3kSimDevice::Init(Ath3kSimScheduler* pScheduler, Ath3kSimLink* pLink, const Ath3kSimDeviceConfig* pConfig)
+{
+    m_pScheduler = pScheduler;
+    m_pLink = pLink;
+    m_config = *pConfig;
+    m_pEngine = NULL;
+    m_pControlData = NULL;
+    
+    m_bOpen = false;
+    m_bConfigured = false;
+    m_bPipeFound = false;
+    m_bHeaderReceived = false;
+    m_bHalted = false;
+    m_bHung = false;
+    m_bStallFired = false;
+    m_bHangFired = false;
+    m_bRunning = false;
+    m_iBodyExpected = 0;
+    m_iReceived = 0;
+    m_uCrc32 = 0;
+    m_iBufferLevel = 0;
+    m_uBufferTime = 0;
+    m_uRandom = (pConfig->uSeed != 0) ? pConfig->uSeed : 1;
+    
+    m_aTransfers.clear();
+    m_uNextTransferId = 1;
+    m_uPacketTransferId = 0;
+    
+    m_uStartTime = 0;
+    m_uReadyTime = 0;
+    m_uNaks = 0;
+    m_uPackets = 0;
+    m_iProtocolErrors = 0;
+    m_iTimeouts = 0;
+    m_iStalls = 0;
+    m_iWrites = 0;
+    m_iAllocations = 0;
+    
+    if (m_pLink != NULL) m_pLink->AddDevice(this);
+}
+
+void Ath3kSimDevice::StartUpload(Ath3kUploadEngine* pEngine, const Ath3kUploadConfig* pConfig)
+{
+    m_pEngine = pEngine;
+    m_uStartTime = m_pScheduler->GetTime();
+    
+    m_pEngine->Start(this, pConfig);
+    m_pEngine->Pump();
+}
+
+int Ath3kSimDevice::ProtocolError(void)
+{
+    m_iProtocolErrors++;
+    return(kAth3kErrorIO);
+}
+
+//
+// ReceiveBytes
+// the image as the device sees it, header first. it boots once the announced length is
+// complete and the checksum matches
+//
+void Ath3kSimDevice::ReceiveBytes(const uint8_t* pData, int iLength)
+{
+    m_uCrc32 = Ath3kCrc32(m_uCrc32, pData, iLength);
+    m_iReceived += iLength;
+    
+    if (m_bHeaderReceived && (m_iReceived == ATH3K_DFU_HEADER_SIZE + m_iBodyExpected))
+    {
+        m_bRunning = (m_uCrc32 == m_config.uExpectedCrc32);
+        m_uReadyTime = m_pScheduler->GetTime();
+    }
+}
+
+//
+// TakePacket
+// room for iBytes in the device buffer, after working off what it could since the last
+// packet. false means the packet gets NAKed
+//
+bool Ath3kSimDevice::TakePacket(int iBytes)
+{
+    if ((m_config.iBufferBytes <= 0) || (m_config.uDrainBytesPerSecond == 0)) return(true);
+    
+    uint64_t uNow = m_pScheduler->GetTime();
+    uint64_t uDrained = (uNow - m_uBufferTime) * m_config.uDrainBytesPerSecond / SIM_NANOSECONDS_PER_SECOND;
+    
+    if (uDrained >= (uint64_t)m_iBufferLevel)
+    {
+        m_iBufferLevel = 0;
+        m_uBufferTime = uNow;
+    }
+    else
+    {
+        //only advance by the time the drained bytes took, so no fraction of a byte is lost
+        m_iBufferLevel -= (int)uDrained;
+        m_uBufferTime += uDrained * SIM_NANOSECONDS_PER_SECOND / m_config.uDrainBytesPerSecond;
+    }
+    
+    if (m_iBufferLevel + iBytes > m_config.iBufferBytes) return(false);
+    
+    m_iBufferLevel += iBytes;
+    return(true);
+}
+
+//
+// FinishTransfer
+// takes a write off the queue and gives its bytes back to the link. the engine hears about
+// it uDelay later
+//
+void Ath3kSimDevice::FinishTransfer(size_t uIndex, int iResult, uint64_t uDelay)
+{
+    Transfer transfer = m_aTransfers[uIndex];
+    m_aTransfers.erase(m_aTransfers.begin() + uIndex);
+    
+    //the write behind it is the one the host controller works on now
+    if ((uIndex == 0) && !m_aTransfers.empty())
+    {
+        m_aTransfers[0].uLastData = std::max(m_pScheduler->GetTime(), m_aTransfers[0].uEligible);
+    }
+    
+    if (m_pLink != NULL) m_pLink->ReleaseBytes(transfer.iLength);
+    
+    m_pScheduler->Schedule(uDelay, this, kSimDeviceWriteDone, SIM_PACK_WRITE(transfer.iSlot, iResult, transfer.iSent));
+}
+
+int Ath3kSimDevice::FindTransfer(uint64_t uId) const
+{
+    for (size_t uTransfer = 0; uTransfer < m_aTransfers.size(); uTransfer++)
+    {
+        if (m_aTransfers[uTransfer].uId == uId) return((int)uTransfer);
+    }
+    
+    return(-1);
+}
+
+bool Ath3kSimDevice::HasPacket(void) const
+{
+    if (m_bHalted || m_aTransfers.empty()) return(false);
+    
+    return(m_aTransfers[0].uEligible <= m_pScheduler->GetTime());
+}
+
+int Ath3kSimDevice::BeginPacket(void)
+{
+    const Transfer* pTransfer = &m_aTransfers[0];
+    
+    m_uPacketTransferId = pTransfer->uId;
+    return(std::min(pTransfer->iLength - pTransfer->iSent, m_config.iPacketSize));
+}
+
+//
+// DeliverPacket
+// the packet the link started with BeginPacket has arrived. true if the device took it,
+// false for a NAK, a STALL, or a write that went away in the meantime
+//
+bool Ath3kSimDevice::DeliverPacket(int iBytes)
+{
+    m_uPackets++;
+    
+    if (m_bHalted || m_aTransfers.empty() || (m_aTransfers[0].uId != m_uPacketTransferId)) return(false);
+    
+    Transfer* pTransfer = &m_aTransfers[0];
+    int iOffset = m_iReceived;
+    
+    //a hung device NAKs forever, the host gives up with the timeout of the write
+    if (!m_bHangFired && (m_config.iHangAtOffset >= 0) && (iOffset + iBytes > m_config.iHangAtOffset))
+    {
+        m_bHangFired = true;
+        m_bHung = true;
+    }
+    if (m_bHung)
+    {
+        m_uNaks++;
+        return(false);
+    }
+    
+    if (!m_bStallFired && (m_config.iStallAtOffset >= 0) && (iOffset + iBytes > m_config.iStallAtOffset))
+    {
+        m_bStallFired = true;
+        m_bHalted = true;
+        m_iStalls++;
+        this->FinishTransfer(0, kAth3kErrorStall, m_config.uCompletionNs);
+        return(false);
+    }
+    
+    //more body than the header announced
+    if (!m_bHeaderReceived || (iOffset + iBytes > ATH3K_DFU_HEADER_SIZE + m_iBodyExpected))
+    {
+        this->ProtocolError();
+        m_bHalted = true;
+        m_iStalls++;
+        this->FinishTransfer(0, kAth3kErrorStall, m_config.uCompletionNs);
+        return(false);
+    }
+    
+    if (m_config.iNakPerMille > 0)
+    {
+        m_uRandom ^= m_uRandom << 13;
+        m_uRandom ^= m_uRandom >> 17;
+        m_uRandom ^= m_uRandom << 5;
+        
+        if ((int)(m_uRandom % 1000) < m_config.iNakPerMille)
+        {
+            m_uNaks++;
+            return(false);
+        }
+    }
+    
+    if (!this->TakePacket(iBytes))
+    {
+        m_uNaks++;
+        return(false);
+    }
+    
+    this->ReceiveBytes(pTransfer->pData + pTransfer->iSent, iBytes);
+    pTransfer->iSent += iBytes;
+    pTransfer->uLastData = m_pScheduler->GetTime();
+    
+    if (pTransfer->iSent == pTransfer->iLength) this->FinishTransfer(0, kAth3kSuccess, m_config.uCompletionNs);
+    
+    return(true);
+}
+
+//
+// RunStep
+// what the device makes of a step once its latency is over
+//
+int Ath3kSimDevice::RunStep(int iStep)
+{
+    switch (iStep)
+    {
+        case kAth3kStepOpen:
+            if (m_bOpen) return(this->ProtocolError());
+            m_bOpen = true;
+            break;
+        
+        case kAth3kStepGetStatus:
+            if (!m_bOpen) return(this->ProtocolError());
+            break;
+        
+        case kAth3kStepReset:
+            if (!m_bOpen) return(this->ProtocolError());
+            
+            //back to a fresh boot loader, whatever came before
+            m_bConfigured = false;
+            m_bPipeFound = false;
+            m_bHeaderReceived = false;
+            m_bHalted = false;
+            m_bHung = false;
+            m_iBodyExpected = 0;
+            m_iReceived = 0;
+            m_uCrc32 = 0;
+            m_iBufferLevel = 0;
+            break;
+        
+        case kAth3kStepConfigure:
+            if (!m_bOpen) return(this->ProtocolError());
+            m_bConfigured = true;
+            break;
+        
+        case kAth3kStepFindPipe:
+            if (!m_bConfigured) return(this->ProtocolError());
+            m_bPipeFound = true;
+            break;
+        
+        case kAth3kStepClearStall:
+            if (!m_bPipeFound) return(this->ProtocolError());
+            
+            //CLEAR_FEATURE(ENDPOINT_HALT) - the bytes taken so far stay, a hung device stays hung
+            m_bHalted = false;
+            break;
+        
+        case kAth3kStepClose:
+            if (!m_bOpen) return(this->ProtocolError());
+            m_bOpen = false;
+            m_bPipeFound = false;
+            break;
+        
+        default:
+            return(this->ProtocolError());
+    }
+    
+    return(kAth3kSuccess);
+}
+
+//
+// ReceiveHeader
+// the DFU header opens the download and announces the length of the body in its third
+// little endian word
+//
+int Ath3kSimDevice::ReceiveHeader(void)
+{
+    const uint8_t* pHeader = m_pControlData;
+    
+    if (!m_bConfigured || m_bHeaderReceived) return(this->ProtocolError());
+    
+    int iBodySize = (int)((uint32_t)pHeader[8] | ((uint32_t)pHeader[9] << 8) | ((uint32_t)pHeader[10] << 16) | ((uint32_t)pHeader[11] << 24));
+    if ((iBodySize <= 0) || (iBodySize > SIM_BODY_SIZE_MAX)) return(this->ProtocolError());
+    
+    m_bHeaderReceived = true;
+    m_iBodyExpected = iBodySize;
+    this->ReceiveBytes(pHeader, ATH3K_DFU_HEADER_SIZE);
+    
+    return(kAth3kSuccess);
+}
+
+int Ath3kSimDevice::StartStep(int iStep)
+{
+    uint64_t uLatency;
+    
+    switch (iStep)
+    {
+        case kAth3kStepOpen:        uLatency = m_config.uOpenNs; break;
+        case kAth3kStepGetStatus:   uLatency = m_config.uStatusNs; break;
+        case kAth3kStepReset:       uLatency = m_config.uResetNs; break;
+        case kAth3kStepConfigure:   uLatency = m_config.uConfigureNs; break;
+        case kAth3kStepFindPipe:    uLatency = m_config.uFindPipeNs; break;
+        case kAth3kStepClearStall:  uLatency = m_config.uControlNs; break;
+        case kAth3kStepClose:       uLatency = m_config.uCloseNs; break;
+        default:                    return(this->ProtocolError());
+    }
+    
+    m_pScheduler->Schedule(uLatency, this, kSimDeviceStepDone, iStep);
+    return(kAth3kSuccess);
+}
+
+int Ath3kSimDevice::SendControl(const Ath3kControlRequest* pRequest, const uint8_t* pData, uint32_t uTimeoutMs)
+{
+    //the control pipe never hangs here
+    (void)uTimeoutMs;
+    
+    if ((pRequest->bmRequestType != ATH3K_DFU_REQUEST_TYPE) || (pRequest->bRequest != ATH3K_DFU_REQUEST_DNLOAD) ||
+        (pRequest->wLength != ATH3K_DFU_HEADER_SIZE) || (pData == NULL))
+    {
+        return(this->ProtocolError());
+    }
+    
+    //the data stays put until the request completes, the device reads it then
+    m_pControlData = pData;
+    m_pScheduler->Schedule(m_config.uControlNs, this, kSimDeviceControlDone, 0);
+    return(kAth3kSuccess);
+}
+
+int Ath3kSimDevice::GetPacketSize(void)
+{
+    return(m_config.iPacketSize);
+}
+
+int Ath3kSimDevice::GetSpeed(void)
+{
+    return(m_config.iSpeed);
+}
+
+uint8_t* Ath3kSimDevice::GetSlotBuffer(int iSlot, int iCapacity)
+{
+    if ((iSlot < 0) || (iSlot >= ATH3K_QUEUE_DEPTH_MAX)) return(NULL);
+    
+    std::vector<uint8_t>& aBuffer = m_aSlotBuffers[iSlot];
+    if ((int)aBuffer.size() < iCapacity)
+    {
+        //a real transport allocates a new buffer here, the sim just counts it
+        aBuffer.resize(iCapacity);
+        m_iAllocations++;
+    }
+    
+    return(&aBuffer[0]);
+}
+
+//
+// BulkWrite
+// queues a write behind the ones already on the pipe. the host controller starts on it
+// uSubmitNs later. it times out when the device took nothing of it for uNoDataMs while it
+// was the head of the queue, or uCompletionMs after it was queued
+//
+int Ath3kSimDevice::BulkWrite(int iSlot, const uint8_t* pData, int iLength, bool bInPlace, uint32_t uNoDataMs,
+                              uint32_t uCompletionMs)
+{
+    (void)bInPlace;
+    
+    if (!m_bOpen || !m_bPipeFound || (iLength <= 0)) return(this->ProtocolError());
+    if (m_bHalted) return(kAth3kErrorStall);
+    
+    if ((m_pLink != NULL) && !m_pLink->AcquireBytes(this, iLength)) return(kAth3kBusy);
+    
+    Transfer transfer;
+    transfer.uId = m_uNextTransferId++;
+    transfer.iSlot = iSlot;
+    transfer.pData = pData;
+    transfer.iLength = iLength;
+    transfer.iSent = 0;
+    transfer.uEligible = m_pScheduler->GetTime() + m_config.uSubmitNs;
+    transfer.uNoDataNs = SIM_MS(uNoDataMs);
+    transfer.uLastData = transfer.uEligible;
+    m_aTransfers.push_back(transfer);
+    m_iWrites++;
+    
+    m_pScheduler->Schedule(m_config.uSubmitNs, this, kSimDeviceTransferEligible, (int64_t)transfer.uId);
+    m_pScheduler->Schedule(m_config.uSubmitNs + transfer.uNoDataNs, this, kSimDeviceTransferNoData, (int64_t)transfer.uId);
+    m_pScheduler->Schedule(SIM_MS(uCompletionMs), this, kSimDeviceTransferTimeout, (int64_t)transfer.uId);
+    
+    return(kAth3kSuccess);
+}
+
+//everything still on the pipe completes as aborted, the halt stays until a reset or a clear
+void Ath3kSimDevice::AbortBulk(void)
+{
+    while (!m_aTransfers.empty())
+    {
+        this->FinishTransfer(m_aTransfers.size() - 1, kAth3kErrorAborted, m_config.uCompletionNs);
+    }
+}
+
+uint64_t Ath3kSimDevice::GetTimeNanoseconds(void)
+{
+    return(m_pScheduler->GetTime());
+}
+
+void Ath3kSimDevice::SimEvent(int iKind, int64_t iArg)
+{
+    switch (iKind)
+    {
+        case kSimDeviceStepDone:
+        {
+            int iResult = this->RunStep((int)iArg);
+            
+            m_pEngine->StepComplete((int)iArg, iResult);
+            m_pEngine->Pump();
+            break;
+        }
+        
+        case kSimDeviceControlDone:
+        {
+            int iResult = this->ReceiveHeader();
+            
+            m_pEngine->StepComplete(kAth3kStepControl, iResult);
+            m_pEngine->Pump();
+            break;
+        }
+        
+        case kSimDeviceTransferEligible:
+            if (m_pLink != NULL) m_pLink->Kick();
+            break;
+        
+        case kSimDeviceTransferTimeout:
+        {
+            int iTransfer = this->FindTransfer((uint64_t)iArg);
+            if (iTransfer < 0) break;
+            
+            m_iTimeouts++;
+            this->FinishTransfer(iTransfer, kAth3kErrorTimeout, 0);
+            break;
+        }
+        
+        case kSimDeviceTransferNoData:
+        {
+            int iTransfer = this->FindTransfer((uint64_t)iArg);
+            if (iTransfer < 0) break;
+            
+            //the writes behind the head are not on the bus yet, their clock does not run
+            Transfer* pTransfer = &m_aTransfers[iTransfer];
+            uint64_t uNow = m_pScheduler->GetTime();
+            uint64_t uLastData = (iTransfer == 0) ? pTransfer->uLastData : uNow;
+            
+            if (uNow < uLastData + pTransfer->uNoDataNs)
+            {
+                m_pScheduler->Schedule(uLastData + pTransfer->uNoDataNs - uNow, this, kSimDeviceTransferNoData, iArg);
+                break;
+            }
+            
+            m_iTimeouts++;
+            this->FinishTransfer(iTransfer, kAth3kErrorTimeout, 0);
+            break;
+        }
+        
+        case kSimDeviceWriteDone:
+            m_pEngine->WriteComplete(SIM_WRITE_SLOT(iArg), SIM_WRITE_RESULT(iArg), SIM_WRITE_BYTES(iArg));
+            m_pEngine->Pump();
+            break;
+        
+        case kSimDeviceLinkAvailable:
+            m_pEngine->Pump();
+            break;
+    }
+}
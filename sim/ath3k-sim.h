@@ -0,0 +1,261 @@
+/* Ath3kSimScheduler, Ath3kSimLink and Ath3kSimDevice classes */
+#ifndef __ATH3K_SIM__
+#define __ATH3K_SIM__
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "ath3k-engine.h"
+
+//
+// a discrete event model of AR3011 dongles on a USB bus, for running the upload engine on a
+// host without hardware. everything runs on a virtual clock, so a run takes as long as the
+// model needs to compute and gives the same numbers every time for the same seed
+//
+
+class Ath3kSimEventTarget
+{
+public:
+    virtual void SimEvent(int iKind, int64_t iArg) = 0;
+};
+
+//the virtual clock and the events waiting on it, earliest first and in order of scheduling
+//for events at the same time
+class Ath3kSimScheduler
+{
+private:
+    struct Event
+    {
+        uint64_t uTime;
+        uint64_t uSequence;
+        Ath3kSimEventTarget* pTarget;
+        int iKind;
+        int64_t iArg;
+    };
+    
+    std::vector<Event> m_aEvents;
+    uint64_t m_uNow;
+    uint64_t m_uSequence;
+    uint64_t m_uEventsRun;
+    
+    static bool IsLater(const Event& eventA, const Event& eventB);
+
+public:
+    Ath3kSimScheduler();
+    
+    uint64_t GetTime(void) const { return(m_uNow); }
+    uint64_t GetEventsRun(void) const { return(m_uEventsRun); }
+    
+    void Schedule(uint64_t uDelay, Ath3kSimEventTarget* pTarget, int iKind, int64_t iArg);
+    
+    //runs the next event, false if there is none
+    bool RunNext(void);
+    
+    //runs events until there are none left or the clock would pass uUntil
+    void Run(uint64_t uUntil = UINT64_MAX);
+};
+
+class Ath3kSimDevice;
+
+//
+// the bus segment a group of devices shares, e.g. the upstream port of a hub. the host
+// controller serves the bulk endpoints with pending data round robin, one packet at a time.
+// every packet costs the link its bytes at uBytesPerSecond plus uPacketOverheadNs, also the
+// ones the device NAKs - a full speed OUT transaction carries its data before the handshake
+//
+struct Ath3kSimLinkConfig
+{
+    uint64_t uBytesPerSecond;
+    uint64_t uPacketOverheadNs;
+    
+    //bulk bytes the devices on the link may have queued together, 0 for no limit. writes
+    //over it are turned down with kAth3kBusy and tried again on LinkAvailable. only an
+    //experiment: the kext has no such budget, in the hub benchmarks none beats no limit
+    int iInFlightLimit;
+};
+
+class Ath3kSimLink : public Ath3kSimEventTarget
+{
+private:
+    Ath3kSimScheduler* m_pScheduler;
+    Ath3kSimLinkConfig m_config;
+    std::vector<Ath3kSimDevice*> m_aDevices;
+    int m_iNextDevice;
+    bool m_bBusy;
+    
+    int m_iInFlightBytes;
+    std::vector<Ath3kSimDevice*> m_aWaiting;
+    
+    uint64_t m_uBusyNanoseconds;
+    uint64_t m_uWastedNanoseconds;
+
+public:
+    void Init(Ath3kSimScheduler* pScheduler, const Ath3kSimLinkConfig* pConfig);
+    void AddDevice(Ath3kSimDevice* pDevice);
+    
+    //starts the next packet if the link is idle
+    void Kick(void);
+    
+    bool AcquireBytes(Ath3kSimDevice* pDevice, int iBytes);
+    void ReleaseBytes(int iBytes);
+    
+    uint64_t GetBusyNanoseconds(void) const { return(m_uBusyNanoseconds); }
+    uint64_t GetWastedNanoseconds(void) const { return(m_uWastedNanoseconds); }
+    
+    virtual void SimEvent(int iKind, int64_t iArg);
+};
+
+//
+// timing and faults of one device. the latencies are those of the whole round trip the
+// engine sees, host controller and completion delivery included
+//
+struct Ath3kSimDeviceConfig
+{
+    int iPacketSize;
+    int iSpeed;
+    
+    uint64_t uOpenNs;
+    uint64_t uStatusNs;
+    uint64_t uResetNs;
+    uint64_t uConfigureNs;
+    uint64_t uFindPipeNs;
+    uint64_t uControlNs;
+    uint64_t uCloseNs;
+    
+    //until a queued bulk write is picked up by the host controller, and from its last
+    //packet until the completion reaches the engine
+    uint64_t uSubmitNs;
+    uint64_t uCompletionNs;
+    
+    //the device buffers iBufferBytes and works them off at uDrainBytesPerSecond, packets
+    //that do not fit are NAKed. 0 for either means the device is never the bottleneck
+    int iBufferBytes;
+    uint64_t uDrainBytesPerSecond;
+    
+    //faults: NAKs out of the blue, a STALL once the stream reaches an offset, and a device
+    //that stops taking data at an offset, so the writes time out. -1 turns them off
+    int iNakPerMille;
+    int iStallAtOffset;
+    int iHangAtOffset;
+    uint32_t uSeed;
+    
+    //what the device checks the received image against
+    uint32_t uExpectedCrc32;
+};
+
+//
+// one dongle in boot mode together with the host side of its pipes - the transport the
+// engine talks to. it accepts the DFU header through the vendor control request, then the
+// number of body bytes the header announces through the bulk pipe, and runs the firmware
+// once all of it arrived with the expected checksum. steps out of order count as protocol
+// errors and fail
+//
+class Ath3kSimDevice : public Ath3kTransport, public Ath3kSimEventTarget
+{
+private:
+    struct Transfer
+    {
+        uint64_t uId;
+        int iSlot;
+        const uint8_t* pData;
+        int iLength;
+        int iSent;
+        uint64_t uEligible;
+        uint64_t uNoDataNs;
+        uint64_t uLastData;         //when it last moved data, or became the head of the queue
+    };
+    
+    Ath3kSimScheduler* m_pScheduler;
+    Ath3kSimLink* m_pLink;
+    Ath3kSimDeviceConfig m_config;
+    Ath3kUploadEngine* m_pEngine;
+    const uint8_t* m_pControlData;
+    
+    //device state
+    bool m_bOpen;
+    bool m_bConfigured;
+    bool m_bPipeFound;
+    bool m_bHeaderReceived;
+    bool m_bHalted;
+    bool m_bHung;
+    bool m_bStallFired;
+    bool m_bHangFired;
+    bool m_bRunning;
+    int m_iBodyExpected;
+    int m_iReceived;
+    uint32_t m_uCrc32;
+    int m_iBufferLevel;
+    uint64_t m_uBufferTime;
+    uint32_t m_uRandom;
+    
+    //host side
+    std::vector<Transfer> m_aTransfers;
+    uint64_t m_uNextTransferId;
+    uint64_t m_uPacketTransferId;
+    std::vector<uint8_t> m_aSlotBuffers[ATH3K_QUEUE_DEPTH_MAX];
+    
+    //statistics
+    uint64_t m_uStartTime;
+    uint64_t m_uReadyTime;
+    uint64_t m_uNaks;
+    uint64_t m_uPackets;
+    int m_iProtocolErrors;
+    int m_iTimeouts;
+    int m_iStalls;
+    int m_iWrites;
+    int m_iAllocations;
+    
+    void ReceiveBytes(const uint8_t* pData, int iLength);
+    bool TakePacket(int iBytes);
+    void FinishTransfer(size_t uIndex, int iResult, uint64_t uDelay);
+    int FindTransfer(uint64_t uId) const;
+    int ProtocolError(void);
+    int RunStep(int iStep);
+    int ReceiveHeader(void);
+
+public:
+    void Init(Ath3kSimScheduler* pScheduler, Ath3kSimLink* pLink, const Ath3kSimDeviceConfig* pConfig);
+    
+    //starts pEngine with pConfig against this device, now
+    void StartUpload(Ath3kUploadEngine* pEngine, const Ath3kUploadConfig* pConfig);
+    
+    //what the link needs to schedule packets: whether there is one to send, its size, and
+    //whether the device took it when it arrived
+    bool HasPacket(void) const;
+    int BeginPacket(void);
+    bool DeliverPacket(int iBytes);
+    
+    bool IsRunningFirmware(void) const { return(m_bRunning); }
+    uint64_t GetTimeToReady(void) const { return(m_bRunning ? m_uReadyTime - m_uStartTime : 0); }
+    int GetReceived(void) const { return(m_iReceived); }
+    uint32_t GetCrc32(void) const { return(m_uCrc32); }
+    uint64_t GetNaks(void) const { return(m_uNaks); }
+    uint64_t GetPackets(void) const { return(m_uPackets); }
+    int GetProtocolErrors(void) const { return(m_iProtocolErrors); }
+    int GetTimeouts(void) const { return(m_iTimeouts); }
+    int GetStalls(void) const { return(m_iStalls); }
+    
+    //bulk writes the engine queued, and how often a staging buffer had to grow for them
+    int GetWrites(void) const { return(m_iWrites); }
+    int GetAllocations(void) const { return(m_iAllocations); }
+    
+    static void GetDefaultConfig(Ath3kSimDeviceConfig* pConfig);
+    static void GetDefaultLinkConfig(Ath3kSimLinkConfig* pConfig);
+    
+    //Ath3kTransport
+    virtual int StartStep(int iStep);
+    virtual int SendControl(const Ath3kControlRequest* pRequest, const uint8_t* pData, uint32_t uTimeoutMs);
+    virtual int GetPacketSize(void);
+    virtual int GetSpeed(void);
+    virtual uint8_t* GetSlotBuffer(int iSlot, int iCapacity);
+    virtual int BulkWrite(int iSlot, const uint8_t* pData, int iLength, bool bInPlace, uint32_t uNoDataMs,
+                          uint32_t uCompletionMs);
+    virtual void AbortBulk(void);
+    virtual uint64_t GetTimeNanoseconds(void);
+    
+    //Ath3kSimEventTarget
+    virtual void SimEvent(int iKind, int64_t iArg);
+};
+
+#endif //__ATH3K_SIM__
@@ -0,0 +1,262 @@
+/*
+ Runs the upload engine against simulated dongles sharing one link and prints what each
+ of them saw. ath3k-simrun -h lists the knobs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ath3k-sim.h"
+#include "ath3k-timeline.h"
+#include "ath3k-1fw-plan.h"
+
+#define SIMRUN_DEVICES_MAX  16
+
+extern "C"
+{
+    extern const unsigned char g_bytesFirmware[];              /* ATH3K_FIRMWARE_SIZE */
+    extern const unsigned char g_bytesFirmwareCompressed[];    /* ATH3K_FIRMWARE_COMPRESSED_SIZE */
+}
+
+static const char* g_aResultNames[] =
+{
+    "success", "busy", "io", "no device", "no memory", "stall", "timeout", "underrun", "aborted", "corrupt"
+};
+
+static const char* g_aStepNames[] =
+{
+    "open", "status", "reset", "configure", "find pipe", "control", "body", "close", "clear stall", "done"
+};
+
+static void Usage(void)
+{
+    fprintf(stderr,
+            "usage: ath3k-simrun [options]\n"
+            "  -n devices     dongles on the link (1..%d, default 1)\n"
+            "  -m mode        zerocopy, staged, lz or single (default zerocopy)\n"
+            "  -c bytes       chunk size, 0 derives it from the endpoint (default 0)\n"
+            "  -q depth       bulk writes in flight (default 2)\n"
+            "  -a             auto-tune the chunk size\n"
+            "  -b bytes       in flight budget of the link, 0 for none (default 0)\n"
+            "  -k permille    random NAKs\n"
+            "  -s offset      STALL once the stream reaches offset\n"
+            "  -t offset      stop taking data at offset, the writes time out\n"
+            "  -R count       failed writes to recover from, 0 fails on the first (default 2)\n"
+            "  -B bytes       device buffer, with -D\n"
+            "  -D bytes/s     rate the device works its buffer off\n"
+            "  -r seed        seed of the random NAKs\n"
+            "  -v digest      check the image against the manifest: none, crc or sha256 (default crc)\n"
+            "  -x offset      flip a bit of the image at offset, the check has to catch it (not with lz)\n"
+            "  -j file        write the sessions as Chrome trace events (JSON)\n",
+            SIMRUN_DEVICES_MAX);
+}
+
+int main(int argc, char** argv)
+{
+    int iDevices = 1;
+    const char* pMode = "zerocopy";
+    int iChunkSize = 0;
+    int iQueueDepth = 2;
+    bool bAutoTune = false;
+    int iMaxRecoveries = 2;
+    const char* pTimelinePath = NULL;
+    const char* pDigest = "crc";
+    int iCorruptAt = -1;
+    
+    Ath3kSimLinkConfig configLink;
+    Ath3kSimDevice::GetDefaultLinkConfig(&configLink);
+    
+    Ath3kSimDeviceConfig configDevice;
+    Ath3kSimDevice::GetDefaultConfig(&configDevice);
+    
+    int iOption;
+    while ((iOption = getopt(argc, argv, "n:m:c:q:ab:k:s:t:R:B:D:r:j:v:x:h")) != -1)
+    {
+        switch (iOption)
+        {
+            case 'n': iDevices = atoi(optarg); break;
+            case 'm': pMode = optarg; break;
+            case 'c': iChunkSize = atoi(optarg); break;
+            case 'q': iQueueDepth = atoi(optarg); break;
+            case 'a': bAutoTune = true; break;
+            case 'b': configLink.iInFlightLimit = atoi(optarg); break;
+            case 'k': configDevice.iNakPerMille = atoi(optarg); break;
+            case 's': configDevice.iStallAtOffset = atoi(optarg); break;
+            case 't': configDevice.iHangAtOffset = atoi(optarg); break;
+            case 'R': iMaxRecoveries = atoi(optarg); break;
+            case 'B': configDevice.iBufferBytes = atoi(optarg); break;
+            case 'D': configDevice.uDrainBytesPerSecond = strtoull(optarg, NULL, 0); break;
+            case 'r': configDevice.uSeed = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'j': pTimelinePath = optarg; break;
+            case 'v': pDigest = optarg; break;
+            case 'x': iCorruptAt = atoi(optarg); break;
+            default: Usage(); return(2);
+        }
+    }
+    
+    if ((iDevices < 1) || (iDevices > SIMRUN_DEVICES_MAX) || (iCorruptAt >= ATH3K_FIRMWARE_SIZE) ||
+        ((iCorruptAt >= 0) && (strcmp(pMode, "lz") == 0)))
+    {
+        Usage();
+        return(2);
+    }
+    
+    Ath3kUploadConfig configUpload;
+    memset(&configUpload, 0, sizeof(configUpload));
+    configUpload.pImage = g_bytesFirmware;
+    configUpload.iImageSize = ATH3K_FIRMWARE_SIZE;
+    configUpload.iChunkSize = iChunkSize;
+    configUpload.iQueueDepth = iQueueDepth;
+    configUpload.bAutoTune = bAutoTune;
+    configUpload.iMaxRecoveries = iMaxRecoveries;
+    configUpload.pPlans = g_aFirmwarePlans;
+    configUpload.iPlans = ATH3K_FIRMWARE_PLANS;
+    
+    if (strcmp(pMode, "zerocopy") == 0) configUpload.bZeroCopy = true;
+    else if (strcmp(pMode, "single") == 0) configUpload.bZeroCopy = configUpload.bSingleTransfer = true;
+    else if (strcmp(pMode, "lz") != 0 && strcmp(pMode, "staged") != 0)
+    {
+        Usage();
+        return(2);
+    }
+    
+    static const uint8_t s_aSha256[ATH3K_SHA256_SIZE] = { ATH3K_FIRMWARE_SHA256_BYTES };
+    static const Ath3kImageDigest s_digestCrc32 = { ATH3K_FIRMWARE_CRC32, NULL };
+    static const Ath3kImageDigest s_digestSha256 = { ATH3K_FIRMWARE_CRC32, s_aSha256 };
+    
+    if (strcmp(pDigest, "crc") == 0) configUpload.pDigest = &s_digestCrc32;
+    else if (strcmp(pDigest, "sha256") == 0) configUpload.pDigest = &s_digestSha256;
+    else if (strcmp(pDigest, "none") != 0)
+    {
+        Usage();
+        return(2);
+    }
+    
+    //a copy of the image with one bit off, as a bad flash or a bad build would leave it
+    static uint8_t s_aImageCorrupt[ATH3K_FIRMWARE_SIZE];
+    if (iCorruptAt >= 0)
+    {
+        memcpy(s_aImageCorrupt, g_bytesFirmware, ATH3K_FIRMWARE_SIZE);
+        s_aImageCorrupt[iCorruptAt] ^= 0x01;
+        configUpload.pImage = s_aImageCorrupt;
+    }
+    
+    static uint8_t s_aDecoderWindows[SIMRUN_DEVICES_MAX][ATH3K_LZ_WINDOW_SIZE];
+    
+    Ath3kSimScheduler scheduler;
+    Ath3kSimLink link;
+    link.Init(&scheduler, &configLink);
+    
+    static Ath3kSimDevice s_aDevices[SIMRUN_DEVICES_MAX];
+    static Ath3kUploadEngine s_aEngines[SIMRUN_DEVICES_MAX];
+    static Ath3kTimeline s_timeline;
+    
+    for (int iDevice = 0; iDevice < iDevices; iDevice++)
+    {
+        Ath3kSimDeviceConfig config = configDevice;
+        config.uSeed = configDevice.uSeed + iDevice;
+        s_aDevices[iDevice].Init(&scheduler, &link, &config);
+        
+        Ath3kUploadConfig configEngine = configUpload;
+        if (strcmp(pMode, "lz") == 0)
+        {
+            configEngine.pImage = NULL;
+            configEngine.pImageCompressed = g_bytesFirmwareCompressed;
+            configEngine.iImageCompressedSize = ATH3K_FIRMWARE_COMPRESSED_SIZE;
+            configEngine.pDecoderWindow = s_aDecoderWindows[iDevice];
+        }
+        if (pTimelinePath != NULL)
+        {
+            char szName[ATH3K_TIMELINE_NAME_SIZE];
+            snprintf(szName, sizeof(szName), "device %d", iDevice);
+            configEngine.pObserver = s_timeline.AddSession(szName);
+        }
+        s_aDevices[iDevice].StartUpload(&s_aEngines[iDevice], &configEngine);
+    }
+    
+    //stop with the last upload rather than the last timeout still pending
+    for (int iDevice = 0; iDevice < iDevices; iDevice++)
+    {
+        while (!s_aEngines[iDevice].IsDone() && scheduler.RunNext());
+    }
+    
+    int iFailed = 0;
+    for (int iDevice = 0; iDevice < iDevices; iDevice++)
+    {
+        Ath3kSimDevice* pDevice = &s_aDevices[iDevice];
+        Ath3kUploadEngine* pEngine = &s_aEngines[iDevice];
+        bool bFailed = !pDevice->IsRunningFirmware() || (pEngine->GetResult() != kAth3kSuccess);
+        
+        printf("device %d: %s", iDevice, bFailed ? "FAILED" : "running");
+        if (pEngine->GetResult() != kAth3kSuccess)
+        {
+            printf(" (%s in %s)", g_aResultNames[pEngine->GetResult()], g_aStepNames[pEngine->GetFailedStep()]);
+        }
+        printf(", ready after %.3f ms, %d bytes received, crc32 %08x, chunk %d x %d, %llu packets, %llu naks, %d stalls, %d timeouts, %d protocol errors\n",
+               pDevice->GetTimeToReady() / 1e6, pDevice->GetReceived(), pDevice->GetCrc32(),
+               pEngine->GetChunkSize(), pEngine->GetQueueDepth(),
+               (unsigned long long)pDevice->GetPackets(), (unsigned long long)pDevice->GetNaks(),
+               pDevice->GetStalls(), pDevice->GetTimeouts(), pDevice->GetProtocolErrors());
+        
+        //where the time went, as the driver publishes it in UploadTiming
+        const Ath3kUploadTiming* pTiming = pEngine->GetTiming();
+        printf("  steps:");
+        for (int iStep = 0; iStep < kAth3kStepDone; iStep++)
+        {
+            printf(" %s %.3f ms%s", g_aStepNames[iStep], pTiming->aStepNanoseconds[iStep] / 1e6,
+                   (iStep < kAth3kStepDone - 1) ? "," : "\n");
+        }
+        printf("  chunks: %u, latency min %.1f us, mean %.1f us, max %.1f us, histogram",
+               (unsigned int)pTiming->uChunks, pTiming->uChunkMinNanoseconds / 1e3,
+               pTiming->uChunks ? pTiming->uChunkSumNanoseconds / 1e3 / pTiming->uChunks : 0.0,
+               pTiming->uChunkMaxNanoseconds / 1e3);
+        for (int iBucket = 0; iBucket < ATH3K_LATENCY_BUCKETS; iBucket++)
+        {
+            if (pTiming->aChunkLatency[iBucket] == 0) continue;
+            printf(" <%dus:%u", ATH3K_LATENCY_BUCKET_US << iBucket, (unsigned int)pTiming->aChunkLatency[iBucket]);
+        }
+        printf("\n");
+        printf("  timeouts: completion up to %u ms, no data %u..%u ms, histogram",
+               (unsigned int)pTiming->uCompletionTimeoutMaxMs, (unsigned int)pTiming->uNoDataTimeoutMinMs,
+               (unsigned int)pTiming->uNoDataTimeoutMaxMs);
+        for (int iBucket = 0; iBucket < ATH3K_LATENCY_BUCKETS; iBucket++)
+        {
+            if (pTiming->aNoDataTimeout[iBucket] == 0) continue;
+            printf(" <%dus:%u", ATH3K_LATENCY_BUCKET_US << iBucket, (unsigned int)pTiming->aNoDataTimeout[iBucket]);
+        }
+        printf("\n");
+        if (configUpload.pDigest != NULL)
+        {
+            printf("  image: %s against the manifest %s\n", pEngine->IsImageVerified() ? "verified" : "NOT verified",
+                   (configUpload.pDigest->pSha256 != NULL) ? "crc32 and sha256" : "crc32");
+        }
+        if (pEngine->GetRecoveries() > 0)
+        {
+            printf("  recovered from %d failed writes in %.3f ms, %d bytes sent again\n", pEngine->GetRecoveries(),
+                   pTiming->uRecoveryNanoseconds / 1e6, pEngine->GetWastedBytes());
+        }
+        
+        if (bFailed) iFailed++;
+    }
+    
+    printf("link: %.3f ms until the last upload finished, %.1f%% busy, %.1f%% of it wasted, %llu events\n",
+           scheduler.GetTime() / 1e6,
+           scheduler.GetTime() ? 100.0 * link.GetBusyNanoseconds() / scheduler.GetTime() : 0.0,
+           link.GetBusyNanoseconds() ? 100.0 * link.GetWastedNanoseconds() / link.GetBusyNanoseconds() : 0.0,
+           (unsigned long long)scheduler.GetEventsRun());
+    
+    if (pTimelinePath != NULL)
+    {
+        FILE* pFile = fopen(pTimelinePath, "w");
+        bool bWritten = (pFile != NULL) && s_timeline.Write(pFile);
+        if ((pFile == NULL) || (fclose(pFile) != 0) || !bWritten)
+        {
+            perror(pTimelinePath);
+            return(1);
+        }
+        printf("timeline: %d events in %s\n", s_timeline.GetEventCount(), pTimelinePath);
+    }
+    
+    return((iFailed == 0) ? 0 : 1);
+}
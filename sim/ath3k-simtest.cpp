@@ -0,0 +1,107 @@
+/*
+ Checks that the upload engine turns down a body that would not reach the device as one
+ contiguous image: a chunk plan with a gap or one going back has to fail the upload, the
+ intact plan has to go through verified. Run by ctest.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "ath3k-sim.h"
+#include "ath3k-1fw-plan.h"
+
+#define SIMTEST_CHUNK_SIZE  4096
+#define SIMTEST_CHUNK       3
+
+extern "C"
+{
+    extern const unsigned char g_bytesFirmware[];              /* ATH3K_FIRMWARE_SIZE */
+}
+
+static const uint8_t g_aSha256[ATH3K_SHA256_SIZE] = { ATH3K_FIRMWARE_SHA256_BYTES };
+static const Ath3kImageDigest g_digestSha256 = { ATH3K_FIRMWARE_CRC32, g_aSha256 };
+
+//
+// RunUpload
+// one simulated dongle through the firmware plans, with the plan of SIMTEST_CHUNK_SIZE
+// replaced by pPlan. true if the result is what the case expects
+//
+static bool RunUpload(const char* pName, bool bZeroCopy, const Ath3kChunkPlan* pPlan, bool bSucceeds)
+{
+    static Ath3kChunkPlan s_aPlans[ATH3K_FIRMWARE_PLANS];
+    memcpy(s_aPlans, g_aFirmwarePlans, sizeof(s_aPlans));
+    for (int iPlan = 0; iPlan < ATH3K_FIRMWARE_PLANS; iPlan++)
+    {
+        if (s_aPlans[iPlan].iChunkSize == SIMTEST_CHUNK_SIZE) s_aPlans[iPlan] = *pPlan;
+    }
+    
+    Ath3kUploadConfig configUpload;
+    memset(&configUpload, 0, sizeof(configUpload));
+    configUpload.pImage = g_bytesFirmware;
+    configUpload.iImageSize = ATH3K_FIRMWARE_SIZE;
+    configUpload.iChunkSize = SIMTEST_CHUNK_SIZE;
+    configUpload.iQueueDepth = 2;
+    configUpload.bZeroCopy = bZeroCopy;
+    configUpload.pDigest = &g_digestSha256;
+    configUpload.pPlans = s_aPlans;
+    configUpload.iPlans = ATH3K_FIRMWARE_PLANS;
+    
+    Ath3kSimLinkConfig configLink;
+    Ath3kSimDevice::GetDefaultLinkConfig(&configLink);
+    Ath3kSimDeviceConfig configDevice;
+    Ath3kSimDevice::GetDefaultConfig(&configDevice);
+    
+    Ath3kSimScheduler scheduler;
+    Ath3kSimLink link;
+    link.Init(&scheduler, &configLink);
+    
+    static Ath3kSimDevice s_device;
+    static Ath3kUploadEngine s_engine;
+    s_device.Init(&scheduler, &link, &configDevice);
+    s_device.StartUpload(&s_engine, &configUpload);
+    while (!s_engine.IsDone() && scheduler.RunNext());
+    
+    bool bUploaded = s_engine.IsDone() && (s_engine.GetResult() == kAth3kSuccess) && s_engine.IsImageVerified() &&
+                     s_device.IsRunningFirmware();
+    bool bFailed = s_engine.IsDone() && (s_engine.GetResult() == kAth3kErrorCorrupt) && !s_device.IsRunningFirmware();
+    bool bPassed = bSucceeds ? bUploaded : bFailed;
+    
+    printf("%-24s %s (result %d, %d bytes received)\n", pName, bPassed ? "ok" : "FAILED", s_engine.GetResult(),
+           s_device.GetReceived());
+    return(bPassed);
+}
+
+int main(void)
+{
+    const Ath3kChunkPlan* pPlan = NULL;
+    for (int iPlan = 0; iPlan < ATH3K_FIRMWARE_PLANS; iPlan++)
+    {
+        if (g_aFirmwarePlans[iPlan].iChunkSize == SIMTEST_CHUNK_SIZE) pPlan = &g_aFirmwarePlans[iPlan];
+    }
+    if ((pPlan == NULL) || (pPlan->iChunks <= SIMTEST_CHUNK + 1))
+    {
+        printf("no plan of %d byte chunks to test with\n", SIMTEST_CHUNK_SIZE);
+        return(1);
+    }
+    
+    static Ath3kPlannedChunk s_aChunks[ATH3K_PLAN_CHUNKS_MAX];
+    Ath3kChunkPlan planBroken = *pPlan;
+    planBroken.pChunks = s_aChunks;
+    
+    int iFailed = 0;
+    
+    //the plan as it is built
+    memcpy(s_aChunks, pPlan->pChunks, pPlan->iChunks * sizeof(Ath3kPlannedChunk));
+    if (!RunUpload("contiguous zerocopy", true, &planBroken, true)) iFailed++;
+    if (!RunUpload("contiguous staged", false, &planBroken, true)) iFailed++;
+    
+    //one chunk that starts a packet past the end of the one before
+    s_aChunks[SIMTEST_CHUNK].iPosition += 64;
+    if (!RunUpload("gap zerocopy", true, &planBroken, false)) iFailed++;
+    if (!RunUpload("gap staged", false, &planBroken, false)) iFailed++;
+    
+    //and one that goes back into the one before
+    s_aChunks[SIMTEST_CHUNK].iPosition -= 128;
+    if (!RunUpload("overlap zerocopy", true, &planBroken, false)) iFailed++;
+    
+    return((iFailed == 0) ? 0 : 1);
+}
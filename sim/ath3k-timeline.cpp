@@ -0,0 +1,172 @@
+/*
+ Chrome trace event export of upload sessions, see ath3k-timeline.h. The format is described
+ in "Trace Event Format" of the Catapult project: "X" events are slices with a duration,
+ "i" events instants and "M" events name the processes and threads.
+ */
+#include <string.h>
+
+#include "ath3k-timeline.h"
+
+#define TIMELINE_LANE_STEPS     0
+#define TIMELINE_LANE_LINK      1
+#define TIMELINE_LANE_SLOTS     2
+
+static const char* g_aStepNames[] =
+{
+    "open", "status", "reset", "configure", "find pipe", "control", "body", "close", "clear stall", "done"
+};
+
+static const char* g_aResultNames[] =
+{
+    "success", "busy", "io", "no device", "no memory", "stall", "timeout", "underrun", "aborted", "corrupt"
+};
+
+static const char* GetResultName(int iResult)
+{
+    return(((iResult >= 0) && (iResult <= kAth3kErrorCorrupt)) ? g_aResultNames[iResult] : "?");
+}
+
+Ath3kTimeline::Ath3kTimeline(void)
+{
+    m_iSessions = 0;
+}
+
+Ath3kUploadObserver* Ath3kTimeline::AddSession(const char* pName)
+{
+    if (m_iSessions >= ATH3K_TIMELINE_SESSIONS_MAX) return(NULL);
+    
+    Session* pSession = &m_aSessions[m_iSessions];
+    memset(pSession->m_szName, 0, sizeof(pSession->m_szName));
+    strncpy(pSession->m_szName, pName, sizeof(pSession->m_szName) - 1);
+    pSession->m_pTimeline = this;
+    pSession->m_iSession = m_iSessions++;
+    pSession->m_uStepStart = 0;
+    pSession->m_iInFlight = 0;
+    pSession->m_uIdleStart = 0;
+    pSession->m_iSlots = 0;
+    
+    return(pSession);
+}
+
+void Ath3kTimeline::AddEvent(int iSession, int iKind, int iLane, uint64_t uStart, uint64_t uEnd, int iArg0, int iArg1,
+                             int iArg2)
+{
+    Event event;
+    event.uStart = uStart;
+    event.uDuration = uEnd - uStart;
+    event.iSession = iSession;
+    event.iKind = iKind;
+    event.iLane = iLane;
+    event.aArgs[0] = iArg0;
+    event.aArgs[1] = iArg1;
+    event.aArgs[2] = iArg2;
+    
+    m_aEvents.push_back(event);
+}
+
+void Ath3kTimeline::Session::StepStarted(int iStep, uint64_t uTime)
+{
+    m_uStepStart = uTime;
+    
+    //the pipeline fills up at the start of the body, that is no bubble
+    if (iStep == kAth3kStepBody) m_uIdleStart = 0;
+}
+
+void Ath3kTimeline::Session::StepFinished(int iStep, int iResult, uint64_t uTime)
+{
+    m_pTimeline->AddEvent(m_iSession, kEventStep, TIMELINE_LANE_STEPS, m_uStepStart, uTime, iStep, iResult);
+}
+
+void Ath3kTimeline::Session::WriteSubmitted(int iSlot, int iPosition, int iLength, uint64_t uTime)
+{
+    if ((m_uIdleStart != 0) && (uTime > m_uIdleStart))
+    {
+        m_pTimeline->AddEvent(m_iSession, kEventIdle, TIMELINE_LANE_LINK, m_uIdleStart, uTime);
+    }
+    m_uIdleStart = 0;
+    
+    m_aSlotStart[iSlot] = uTime;
+    m_aSlotPosition[iSlot] = iPosition;
+    m_aSlotLength[iSlot] = iLength;
+    m_iSlots = (iSlot + 1 > m_iSlots) ? iSlot + 1 : m_iSlots;
+    m_iInFlight++;
+}
+
+void Ath3kTimeline::Session::WriteRefused(int iSlot, uint64_t uTime)
+{
+    m_pTimeline->AddEvent(m_iSession, kEventRefused, TIMELINE_LANE_LINK, uTime, uTime, iSlot);
+}
+
+void Ath3kTimeline::Session::WriteCompleted(int iSlot, int iResult, int iBytesDone, uint64_t uTime)
+{
+    m_pTimeline->AddEvent(m_iSession, kEventChunk, TIMELINE_LANE_SLOTS + iSlot, m_aSlotStart[iSlot], uTime,
+                          m_aSlotPosition[iSlot], m_aSlotLength[iSlot], (iResult == kAth3kSuccess) ? iBytesDone : -iResult);
+    
+    //nothing on the wire until the engine submits again
+    if (--m_iInFlight == 0) m_uIdleStart = uTime;
+}
+
+bool Ath3kTimeline::Write(FILE* pFile) const
+{
+    fprintf(pFile, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    
+    const char* pSeparator = "";
+    for (int iSession = 0; iSession < m_iSessions; iSession++)
+    {
+        const Session* pSession = &m_aSessions[iSession];
+        int iProcess = iSession + 1;
+        
+        fprintf(pFile, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}", pSeparator,
+                iProcess, pSession->m_szName);
+        pSeparator = ",\n";
+        
+        fprintf(pFile, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"steps\"}}",
+                iProcess, TIMELINE_LANE_STEPS);
+        fprintf(pFile, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"link\"}}",
+                iProcess, TIMELINE_LANE_LINK);
+        for (int iSlot = 0; iSlot < pSession->m_iSlots; iSlot++)
+        {
+            fprintf(pFile, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"slot %d\"}}",
+                    iProcess, TIMELINE_LANE_SLOTS + iSlot, iSlot);
+        }
+    }
+    
+    for (size_t uEvent = 0; uEvent < m_aEvents.size(); uEvent++)
+    {
+        const Event* pEvent = &m_aEvents[uEvent];
+        
+        //timestamps are in microseconds
+        fprintf(pFile, "%s{\"pid\":%d,\"tid\":%d,\"ts\":%.3f,", pSeparator, pEvent->iSession + 1, pEvent->iLane,
+                pEvent->uStart / 1e3);
+        pSeparator = ",\n";
+        
+        switch (pEvent->iKind)
+        {
+            case kEventStep:
+                fprintf(pFile, "\"ph\":\"X\",\"dur\":%.3f,\"cat\":\"step\",\"name\":\"%s\",\"args\":{\"result\":\"%s\"}}",
+                        pEvent->uDuration / 1e3, g_aStepNames[pEvent->aArgs[0]], GetResultName(pEvent->aArgs[1]));
+                break;
+            
+            case kEventChunk:
+                fprintf(pFile, "\"ph\":\"X\",\"dur\":%.3f,\"cat\":\"bulk\",\"name\":\"%s\",\"args\":{\"offset\":%d,\"length\":%d,",
+                        pEvent->uDuration / 1e3, (pEvent->aArgs[2] >= 0) ? "chunk" : "chunk failed", pEvent->aArgs[0],
+                        pEvent->aArgs[1]);
+                if (pEvent->aArgs[2] >= 0) fprintf(pFile, "\"done\":%d}}", pEvent->aArgs[2]);
+                else fprintf(pFile, "\"result\":\"%s\"}}", GetResultName(-pEvent->aArgs[2]));
+                break;
+            
+            case kEventIdle:
+                fprintf(pFile, "\"ph\":\"X\",\"dur\":%.3f,\"cat\":\"link\",\"name\":\"idle\"}", pEvent->uDuration / 1e3);
+                break;
+            
+            case kEventRefused:
+                fprintf(pFile, "\"ph\":\"i\",\"s\":\"t\",\"cat\":\"link\",\"name\":\"link busy, retry\",\"args\":{\"slot\":%d}}",
+                        pEvent->aArgs[0]);
+                break;
+        }
+    }
+    
+    fprintf(pFile, "\n]}\n");
+    
+    return(ferror(pFile) == 0);
+}
@@ -0,0 +1,82 @@
+/* Ath3kTimeline class */
+#ifndef __ATH3K_TIMELINE__
+#define __ATH3K_TIMELINE__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <vector>
+
+#include "ath3k-engine.h"
+
+#define ATH3K_TIMELINE_SESSIONS_MAX 32
+#define ATH3K_TIMELINE_NAME_SIZE    32
+
+//
+// records upload sessions through the observer of the engine and writes them out as Chrome
+// trace events (JSON), which chrome://tracing and ui.perfetto.dev open. every session is a
+// process with a lane for the steps, one for the link - idle gaps in the body and writes the
+// link refused - and one per slot with the chunks in flight
+//
+class Ath3kTimeline
+{
+private:
+    enum
+    {
+        kEventStep = 0,
+        kEventChunk,
+        kEventIdle,
+        kEventRefused
+    };
+    
+    struct Event
+    {
+        uint64_t uStart;
+        uint64_t uDuration;
+        int iSession;
+        int iKind;
+        int iLane;
+        int aArgs[3];
+    };
+    
+    class Session : public Ath3kUploadObserver
+    {
+    public:
+        Ath3kTimeline* m_pTimeline;
+        int m_iSession;
+        char m_szName[ATH3K_TIMELINE_NAME_SIZE];
+        
+        uint64_t m_uStepStart;
+        uint64_t m_aSlotStart[ATH3K_QUEUE_DEPTH_MAX];
+        int m_aSlotPosition[ATH3K_QUEUE_DEPTH_MAX];
+        int m_aSlotLength[ATH3K_QUEUE_DEPTH_MAX];
+        int m_iInFlight;
+        uint64_t m_uIdleStart;      //0 while the link is not idle, or before the first write
+        int m_iSlots;
+        
+        virtual void StepStarted(int iStep, uint64_t uTime);
+        virtual void StepFinished(int iStep, int iResult, uint64_t uTime);
+        virtual void WriteSubmitted(int iSlot, int iPosition, int iLength, uint64_t uTime);
+        virtual void WriteRefused(int iSlot, uint64_t uTime);
+        virtual void WriteCompleted(int iSlot, int iResult, int iBytesDone, uint64_t uTime);
+    };
+    
+    Session m_aSessions[ATH3K_TIMELINE_SESSIONS_MAX];
+    int m_iSessions;
+    std::vector<Event> m_aEvents;
+    
+    void AddEvent(int iSession, int iKind, int iLane, uint64_t uStart, uint64_t uEnd, int iArg0 = 0, int iArg1 = 0,
+                  int iArg2 = 0);
+
+public:
+    Ath3kTimeline(void);
+    
+    //the observer to put into Ath3kUploadConfig for one session, NULL when they ran out
+    Ath3kUploadObserver* AddSession(const char* pName);
+    
+    int GetEventCount(void) const { return((int)m_aEvents.size()); }
+    
+    bool Write(FILE* pFile) const;
+};
+
+#endif //__ATH3K_TIMELINE__
@@ -0,0 +1,84 @@
+#!/usr/bin/env python
+#
+# fwembed.py
+# build step for the firmware embedded in the kext. ath3k-1fw.S pulls the raw image
+# (or the LZ4 packed one) in with .incbin, this script writes what goes with it:
+#
+#   ath3k-1fw.lz            the packed image, see tools/fwpack.py
+#   ath3k-1fw-manifest.h    size, checksums, DFU header and version of the image; the
+#                           driver checks the upload against the checksums as it goes
+#                           out, and the header against the size when it is built
+#
+# usage: fwembed.py [--check] [--version <version>] <ath3k-1fw.bin> <output directory>
+#
+# --check writes nothing and fails if the files in the output directory are not the ones
+# the image gives, so a stale or edited manifest cannot pass the checks of the driver
+#
+# like fwpack.py it runs on python 2.7 as well as 3
+#
+import argparse
+import binascii
+import hashlib
+import os
+import sys
+
+import fwpack
+
+
+def write_if_changed(path, data):
+    # leave the timestamps alone when nothing changed so the kext is not rebuilt
+    if os.path.exists(path) and open(path, 'rb').read() == data:
+        return
+    open(path, 'wb').write(data)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--check', action='store_true', help='compare with the output directory instead of writing it')
+    parser.add_argument('--version', help='firmware version, defaults to the name of the image')
+    parser.add_argument('firmware')
+    parser.add_argument('output')
+    args = parser.parse_args()
+
+    firmware = bytearray(open(args.firmware, 'rb').read())
+    packed = fwpack.pack(firmware)
+    sha256 = bytearray(hashlib.sha256(firmware).digest())
+
+    name = os.path.splitext(os.path.basename(args.firmware))[0]
+    version = args.version or name
+
+    manifest = '\n'.join([
+        '/* generated by tools/fwembed.py from %s - do not edit */' % os.path.basename(args.firmware),
+        '#ifndef ATH3K_1FW_MANIFEST',
+        '#define ATH3K_1FW_MANIFEST ',
+        '',
+        '#define ATH3K_FIRMWARE_VERSION          "%s"' % version,
+        '#define ATH3K_FIRMWARE_SIZE             %d' % len(firmware),
+        '#define ATH3K_FIRMWARE_CRC32            0x%08X' % (binascii.crc32(firmware) & 0xFFFFFFFF),
+        '#define ATH3K_FIRMWARE_SHA256           "%s"' % binascii.hexlify(sha256).decode('ascii'),
+        '#define ATH3K_FIRMWARE_SHA256_BYTES     %s' % ', '.join('0x%02x' % byte for byte in sha256),
+        '#define ATH3K_FIRMWARE_COMPRESSED_SIZE  %d' % len(packed),
+        '#define ATH3K_FIRMWARE_HEADER_BYTES     %s' % ', '.join('0x%02x' % byte for byte in firmware[:20]),
+        '',
+        '#endif',
+        ''])
+
+    outputs = [(os.path.join(args.output, name + '.lz'), packed),
+               (os.path.join(args.output, name + '-manifest.h'), manifest.encode())]
+
+    if args.check:
+        stale = [path for path, data in outputs if not os.path.exists(path) or open(path, 'rb').read() != data]
+        for path in stale:
+            print('fwembed.py: %s does not match %s, run tools/fwembed.py' % (path, args.firmware))
+        if stale:
+            sys.exit(1)
+        print('fwembed.py: %s checked, %d bytes' % (version, len(firmware)))
+        return
+
+    for path, data in outputs:
+        write_if_changed(path, data)
+    print('fwembed.py: %s %d bytes, %d packed' % (version, len(firmware), len(packed)))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,136 @@
+#!/usr/bin/env python
+#
+# fwpack.py
+# compresses the AR3011 firmware for kexts built with ATH3K_COMPRESSED_FIRMWARE=1.
+# tools/fwembed.py runs it as part of the build, it can also be used on its own.
+#
+# the output is a plain LZ4 block (token, literals, 16 bit little endian offset, match
+# length) with matches limited to the last 64 KB so Ath3kFirmwareDecoder can expand it
+# chunk by chunk into the transfer buffers with a 64 KB history window.
+#
+# usage: fwpack.py <ath3k-1fw.bin> <ath3k-1fw.lz>
+#
+# runs on python 2.7 as well as 3, the Xcode of 10.7 and 10.8 has no python3. the image is
+# handled as a bytearray so indexing it gives numbers on both
+#
+import sys
+
+WINDOW_SIZE = 65535
+MIN_MATCH = 4
+CHAIN_DEPTH = 64
+
+
+def write_length(out, length):
+    while length >= 255:
+        out.append(255)
+        length -= 255
+    out.append(length)
+
+
+def emit_sequence(out, data, literal_start, literal_end, match_length, match_offset):
+    literal_length = literal_end - literal_start
+    token = min(literal_length, 15) << 4
+    if match_length:
+        token |= min(match_length - MIN_MATCH, 15)
+    out.append(token)
+    if literal_length >= 15:
+        write_length(out, literal_length - 15)
+    out.extend(data[literal_start:literal_end])
+    if match_length:
+        out.append(match_offset & 0xFF)
+        out.append(match_offset >> 8)
+        if match_length - MIN_MATCH >= 15:
+            write_length(out, match_length - MIN_MATCH - 15)
+
+
+def compress(data):
+    out = bytearray()
+    chains = {}
+    size = len(data)
+    position = 0
+    anchor = 0
+
+    # like lz4 the last bytes always go out as literals
+    limit = size - 5
+    while position + MIN_MATCH <= limit:
+        key = bytes(data[position:position + MIN_MATCH])
+        best_length = 0
+        best_offset = 0
+        for candidate in reversed(chains.get(key, [])[-CHAIN_DEPTH:]):
+            if position - candidate > WINDOW_SIZE:
+                break
+            length = MIN_MATCH
+            while position + length < limit and data[candidate + length] == data[position + length]:
+                length += 1
+            if length > best_length:
+                best_length = length
+                best_offset = position - candidate
+        chains.setdefault(key, []).append(position)
+
+        if best_length >= MIN_MATCH:
+            emit_sequence(out, data, anchor, position, best_length, best_offset)
+            for skipped in range(position + 1, position + best_length):
+                chains.setdefault(bytes(data[skipped:skipped + MIN_MATCH]), []).append(skipped)
+            position += best_length
+            anchor = position
+        else:
+            position += 1
+
+    emit_sequence(out, data, anchor, size, 0, 0)
+    return bytes(out)
+
+
+def decompress(packed, size):
+    packed = bytearray(packed)
+    out = bytearray()
+    position = 0
+    while len(out) < size:
+        token = packed[position]
+        position += 1
+        literal_length = token >> 4
+        if literal_length == 15:
+            while True:
+                value = packed[position]
+                position += 1
+                literal_length += value
+                if value != 255:
+                    break
+        out.extend(packed[position:position + literal_length])
+        position += literal_length
+        if len(out) >= size:
+            break
+        offset = packed[position] | (packed[position + 1] << 8)
+        position += 2
+        match_length = (token & 15) + MIN_MATCH
+        if (token & 15) == 15:
+            while True:
+                value = packed[position]
+                position += 1
+                match_length += value
+                if value != 255:
+                    break
+        for _ in range(match_length):
+            out.append(out[-offset])
+    return bytes(out)
+
+
+def pack(firmware):
+    firmware = bytearray(firmware)
+    packed = compress(firmware)
+    if decompress(packed, len(firmware)) != firmware:
+        sys.exit('fwpack.py: round trip failed')
+    return packed
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit('usage: fwpack.py <ath3k-1fw.bin> <ath3k-1fw.lz>')
+
+    firmware = open(sys.argv[1], 'rb').read()
+    packed = pack(firmware)
+    open(sys.argv[2], 'wb').write(packed)
+    print('fwpack.py: %d -> %d bytes' % (len(firmware), len(packed)))
+
+
+if __name__ == '__main__':
+    main()
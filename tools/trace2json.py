@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+#
+# trace2json.py
+# turns the trace the kext writes to the system log (DumpTrace, see ath3k-trace.h) into
+# Chrome trace events, laid out like the timelines of ath3k-simrun -j: a process per
+# device, a lane for the steps, one for the link with the idle gaps in the body and one
+# per slot with the bulk writes in flight. the bulk writes are only in the trace with
+# TraceLevel 2 in the personality.
+#
+# usage: trace2json.py <system.log or output of log show> <timeline.json>
+#
+import json
+import re
+import sys
+
+LINE = re.compile(r'DumpTrace -> \[(\d+)\.(\d+)\] (\w+) ([0-9a-f]{8}): (.*)$')
+STEP = re.compile(r'step (\d+) done \((\d+)\)')
+SUBMITTED = re.compile(r'bulk write queued on slot (\d+), (\d+) bytes')
+COMPLETED = re.compile(r'bulk write on slot (\d+) done \((\d+)\), (\d+) bytes')
+
+STEP_NAMES = ['open', 'status', 'reset', 'configure', 'find pipe', 'control', 'body', 'close', 'clear stall', 'done']
+STEP_CONTROL = 5
+STEP_BODY = 6
+STEP_CLEAR_STALL = 8
+
+LANE_STEPS = 0
+LANE_LINK = 1
+LANE_SLOTS = 2
+
+
+class Device:
+    def __init__(self, pid):
+        self.pid = pid
+        self.step_start = None
+        self.in_body = False
+        self.slots = {}
+        self.in_flight = 0
+        self.idle_start = None
+        self.last_complete = None
+        self.lanes = set()
+        self.events = []
+
+    def slice(self, lane, name, start, end, cat, args=None):
+        event = {'pid': self.pid, 'tid': lane, 'ts': start, 'ph': 'X', 'dur': end - start, 'cat': cat, 'name': name}
+        if args:
+            event['args'] = args
+        self.events.append(event)
+
+    def step_done(self, step, result, time):
+        # the kext only records the end of a step, it started where the one before ended.
+        # the body has no record of its own, it ends with the last write before the next step
+        if self.in_body and self.last_complete is not None:
+            self.slice(LANE_STEPS, STEP_NAMES[STEP_BODY], self.step_start, self.last_complete, 'step')
+            self.step_start = self.last_complete
+        start = self.step_start if self.step_start is not None else time
+        self.slice(LANE_STEPS, STEP_NAMES[step], start, time, 'step', {'result': result})
+        self.step_start = time
+        self.in_body = result == 0 and step in (STEP_CONTROL, STEP_CLEAR_STALL)
+
+    def submitted(self, slot, length, time):
+        if self.idle_start is not None and time > self.idle_start:
+            self.slice(LANE_LINK, 'idle', self.idle_start, time, 'link')
+        self.idle_start = None
+        self.slots[slot] = (time, length)
+        self.lanes.add(slot)
+        self.in_flight += 1
+
+    def completed(self, slot, result, done, time):
+        if slot not in self.slots:
+            return
+        start, length = self.slots.pop(slot)
+        args = {'length': length, 'done': done}
+        if result:
+            args['result'] = result
+        self.slice(LANE_SLOTS + slot, 'chunk' if result == 0 else 'chunk failed', start, time, 'bulk', args)
+        self.in_flight -= 1
+        if self.in_flight == 0:
+            self.idle_start = time
+        self.last_complete = time
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.stderr.write('usage: trace2json.py <log> <timeline.json>\n')
+        return 2
+
+    devices = {}
+    with open(sys.argv[1], errors='replace') as log:
+        for line in log:
+            match = LINE.search(line)
+            if not match:
+                continue
+            time = int(match.group(1)) * 1000000 + int(match.group(2))
+            location, message = match.group(4), match.group(5)
+            device = devices.setdefault(location, Device(len(devices) + 1))
+
+            if message == 'control request sent':
+                device.step_done(STEP_CONTROL, 0, time)
+            elif STEP.match(message):
+                step, result = STEP.match(message).groups()
+                device.step_done(int(step), int(result), time)
+            elif SUBMITTED.match(message):
+                slot, length = SUBMITTED.match(message).groups()
+                device.submitted(int(slot), int(length), time)
+            elif COMPLETED.match(message):
+                slot, result, done = COMPLETED.match(message).groups()
+                device.completed(int(slot), int(result), int(done), time)
+
+    events = []
+    for location, device in devices.items():
+        events.append({'name': 'process_name', 'ph': 'M', 'pid': device.pid, 'args': {'name': 'device ' + location}})
+        lanes = [(LANE_STEPS, 'steps'), (LANE_LINK, 'link')]
+        lanes += [(LANE_SLOTS + slot, 'slot %d' % slot) for slot in sorted(device.lanes)]
+        for lane, name in lanes:
+            events.append({'name': 'thread_name', 'ph': 'M', 'pid': device.pid, 'tid': lane, 'args': {'name': name}})
+        events.extend(device.events)
+
+    with open(sys.argv[2], 'w') as out:
+        json.dump({'displayTimeUnit': 'ns', 'traceEvents': events}, out, indent=0)
+
+    print('%d devices, %d events' % (len(devices), len(events)))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())